@@ -0,0 +1,206 @@
+#include "accessLog.h"
+#include "logging.h"
+
+#include <cstdio>
+#include <cstring>
+#include <condition_variable>
+#include <ctime>
+#include <mutex>
+#include <thread>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define ACCESS_LOG_BYTES (static_cast<std::size_t>(ACCESS_LOG_FILE_MB) * 1024 * 1024)
+
+namespace {
+
+/*
+    One mapped log file. Writers claim slots with next.fetch_add, and hold writers up while they
+    copy into theirs so a rotation knows when it's safe to unmap.
+    There are only ever two of these, taking turns: the live one, and the one the rotator thread is
+    retiring or getting ready as the next file. A writer still holding a pointer to one that has since
+    been retired only touches its counters, sees it isn't current any more and backs off.
+*/
+struct Segment {
+    char *base = nullptr;
+    std::size_t capacity = 0; // records
+    std::atomic<uint64_t> next{0};
+    std::atomic<int> writers{0};
+
+    AccessRecord *slot(uint64_t index) {
+        return reinterpret_cast<AccessRecord*>(base + sizeof(AccessLogHeader)) + index;
+    }
+};
+
+std::string logPath;
+std::string nextPath; // PATH.next, where the next file waits until it's needed
+Segment segments[2];
+std::atomic<Segment*> current{nullptr};
+std::atomic<Segment*> spare{nullptr};   // mapped at nextPath and ready to go, or null while it's being made
+std::atomic<uint64_t> dropped{0};       // records that came while there was no file to put them in
+
+// the appender that swaps files hands the full one over to the rotator thread here.
+std::mutex rotateLock;
+std::condition_variable rotateWakeup;
+Segment *retired = nullptr; // guarded by rotateLock
+
+uint64_t realtimeNs() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000000000ull + static_cast<uint64_t>(now.tv_nsec);
+}
+
+// PATH.3 -> PATH.4, PATH.2 -> PATH.3, ..., PATH -> PATH.1 (whatever was in PATH.KEEP is gone).
+void shiftFiles() {
+    for (int i = ACCESS_LOG_KEEP; i >= 1; i--) {
+        std::string from = (i == 1) ? logPath : logPath + "." + std::to_string(i - 1);
+        std::string to = logPath + "." + std::to_string(i);
+        if (rename(from.c_str(), to.c_str()) < 0 && errno != ENOENT) {
+            WARNING << "could not rotate " << from << " to " << to << ": " << strerror(errno) << ENDL;
+        }
+    }
+}
+
+/*
+    Create the file at path at its full size and map it into segment. Allocated up front rather than
+    left sparse, so running out of disk is an error here and not a SIGBUS in the middle of a request later on.
+*/
+bool mapSegment(Segment &segment, const std::string &path) {
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        ERROR << "could not create access log " << path << ": " << strerror(errno) << ENDL;
+        return false;
+    }
+    int err = posix_fallocate(fd, 0, static_cast<off_t>(ACCESS_LOG_BYTES));
+    if (err != 0) {
+        ERROR << "could not allocate " << ACCESS_LOG_FILE_MB << "MB for access log " << path << ": "
+              << strerror(err) << ENDL;
+        close(fd);
+        return false;
+    }
+    void *mapped = mmap(nullptr, ACCESS_LOG_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps the file
+    if (mapped == MAP_FAILED) {
+        ERROR << "could not map access log " << path << ": " << strerror(errno) << ENDL;
+        return false;
+    }
+
+    segment.base = static_cast<char*>(mapped);
+    segment.capacity = (ACCESS_LOG_BYTES - sizeof(AccessLogHeader)) / sizeof(AccessRecord);
+    segment.next.store(0);
+
+    AccessLogHeader header{};
+    std::memcpy(header.magic, ACCESS_LOG_MAGIC, sizeof(header.magic));
+    header.version = ACCESS_LOG_VERSION;
+    header.recordSize = sizeof(AccessRecord);
+    header.createdNs = realtimeNs();
+    std::memcpy(segment.base, &header, sizeof(header));
+    return true;
+}
+
+/*
+    full ran out of slots: switch to the spare (the first thread to get here does, the rest find it
+    already done) and leave the renaming and unmapping to the rotator thread.
+    False if there's no spare ready, the record is dropped rather than anyone waiting for one.
+*/
+bool rotate(Segment *full) {
+    Segment *next = spare.load();
+    if (!next) return false;
+    if (!current.compare_exchange_strong(full, next)) return true; // someone beat us to it
+    spare.store(nullptr);
+    {
+        std::lock_guard<std::mutex> guard(rotateLock);
+        retired = full;
+    }
+    rotateWakeup.notify_one();
+    return true;
+}
+
+/*
+    The rotator thread: keeps the next file made and mapped ahead of time, and once the live one has
+    been swapped out, moves the files along, unmaps the full one and makes that the next spare.
+    All the slow parts (renames, fallocate, mmap, munmap) happen here, never on a serving thread.
+*/
+void rotatorMain(Segment *free) {
+    while (1) {
+        if (mapSegment(*free, nextPath)) {
+            spare.store(free);
+        } else {
+            ERROR << "access log will stop when " << logPath << " is full, could not make the next file" << ENDL;
+        }
+
+        Segment *full;
+        {
+            std::unique_lock<std::mutex> guard(rotateLock);
+            rotateWakeup.wait(guard, [] { return retired != nullptr; });
+            full = retired;
+            retired = nullptr;
+        }
+
+        shiftFiles();
+        if (rename(nextPath.c_str(), logPath.c_str()) < 0) {
+            WARNING << "could not rename " << nextPath << " to " << logPath << ": " << strerror(errno) << ENDL;
+        }
+        while (full->writers.load() != 0) std::this_thread::yield();
+        munmap(full->base, ACCESS_LOG_BYTES);
+        full->base = nullptr;
+        DEBUG << "access log rotated after " << full->capacity << " records" << ENDL;
+
+        uint64_t lost = dropped.exchange(0);
+        if (lost > 0) WARNING << "access log dropped " << lost << " records while the next file wasn't ready" << ENDL;
+        free = full;
+    }
+}
+
+} // namespace
+
+bool openAccessLog(const std::string &path) {
+    logPath = path;
+    nextPath = path + ".next";
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0) shiftFiles(); // never overwrite the last run's log
+
+    if (!mapSegment(segments[0], logPath)) return false;
+    current.store(&segments[0]);
+    accessLogOn = true;
+    std::thread(rotatorMain, &segments[1]).detach();
+    INFO << "access log: " << path << " (" << segments[0].capacity << " records per file, keeping "
+         << ACCESS_LOG_KEEP << " old ones)" << ENDL;
+    return true;
+}
+
+void appendAccess(const AccessRecord &record) {
+    while (1) {
+        Segment *segment = current.load();
+        if (!segment) return;
+
+        // announce ourselves, then make sure it's still the live one (rotate() swaps first, then waits).
+        segment->writers.fetch_add(1);
+        if (current.load() != segment) {
+            segment->writers.fetch_sub(1);
+            continue;
+        }
+
+        uint64_t index = segment->next.fetch_add(1, std::memory_order_relaxed);
+        if (index < segment->capacity) {
+            AccessRecord *slot = segment->slot(index);
+            // everything but timeNs, then timeNs: a reader never sees a record that's half there.
+            std::memcpy(reinterpret_cast<char*>(slot) + sizeof(slot->timeNs),
+                        reinterpret_cast<const char*>(&record) + sizeof(record.timeNs),
+                        sizeof(record) - sizeof(record.timeNs));
+            __atomic_store_n(&slot->timeNs, record.timeNs, __ATOMIC_RELEASE);
+            segment->writers.fetch_sub(1);
+            return;
+        }
+
+        segment->writers.fetch_sub(1);
+        if (!rotate(segment)) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+    }
+}
@@ -0,0 +1,69 @@
+#ifndef ACCESSLOG_H
+#define ACCESSLOG_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+/*
+    Per-request access log, written as fixed size binary records straight into a memory mapped file.
+    Appending one is a fetch_add for the slot and a 128 byte copy: no formatting, no lock, no syscall.
+    A background thread keeps the next file created and mapped ahead of time (PATH.next), so when
+    the live one is full the appenders just switch to that one; the thread then renames the full one
+    to PATH.1 (PATH.1 to PATH.2 and so on, ACCESS_LOG_KEEP of them) and unmaps it.
+    accessLogDecode turns the files back into text/CSV and statistics.
+
+    File layout: one AccessLogHeader, then AccessRecords back to back. The file is preallocated at its
+    full size, so the slots after the last record written are all zero (timeNs == 0: empty slot).
+*/
+
+#define ACCESS_LOG_FILE_MB 64     // size of each log file before it rotates
+#define ACCESS_LOG_KEEP 4         // rotated files kept around (PATH.1 ... PATH.4)
+#define ACCESS_LOG_MAGIC "WSACCLG1"
+#define ACCESS_LOG_VERSION 1
+#define ACCESS_PATH_MAX 90        // request paths longer than this are cut (ACCESS_PATH_CUT)
+#define ACCESS_METHOD_MAX 8
+
+enum AccessFlags {
+    ACCESS_ABORTED = 1,   // the connection went away before the whole response was sent
+    ACCESS_KEEPALIVE = 2, // the connection stayed open after this response
+    ACCESS_PATH_CUT = 4   // path is only the first ACCESS_PATH_MAX bytes of the target
+};
+
+struct AccessLogHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+    uint64_t createdNs;   // CLOCK_REALTIME, when the file was started
+    char reserved[104];
+};
+
+struct AccessRecord {
+    uint64_t timeNs;      // CLOCK_REALTIME when the response finished. Written last: 0 means no record (yet).
+    uint64_t bytes;       // bytes of the response that made it to the socket, header included
+    uint32_t latencyUs;   // request parsed -> response sent
+    uint32_t peerAddr;    // IPv4, network byte order
+    uint16_t peerPort;    // host byte order
+    uint16_t status;
+    uint8_t flags;        // AccessFlags
+    uint8_t pathLen;
+    char method[ACCESS_METHOD_MAX]; // not terminated when all 8 are used
+    char path[ACCESS_PATH_MAX];
+};
+
+static_assert(sizeof(AccessLogHeader) == 128, "access log header is 128 bytes on disk");
+static_assert(sizeof(AccessRecord) == 128, "access log records are 128 bytes on disk");
+
+// set once by openAccessLog() at startup, read-only after that.
+inline bool accessLogOn = false;
+
+/*
+    Start logging to path (an existing file there is rotated out of the way first).
+    Returns false, with the reason already logged, if the file can't be created and mapped.
+*/
+bool openAccessLog(const std::string &path);
+
+// Copy one finished record (timeNs already set) into the log. Safe from any number of threads.
+void appendAccess(const AccessRecord &record);
+
+#endif
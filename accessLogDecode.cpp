@@ -0,0 +1,210 @@
+/*
+    accessLogDecode: turn the server's binary access log (-a FILE) back into something readable.
+    Prints every record as text or CSV, or with -s a summary instead: status codes, bytes,
+    latency percentiles and the busiest paths.
+
+    make accessLogDecode && ./accessLogDecode [-f text|csv] [-s] FILE [FILE...]
+    (give rotated files oldest first: access.log.2 access.log.1 access.log)
+*/
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include "accessLog.h"
+
+struct Summary {
+    uint64_t records = 0;
+    uint64_t bytes = 0;
+    uint64_t aborted = 0;
+    uint64_t keepAlive = 0;
+    uint64_t firstNs = 0;
+    uint64_t lastNs = 0;
+    std::map<int, uint64_t> statuses;
+    std::unordered_map<std::string, uint64_t> paths;
+    std::vector<uint32_t> latencies;
+};
+
+static std::string fieldText(const char *text, std::size_t max) {
+    return std::string(text, strnlen(text, max));
+}
+
+// "2026-10-16T22:57:12.123456Z"
+static std::string timestamp(uint64_t ns) {
+    time_t seconds = static_cast<time_t>(ns / 1000000000ull);
+    struct tm parts;
+    gmtime_r(&seconds, &parts);
+    char text[48];
+    std::size_t len = strftime(text, sizeof(text), "%Y-%m-%dT%H:%M:%S", &parts);
+    snprintf(text + len, sizeof(text) - len, ".%06lluZ", static_cast<unsigned long long>(ns % 1000000000ull / 1000));
+    return text;
+}
+
+static std::string peerText(const AccessRecord &record) {
+    char addr[INET_ADDRSTRLEN];
+    struct in_addr in;
+    in.s_addr = record.peerAddr;
+    inet_ntop(AF_INET, &in, addr, sizeof(addr));
+    return addr;
+}
+
+// quoted, with any quote inside doubled.
+static std::string csvField(const std::string &value) {
+    std::string quoted = "\"";
+    for (char c : value) {
+        if (c == '"') quoted += '"';
+        quoted += c;
+    }
+    return quoted + "\"";
+}
+
+static void printRecord(const AccessRecord &record, bool csv) {
+    std::string path(record.path, std::min<std::size_t>(record.pathLen, ACCESS_PATH_MAX));
+    std::string method = fieldText(record.method, ACCESS_METHOD_MAX);
+    if (csv) {
+        std::cout << timestamp(record.timeNs) << ',' << peerText(record) << ',' << record.peerPort << ','
+                  << csvField(method) << ',' << csvField(path) << ',' << record.status << ','
+                  << record.bytes << ',' << record.latencyUs << ','
+                  << ((record.flags & ACCESS_KEEPALIVE) ? 1 : 0) << ','
+                  << ((record.flags & ACCESS_ABORTED) ? 1 : 0) << ','
+                  << ((record.flags & ACCESS_PATH_CUT) ? 1 : 0) << '\n';
+        return;
+    }
+    std::cout << timestamp(record.timeNs) << ' ' << peerText(record) << ':' << record.peerPort << ' '
+              << (method.empty() ? "-" : method) << ' ' << (path.empty() ? "-" : path)
+              << ((record.flags & ACCESS_PATH_CUT) ? "..." : "") << ' ' << record.status << ' '
+              << record.bytes << "B " << record.latencyUs << "us"
+              << ((record.flags & ACCESS_KEEPALIVE) ? " keep-alive" : "")
+              << ((record.flags & ACCESS_ABORTED) ? " ABORTED" : "") << '\n';
+}
+
+static void addToSummary(Summary &summary, const AccessRecord &record) {
+    if (summary.records == 0 || record.timeNs < summary.firstNs) summary.firstNs = record.timeNs;
+    summary.lastNs = std::max(summary.lastNs, record.timeNs);
+    summary.records++;
+    summary.bytes += record.bytes;
+    if (record.flags & ACCESS_ABORTED) summary.aborted++;
+    if (record.flags & ACCESS_KEEPALIVE) summary.keepAlive++;
+    summary.statuses[record.status]++;
+    summary.paths[std::string(record.path, std::min<std::size_t>(record.pathLen, ACCESS_PATH_MAX))]++;
+    summary.latencies.push_back(record.latencyUs);
+}
+
+static void printSummary(Summary &summary) {
+    if (summary.records == 0) {
+        std::cout << "no records" << std::endl;
+        return;
+    }
+    double seconds = static_cast<double>(summary.lastNs - summary.firstNs) / 1e9;
+    std::cout << "records:    " << summary.records << '\n'
+              << "from:       " << timestamp(summary.firstNs) << '\n'
+              << "to:         " << timestamp(summary.lastNs) << '\n';
+    if (seconds > 0) std::cout << "rate:       " << static_cast<double>(summary.records) / seconds << " req/s\n";
+    std::cout << "bytes sent: " << summary.bytes << " (" << summary.bytes / summary.records << " per response)\n"
+              << "keep-alive: " << summary.keepAlive << '\n'
+              << "aborted:    " << summary.aborted << '\n';
+
+    std::cout << "status:\n";
+    for (const auto &status : summary.statuses) {
+        std::cout << "  " << status.first << ": " << status.second << '\n';
+    }
+
+    std::vector<uint32_t> &lat = summary.latencies;
+    std::sort(lat.begin(), lat.end());
+    auto percentile = [&lat](double p) { return lat[std::min(lat.size() - 1, static_cast<std::size_t>(p * lat.size()))]; };
+    uint64_t total = 0;
+    for (uint32_t value : lat) total += value;
+    std::cout << "latency (us): min " << lat.front() << ", mean " << total / lat.size()
+              << ", p50 " << percentile(0.50) << ", p90 " << percentile(0.90) << ", p99 " << percentile(0.99)
+              << ", p99.9 " << percentile(0.999) << ", max " << lat.back() << '\n';
+
+    std::vector<std::pair<std::string, uint64_t>> paths(summary.paths.begin(), summary.paths.end());
+    std::sort(paths.begin(), paths.end(), [](const auto &a, const auto &b) { return a.second > b.second; });
+    std::cout << "top paths:\n";
+    for (std::size_t i = 0; i < paths.size() && i < 10; i++) {
+        std::cout << "  " << paths[i].second << "  " << (paths[i].first.empty() ? "-" : paths[i].first) << '\n';
+    }
+    std::cout << std::flush;
+}
+
+// Every record in one file, in order. False if it isn't an access log.
+static bool decodeFile(const char *name, bool csv, bool summaryOnly, Summary &summary) {
+    FILE *file = fopen(name, "rb");
+    if (!file) {
+        std::cerr << name << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    AccessLogHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || std::memcmp(header.magic, ACCESS_LOG_MAGIC, sizeof(header.magic)) != 0
+        || header.version != ACCESS_LOG_VERSION || header.recordSize != sizeof(AccessRecord)) {
+        std::cerr << name << ": not an access log (or from a different version of the server)" << std::endl;
+        fclose(file);
+        return false;
+    }
+
+    std::vector<AccessRecord> batch(4096);
+    while (1) {
+        std::size_t got = fread(batch.data(), sizeof(AccessRecord), batch.size(), file);
+        if (got == 0) break;
+        for (std::size_t i = 0; i < got; i++) {
+            // slots are claimed in order but filled concurrently, so an empty one can sit between
+            // written ones when the server stopped (or is still running). Past the end it's all zeros.
+            if (batch[i].timeNs == 0) continue;
+            addToSummary(summary, batch[i]);
+            if (!summaryOnly) printRecord(batch[i], csv);
+        }
+    }
+    fclose(file);
+    return true;
+}
+
+static void usage(const char *prog) {
+    std::cerr << "usage: " << prog << " [-f text|csv] [-s] FILE [FILE...]" << std::endl
+              << "  -f  format of the records (default text)" << std::endl
+              << "  -s  print a summary instead of the records" << std::endl;
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    bool csv = false;
+    bool summaryOnly = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "f:s")) != -1) {
+        switch (opt) {
+        case 'f':
+            if (std::string(optarg) == "csv") {
+                csv = true;
+            } else if (std::string(optarg) != "text") {
+                usage(argv[0]);
+            }
+            break;
+        case 's':
+            summaryOnly = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind >= argc) usage(argv[0]);
+
+    if (csv && !summaryOnly) std::cout << "time,peer,port,method,path,status,bytes,latency_us,keep_alive,aborted,path_cut\n";
+
+    Summary summary;
+    int failed = 0;
+    for (int i = optind; i < argc; i++) {
+        if (!decodeFile(argv[i], csv, summaryOnly, summary)) failed++;
+    }
+    if (summaryOnly) printSummary(summary);
+    std::cout << std::flush;
+    return failed ? 1 : 0;
+}
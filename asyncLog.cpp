@@ -0,0 +1,238 @@
+#include "asyncLog.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <unistd.h>
+
+namespace {
+
+struct LogRecord {
+    uint32_t len;
+    char text[LOG_RECORD_MAX];
+};
+
+/*
+    Single producer (the owning thread), single consumer (the writer). head and tail only ever grow,
+    head - tail is how many records are waiting. Each on its own cache line so the two sides
+    don't keep stealing it from each other.
+*/
+struct LogRing {
+    alignas(64) std::atomic<uint64_t> head{0};
+    alignas(64) std::atomic<uint64_t> tail{0};
+    alignas(64) std::atomic<uint64_t> dropped{0};
+    std::atomic<bool> retired{false}; // owning thread is gone, free it once it's drained
+    LogRecord slots[LOG_RING_SLOTS];
+};
+
+static void writeAll(const char *data, std::size_t len) {
+    while (len > 0) {
+        ssize_t written = write(STDERR_FILENO, data, len);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return; // nowhere left to complain to.
+        }
+        data += written;
+        len -= static_cast<std::size_t>(written);
+    }
+}
+
+class AsyncLogger {
+public:
+    AsyncLogger() : writer(&AsyncLogger::writerLoop, this) {}
+
+    LogRing *addRing() {
+        auto *ring = new LogRing();
+        std::lock_guard<std::mutex> guard(lock);
+        rings.push_back(ring);
+        return ring;
+    }
+
+    void wake() { wakeup.notify_one(); }
+
+    bool running() const { return !stopped.load(); }
+
+    /*
+        A producer about to push a line checks in here first, and leave()s once it's in its ring.
+        False once we've stopped: write the line straight out instead. (Counted in before looking,
+        so stop() can't do its last drain while a push is halfway there.)
+    */
+    bool enter() {
+        pushing.fetch_add(1);
+        if (!stopped.load()) return true;
+        pushing.fetch_sub(1);
+        return false;
+    }
+
+    void leave() { pushing.fetch_sub(1, std::memory_order_release); }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (stopping) return;
+            stopping = true;
+        }
+        stopped.store(true); // from here on lines go straight to stderr
+        wakeup.notify_one();
+        writer.join();
+        // pushes that got in before that are finishing up, then their lines are the last ones.
+        while (pushing.load(std::memory_order_acquire) > 0) std::this_thread::yield();
+        drainAll();
+    }
+
+private:
+    // Copy everything waiting in every ring into batch, writing it out whenever it fills up.
+    // Returns true if there was anything at all.
+    bool drainAll() {
+        std::vector<LogRing*> current;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            current = rings;
+        }
+
+        bool any = false;
+        for (LogRing *ring : current) {
+            uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+            uint64_t head = ring->head.load(std::memory_order_acquire);
+            for (; tail != head; tail++) {
+                const LogRecord &record = ring->slots[tail & (LOG_RING_SLOTS - 1)];
+                if (batchLen + record.len + 1 > sizeof(batch)) flushBatch();
+                std::memcpy(batch + batchLen, record.text, record.len);
+                batchLen += record.len;
+                batch[batchLen++] = '\n';
+                any = true;
+            }
+            ring->tail.store(tail, std::memory_order_release);
+
+            uint64_t dropped = ring->dropped.exchange(0, std::memory_order_relaxed);
+            if (dropped > 0) {
+                char note[96];
+                int len = snprintf(note, sizeof(note), "WARNING: log buffer full, dropped %llu lines (asyncLog.cpp)\n",
+                                   static_cast<unsigned long long>(dropped));
+                if (batchLen + len > sizeof(batch)) flushBatch();
+                std::memcpy(batch + batchLen, note, len);
+                batchLen += len;
+                any = true;
+            }
+        }
+        flushBatch();
+
+        // threads that have exited: their rings go once they're empty.
+        std::lock_guard<std::mutex> guard(lock);
+        for (std::size_t i = 0; i < rings.size(); ) {
+            LogRing *ring = rings[i];
+            if (ring->retired.load(std::memory_order_acquire)
+                && ring->tail.load(std::memory_order_relaxed) == ring->head.load(std::memory_order_acquire)) {
+                delete ring;
+                rings[i] = rings.back();
+                rings.pop_back();
+            } else {
+                i++;
+            }
+        }
+        return any;
+    }
+
+    void flushBatch() {
+        writeAll(batch, batchLen);
+        batchLen = 0;
+    }
+
+    void writerLoop() {
+        while (1) {
+            if (drainAll()) continue; // busy, go straight round again
+
+            std::unique_lock<std::mutex> guard(lock);
+            if (stopping) break;
+            wakeup.wait_for(guard, std::chrono::milliseconds(LOG_FLUSH_MS));
+        }
+        drainAll();
+    }
+
+    std::mutex lock; // guards rings and stopping, never taken by a producer writing a line
+    std::condition_variable wakeup;
+    std::vector<LogRing*> rings;
+    bool stopping = false;
+    std::atomic<bool> stopped{false};
+    std::atomic<int> pushing{0}; // producers between enter() and leave()
+    char batch[LOG_BATCH_BYTES];
+    std::size_t batchLen = 0;
+    std::thread writer;
+};
+
+// Never destroyed: threads still running while the process exits may log after atexit handlers ran.
+AsyncLogger *logger() {
+    static AsyncLogger *instance = []() {
+        auto *created = new AsyncLogger();
+        std::atexit(flushLogs);
+        return created;
+    }();
+    return instance;
+}
+
+// Owns this thread's ring, and hands it back to the writer when the thread exits.
+struct RingHandle {
+    LogRing *ring = nullptr;
+    ~RingHandle() {
+        if (ring) ring->retired.store(true, std::memory_order_release);
+    }
+};
+thread_local RingHandle threadRing;
+
+} // namespace
+
+static void writeLine(const char *text, std::size_t len) {
+    char line[LOG_RECORD_MAX + 1];
+    std::memcpy(line, text, len);
+    line[len] = '\n';
+    writeAll(line, len + 1);
+}
+
+void logSubmit(const char *text, std::size_t len) {
+    AsyncLogger *writer = logger();
+    if (!writer->enter()) {
+        writeLine(text, len);
+        return;
+    }
+
+    if (!threadRing.ring) threadRing.ring = writer->addRing();
+    LogRing *ring = threadRing.ring;
+
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    while (head - ring->tail.load(std::memory_order_acquire) == LOG_RING_SLOTS) {
+        if (LOG_FULL_POLICY.load(std::memory_order_relaxed) == LOG_DROP) {
+            ring->dropped.fetch_add(1, std::memory_order_relaxed);
+            writer->leave();
+            return;
+        }
+        writer->wake();
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+        if (!writer->running()) {
+            // no one's going to make room any more (stop() is waiting on us to drain the rest).
+            writeLine(text, len);
+            writer->leave();
+            return;
+        }
+    }
+
+    LogRecord &record = ring->slots[head & (LOG_RING_SLOTS - 1)];
+    record.len = static_cast<uint32_t>(len);
+    std::memcpy(record.text, text, len);
+    ring->head.store(head + 1, std::memory_order_release);
+    writer->leave();
+
+    // more than half full: don't wait for the writer's nap to end.
+    if (head + 1 - ring->tail.load(std::memory_order_relaxed) > LOG_RING_SLOTS / 2) writer->wake();
+}
+
+void flushLogs() {
+    logger()->stop();
+}
@@ -0,0 +1,33 @@
+#ifndef ASYNCLOG_H
+#define ASYNCLOG_H
+
+#include <atomic>
+#include <cstddef>
+
+#define LOG_RECORD_MAX 512   // one formatted line, longer ones get cut short (ending in "...")
+#define LOG_RING_SLOTS 256   // records per thread waiting for the writer, power of two
+#define LOG_FLUSH_MS 20      // how long the writer naps when there's nothing to write
+#define LOG_BATCH_BYTES (64 * 1024)
+
+/*
+    What a thread does when its ring is full (the writer has fallen behind):
+    drop the line (counted, and reported by the writer later) or wait for room.
+*/
+enum LogFullPolicy {
+    LOG_DROP,
+    LOG_BLOCK
+};
+inline std::atomic<int> LOG_FULL_POLICY{LOG_DROP};
+
+/*
+    Hand one finished line (no newline) to the background writer.
+    Each thread gets its own single-producer ring on first use, so this never takes a lock and never
+    does a syscall: the writer thread collects from every ring and sends them to stderr in batches.
+    After flushLogs() (it runs at exit) lines are written straight to stderr instead.
+*/
+void logSubmit(const char *text, std::size_t len);
+
+// Stop the writer after it has written out everything queued so far.
+void flushLogs();
+
+#endif
@@ -0,0 +1,133 @@
+#include "compression.h"
+
+#include <strings.h>
+#include <zlib.h>
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+const char *codingName(ContentCoding coding) {
+    switch (coding) {
+        case CODING_GZIP: return "gzip";
+        case CODING_BROTLI: return "br";
+        default: return "";
+    }
+}
+
+bool codingAvailable(ContentCoding coding) {
+#ifdef HAVE_BROTLI
+    return coding != CODING_IDENTITY;
+#else
+    return coding == CODING_GZIP;
+#endif
+}
+
+bool worthCompressing(const std::string &contentType, std::size_t size) {
+    if (size < MIN_COMPRESS_BYTES) return false;
+    return contentType.compare(0, 6, "image/") != 0 || contentType.compare(0, 13, "image/svg+xml") == 0;
+}
+
+static bool gzipBody(const std::string &in, std::string &out) {
+    z_stream stream{};
+    // 15 window bits + 16 = write a gzip header/trailer instead of a bare zlib one.
+    if (deflateInit2(&stream, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) return false;
+
+    out.resize(deflateBound(&stream, in.size()));
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+    stream.avail_in = static_cast<uInt>(in.size());
+    stream.next_out = reinterpret_cast<Bytef*>(&out[0]);
+    stream.avail_out = static_cast<uInt>(out.size());
+
+    int result = deflate(&stream, Z_FINISH);
+    out.resize(stream.total_out);
+    deflateEnd(&stream);
+    return result == Z_STREAM_END;
+}
+
+#ifdef HAVE_BROTLI
+static bool brotliBody(const std::string &in, std::string &out) {
+    std::size_t outSize = BrotliEncoderMaxCompressedSize(in.size());
+    if (outSize == 0) return false;
+    out.resize(outSize);
+    if (!BrotliEncoderCompress(BROTLI_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_GENERIC,
+                               in.size(), reinterpret_cast<const uint8_t*>(in.data()),
+                               &outSize, reinterpret_cast<uint8_t*>(&out[0]))) {
+        return false;
+    }
+    out.resize(outSize);
+    return true;
+}
+#endif
+
+bool compressBody(ContentCoding coding, const std::string &in, std::string &out) {
+    switch (coding) {
+        case CODING_GZIP: return gzipBody(in, out);
+#ifdef HAVE_BROTLI
+        case CODING_BROTLI: return brotliBody(in, out);
+#endif
+        default: return false;
+    }
+}
+
+static std::string_view trim(std::string_view text) {
+    while (!text.empty() && (text.front() == ' ' || text.front() == '\t')) text.remove_prefix(1);
+    while (!text.empty() && (text.back() == ' ' || text.back() == '\t')) text.remove_suffix(1);
+    return text;
+}
+
+static bool sameToken(std::string_view a, std::string_view b) {
+    return a.size() == b.size() && strncasecmp(a.data(), b.data(), a.size()) == 0;
+}
+
+// "q=0", "q=0.000" -> true. Anything else (no q, q=0.5, q=1) is a yes.
+static bool isZeroQ(std::string_view params) {
+    while (!params.empty()) {
+        std::size_t semi = params.find(';');
+        std::string_view param = trim(params.substr(0, semi));
+        if (param.size() >= 2 && (param[0] == 'q' || param[0] == 'Q') && param[1] == '=') {
+            for (char c : param.substr(2)) {
+                if (c != '0' && c != '.') return false;
+            }
+            return true;
+        }
+        if (semi == std::string_view::npos) break;
+        params.remove_prefix(semi + 1);
+    }
+    return false;
+}
+
+unsigned acceptedCodings(std::string_view acceptEncoding) {
+    unsigned named = 0;    // codings the header mentions at all
+    unsigned accepted = 0; // ... and doesn't rule out
+    bool star = false;
+
+    while (!acceptEncoding.empty()) {
+        std::size_t comma = acceptEncoding.find(',');
+        std::string_view item = acceptEncoding.substr(0, comma);
+        std::size_t semi = item.find(';');
+        std::string_view coding = trim(item.substr(0, semi));
+        bool ok = (semi == std::string_view::npos) || !isZeroQ(item.substr(semi + 1));
+
+        if (coding == "*") {
+            star = ok;
+        } else {
+            for (int c = CODING_IDENTITY + 1; c < CODING_COUNT; c++) {
+                bool match = sameToken(coding, codingName(static_cast<ContentCoding>(c)))
+                    || (c == CODING_GZIP && sameToken(coding, "x-gzip"));
+                if (!match) continue;
+                named |= CODING_BIT(c);
+                if (ok) accepted |= CODING_BIT(c);
+            }
+        }
+
+        if (comma == std::string_view::npos) break;
+        acceptEncoding.remove_prefix(comma + 1);
+    }
+
+    if (star) {
+        for (int c = CODING_IDENTITY + 1; c < CODING_COUNT; c++) {
+            if (!(named & CODING_BIT(c))) accepted |= CODING_BIT(c);
+        }
+    }
+    return accepted | CODING_BIT(CODING_IDENTITY);
+}
@@ -0,0 +1,38 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#define GZIP_LEVEL 9            // it's done once per file version, so spend the CPU
+#define BROTLI_QUALITY 9        // 10/11 are several times slower again for a couple of percent
+#define MIN_COMPRESS_BYTES 256  // below this the headers cost more than we'd save
+#define MIN_SAVING_PERCENT 10   // a variant has to be at least this much smaller or we don't keep it
+
+// Content-Codings we can hold a cached variant for, in order of preference (best last).
+enum ContentCoding {
+    CODING_IDENTITY = 0,
+    CODING_GZIP,
+    CODING_BROTLI,
+    CODING_COUNT
+};
+
+#define CODING_BIT(coding) (1u << (coding))
+
+const char *codingName(ContentCoding coding); // the Content-Encoding token, "" for identity
+bool codingAvailable(ContentCoding coding);   // compiled in? (brotli is optional, see the Makefile)
+
+// Is it even worth trying? Already compressed formats (jpeg, png, gif) are skipped without a try.
+bool worthCompressing(const std::string &contentType, std::size_t size);
+
+// out = compressed in. false if the codec isn't available or failed.
+bool compressBody(ContentCoding coding, const std::string &in, std::string &out);
+
+/*
+    Accept-Encoding -> bitmask of CODING_BIT()s the client takes. q=0 rules a coding out, "*" covers
+    anything not named. Identity is always in the mask (we never answer 406).
+*/
+unsigned acceptedCodings(std::string_view acceptEncoding);
+
+#endif
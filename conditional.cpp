@@ -0,0 +1,200 @@
+#include "conditional.h"
+
+#include <algorithm>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+#include <unistd.h>
+
+#define HASH_READ_BYTES (256 * 1024)
+
+static uint64_t rotl(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+void ContentHasher::mixWord(uint64_t word) {
+    state ^= rotl(word * 0x87c37b91114253d5ull, 31) * 0x4cf5ad432745937full;
+    state = rotl(state, 27) * 5 + 0x52dce729;
+}
+
+void ContentHasher::update(const char *data, std::size_t len) {
+    total += len;
+    if (tailLen > 0) {
+        std::size_t take = std::min(len, sizeof(tail) - tailLen);
+        std::memcpy(tail + tailLen, data, take);
+        tailLen += take;
+        data += take;
+        len -= take;
+        if (tailLen < sizeof(tail)) return;
+        uint64_t word;
+        std::memcpy(&word, tail, sizeof(word));
+        mixWord(word);
+        tailLen = 0;
+    }
+    while (len >= 8) {
+        uint64_t word;
+        std::memcpy(&word, data, sizeof(word));
+        mixWord(word);
+        data += 8;
+        len -= 8;
+    }
+    std::memcpy(tail, data, len);
+    tailLen = len;
+}
+
+uint64_t ContentHasher::finish() {
+    uint64_t word = 0;
+    std::memcpy(&word, tail, tailLen);
+    mixWord(word ^ total);
+    // murmur3's finaliser, so every input bit reaches every output bit.
+    uint64_t h = state;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+std::string makeEtag(uint64_t hash, const char *coding) {
+    char text[48];
+    if (*coding) {
+        snprintf(text, sizeof(text), "\"%016llx-%s\"", static_cast<unsigned long long>(hash), coding);
+    } else {
+        snprintf(text, sizeof(text), "\"%016llx\"", static_cast<unsigned long long>(hash));
+    }
+    return text;
+}
+
+std::string httpDate(time_t when) {
+    struct tm parts;
+    gmtime_r(&when, &parts);
+    char text[40];
+    strftime(text, sizeof(text), "%a, %d %b %Y %H:%M:%S GMT", &parts);
+    return text;
+}
+
+// Only the IMF-fixdate form ("Sun, 06 Nov 1994 08:49:37 GMT"), anything else is ignored like it wasn't sent.
+bool parseHttpDate(std::string_view text, time_t &when) {
+    char buffer[40];
+    if (text.size() >= sizeof(buffer)) return false;
+    std::memcpy(buffer, text.data(), text.size());
+    buffer[text.size()] = '\0';
+
+    struct tm parts{};
+    const char *end = strptime(buffer, "%a, %d %b %Y %H:%M:%S GMT", &parts);
+    if (!end || *end != '\0') return false;
+    when = timegm(&parts);
+    return when != static_cast<time_t>(-1);
+}
+
+static std::string metadataEtag(const struct stat &st) {
+    ContentHasher hasher;
+    int64_t fields[4] = {static_cast<int64_t>(st.st_ino), static_cast<int64_t>(st.st_size),
+                         static_cast<int64_t>(st.st_mtim.tv_sec), static_cast<int64_t>(st.st_mtim.tv_nsec)};
+    hasher.update(reinterpret_cast<const char*>(fields), sizeof(fields));
+    return makeEtag(hasher.finish());
+}
+
+namespace {
+struct KnownEtag {
+    std::string path;
+    uint64_t size;
+    struct timespec mtime;
+    std::string etag;
+};
+// most recently used at the front, the index points into it.
+std::mutex etagLock;
+std::list<KnownEtag> knownEtags;
+std::unordered_map<std::string, std::list<KnownEtag>::iterator> knownByPath;
+}
+
+std::string etagForFile(const std::string &path, int fd, const struct stat &st, uint64_t hashLimit) {
+    {
+        std::lock_guard<std::mutex> guard(etagLock);
+        auto found = knownByPath.find(path);
+        if (found != knownByPath.end()) {
+            const KnownEtag &known = *found->second;
+            if (known.size == static_cast<uint64_t>(st.st_size)
+                && known.mtime.tv_sec == st.st_mtim.tv_sec && known.mtime.tv_nsec == st.st_mtim.tv_nsec) {
+                knownEtags.splice(knownEtags.begin(), knownEtags, found->second);
+                return known.etag;
+            }
+        }
+    }
+
+    std::string etag;
+    if (static_cast<uint64_t>(st.st_size) > hashLimit) {
+        etag = metadataEtag(st);
+    } else {
+        ContentHasher hasher;
+        std::string buffer(HASH_READ_BYTES, '\0');
+        off_t offset = 0;
+        while (offset < st.st_size) {
+            ssize_t got = pread(fd, &buffer[0], buffer.size(), offset);
+            if (got < 0 && errno == EINTR) continue;
+            if (got <= 0) break;
+            hasher.update(buffer.data(), static_cast<std::size_t>(got));
+            offset += got;
+        }
+        // came up short: the file is changing under us, don't remember anything about this version.
+        if (offset != st.st_size) return metadataEtag(st);
+        etag = makeEtag(hasher.finish());
+    }
+
+    std::lock_guard<std::mutex> guard(etagLock);
+    auto found = knownByPath.find(path);
+    if (found != knownByPath.end()) {
+        // a new version (or another thread got here first): update it in place.
+        KnownEtag &known = *found->second;
+        known.size = static_cast<uint64_t>(st.st_size);
+        known.mtime = st.st_mtim;
+        known.etag = etag;
+        knownEtags.splice(knownEtags.begin(), knownEtags, found->second);
+        return etag;
+    }
+    if (knownEtags.size() >= ETAG_CACHE_MAX) {
+        knownByPath.erase(knownEtags.back().path);
+        knownEtags.pop_back();
+    }
+    knownEtags.push_front(KnownEtag{path, static_cast<uint64_t>(st.st_size), st.st_mtim, etag});
+    knownByPath.emplace(path, knownEtags.begin());
+    return etag;
+}
+
+// Weak comparison (W/ prefixes ignored) over a comma separated list, "*" matches anything.
+static bool etagListMatches(std::string_view list, std::string_view etag) {
+    while (!list.empty()) {
+        std::size_t comma = list.find(',');
+        std::string_view item = list.substr(0, comma);
+        while (!item.empty() && (item.front() == ' ' || item.front() == '\t')) item.remove_prefix(1);
+        while (!item.empty() && (item.back() == ' ' || item.back() == '\t')) item.remove_suffix(1);
+        if (item == "*") return true;
+        if (item.size() > 2 && item[0] == 'W' && item[1] == '/') item.remove_prefix(2);
+        if (item == etag) return true;
+        if (comma == std::string_view::npos) break;
+        list.remove_prefix(comma + 1);
+    }
+    return false;
+}
+
+bool notModified(const HttpRequest &req, std::string_view etag, time_t mtime) {
+    if (req.has(HDR_IF_NONE_MATCH)) return etagListMatches(req.header(HDR_IF_NONE_MATCH), etag);
+
+    time_t since;
+    if (req.has(HDR_IF_MODIFIED_SINCE) && parseHttpDate(req.header(HDR_IF_MODIFIED_SINCE), since)) {
+        return mtime <= since;
+    }
+    return false;
+}
+
+bool ifRangeMatches(const HttpRequest &req, std::string_view etag, time_t mtime) {
+    if (!req.has(HDR_IF_RANGE)) return true;
+    std::string_view value = req.header(HDR_IF_RANGE);
+    if (!value.empty() && value.front() == '"') return value == etag; // strong comparison here
+
+    time_t date;
+    return parseHttpDate(value, date) && date == mtime;
+}
@@ -0,0 +1,57 @@
+#ifndef CONDITIONAL_H
+#define CONDITIONAL_H
+
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <string_view>
+
+#include <sys/stat.h>
+
+#include "httpParser.h"
+
+#define ETAG_CACHE_MAX 4096                 // uncached files we remember an ETag for (least recently used goes first)
+#define ETAG_HASH_MAX_BYTES (256 * 1024)    // with no content cache: bigger than this, the ETag comes from metadata instead
+
+/*
+    Validators for conditional GETs: a strong ETag (a hash of the file's bytes, made once per file
+    version) and Last-Modified (the mtime, to the second).
+*/
+
+// Streaming 64 bit hash, eight bytes per step. Not cryptographic, just quick and well mixed.
+class ContentHasher {
+public:
+    void update(const char *data, std::size_t len);
+    uint64_t finish();
+
+private:
+    void mixWord(uint64_t word);
+
+    uint64_t state = 0x9e3779b97f4a7c15ull;
+    uint64_t total = 0;
+    char tail[8];
+    std::size_t tailLen = 0;
+};
+
+// "\"1f3a...\"" for identity, "\"1f3a...-gzip\"" for a compressed variant (a different representation).
+std::string makeEtag(uint64_t hash, const char *coding = "");
+
+// "Sun, 06 Nov 1994 08:49:37 GMT"
+std::string httpDate(time_t when);
+bool parseHttpDate(std::string_view text, time_t &when);
+
+/*
+    ETag of a file we aren't caching, remembered per path for as long as size and mtime don't move.
+    Up to hashLimit bytes the first request after a change reads the whole file once to hash it (the
+    caller passes the cache's largest entry, so a file has the same ETag cached or not). Anything
+    bigger gets one made from inode/size/mtime: hashing it would hold up the whole reactor.
+*/
+std::string etagForFile(const std::string &path, int fd, const struct stat &st, uint64_t hashLimit);
+
+// If-None-Match (or, without one, If-Modified-Since) says the client's copy is current -> 304.
+bool notModified(const HttpRequest &req, std::string_view etag, time_t mtime);
+
+// No If-Range, or it still matches this version: the Range header stands. Otherwise send the whole file.
+bool ifRangeMatches(const HttpRequest &req, std::string_view etag, time_t mtime);
+
+#endif
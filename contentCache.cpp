@@ -0,0 +1,323 @@
+#include "contentCache.h"
+#include "webServer.h"
+#include "logging.h"
+#include "conditional.h"
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+
+#define WATCH_EVENTS (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE \
+                      | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+static bool sameVersion(const struct stat &st, const CachedFile &file) {
+    return static_cast<uint64_t>(st.st_size) == file.size
+        && st.st_mtim.tv_sec == file.mtime.tv_sec
+        && st.st_mtim.tv_nsec == file.mtime.tv_nsec;
+}
+
+// "/root/data/file1.html" -> "/root/data" (as spelled: dir + "/" + name gives the path back)
+static std::string parentDir(const std::string &path) {
+    std::size_t slash = path.find_last_of('/');
+    if (slash == std::string::npos) return ".";
+    if (slash == 0) return "/";
+    return path.substr(0, slash);
+}
+
+// "/root//data/./" -> "/root/data", what we actually hand inotify.
+static std::string normalDir(const std::string &dir) {
+    std::string normal = std::filesystem::path(dir).lexically_normal().string();
+    while (normal.size() > 1 && normal.back() == '/') normal.pop_back();
+    return normal.empty() ? "." : normal;
+}
+
+/*
+    Compress the body once with everything we have, keep the results that actually came out
+    MIN_SAVING_PERCENT smaller, then build a header per variant. If any variant is kept, every one
+    of them (identity too) says Vary: Accept-Encoding so caches downstream don't mix them up.
+    The ETags come from one hash of the identity body, done here since we have it in memory anyway.
+*/
+static void makeVariants(CachedFile &file) {
+    const std::string &body = file.body();
+    bool varies = false;
+
+    ContentHasher hasher;
+    hasher.update(body.data(), body.size());
+    uint64_t hash = hasher.finish();
+    file.lastModified = httpDate(file.mtime.tv_sec);
+
+    if (worthCompressing(file.contentType, body.size())) {
+        for (int coding = CODING_IDENTITY + 1; coding < CODING_COUNT; coding++) {
+            if (!codingAvailable(static_cast<ContentCoding>(coding))) continue;
+            std::string &encoded = file.variants[coding].body;
+            if (!compressBody(static_cast<ContentCoding>(coding), body, encoded)
+                || encoded.size() * 100 > body.size() * (100 - MIN_SAVING_PERCENT)) {
+                encoded.clear();
+                encoded.shrink_to_fit();
+                continue;
+            }
+            TRACE << file.path << " as " << codingName(static_cast<ContentCoding>(coding)) << ": "
+                  << body.size() << " -> " << encoded.size() << " bytes" << ENDL;
+            varies = true;
+        }
+    }
+
+    file.varies = varies;
+    file.footprint = 0;
+    for (int coding = CODING_IDENTITY; coding < CODING_COUNT; coding++) {
+        CachedVariant &variant = file.variants[coding];
+        file.footprint += variant.body.size();
+        if (coding != CODING_IDENTITY && variant.body.empty()) continue;
+        const char *name = codingName(static_cast<ContentCoding>(coding));
+        variant.etag = makeEtag(hash, name);
+        variant.header = buildFileHeader(file.contentType, variant.body.size(), name, varies,
+                                         validatorLines(variant.etag, file.lastModified));
+    }
+}
+
+ContentCache::ContentCache(std::size_t byteBudget) : budget(byteBudget), maxEntry(byteBudget / 8) {
+    inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    stopFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (inotifyFd < 0 || stopFd < 0) {
+        WARNING << "no change notification for the content cache (" << strerror(errno)
+                << "), falling back to stat() every " << CACHE_REVALIDATE_MS << "ms" << ENDL;
+        if (inotifyFd >= 0) close(inotifyFd);
+        inotifyFd = -1;
+    } else {
+        watcher = std::thread(&ContentCache::watchLoop, this);
+    }
+    DEBUG << "content cache: " << budget << " byte budget, " << maxEntry << " bytes max per file" << ENDL;
+}
+
+ContentCache::~ContentCache() {
+    if (watcher.joinable()) {
+        uint64_t one = 1;
+        if (write(stopFd, &one, sizeof(one)) < 0) {
+            ERROR << "could not stop the cache watcher: " << strerror(errno) << ENDL;
+        }
+        watcher.join();
+    }
+    if (inotifyFd >= 0) close(inotifyFd);
+    if (stopFd >= 0) close(stopFd);
+}
+
+std::shared_ptr<const CachedFile> ContentCache::find(const std::string &path) {
+    std::lock_guard<std::mutex> guard(lock);
+
+    auto entry = entries.find(path);
+    if (entry == entries.end()) return nullptr;
+
+    if (!stillFresh(*entry->second)) {
+        DEBUG << "cache entry for " << path << " is stale, dropping it" << ENDL;
+        eraseLocked(entry);
+        return nullptr;
+    }
+
+    lru.splice(lru.begin(), lru, entry->second); // bump to most recently used
+    TRACE << "cache hit for " << path << ENDL;
+    return entry->second->file;
+}
+
+std::shared_ptr<const CachedFile> ContentCache::insert(const std::string &path, int fd) {
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) return nullptr;
+    if (static_cast<std::size_t>(st.st_size) > maxEntry) return nullptr;
+
+    uint64_t startGeneration;
+    int wd;
+    {
+        // watch before reading, so a write that lands while we read still knocks the entry out.
+        std::lock_guard<std::mutex> guard(lock);
+        wd = watchDirectoryLocked(parentDir(path));
+        startGeneration = generation;
+    }
+
+    auto file = std::make_shared<CachedFile>();
+    file->path = path;
+    file->size = static_cast<uint64_t>(st.st_size);
+    file->mtime = st.st_mtim;
+    file->contentType = contentTypeFor(path);
+    std::string &body = file->variants[CODING_IDENTITY].body;
+    body.resize(file->size);
+
+    std::size_t got = 0;
+    while (got < file->size) {
+        ssize_t chunkRead = pread(fd, &body[got], file->size - got, static_cast<off_t>(got));
+        if (chunkRead < 0 && errno == EINTR) continue;
+        if (chunkRead <= 0) {
+            // error or the file shrank, let the caller deal with the file itself.
+            releaseWatch(wd);
+            return nullptr;
+        }
+        got += static_cast<std::size_t>(chunkRead);
+    }
+
+    // changed while we were reading it? then what we have is a mix of two versions.
+    struct stat after;
+    if (fstat(fd, &after) < 0 || !sameVersion(after, *file)) {
+        releaseWatch(wd);
+        return nullptr;
+    }
+
+    makeVariants(*file);
+
+    std::lock_guard<std::mutex> guard(lock);
+    if (generation != startGeneration) {
+        // something was invalidated while we read, it may have been this file. Serve it, don't keep it.
+        releaseWatchLocked(wd);
+        return file;
+    }
+
+    auto existing = entries.find(path);
+    if (existing != entries.end()) eraseLocked(existing);
+
+    auto watch = watches.find(wd);
+    if (watch == watches.end()) {
+        wd = -1; // (no inotify, or its directory went away while we read: stat() it instead)
+    } else {
+        watch->second.entries++;
+    }
+    lru.push_front(Node{file, std::chrono::steady_clock::now(), wd});
+    entries[path] = lru.begin();
+    bytesUsed += file->footprint;
+
+    while (bytesUsed > budget && !lru.empty()) {
+        DEBUG << "cache full, evicting " << lru.back().file->path << ENDL;
+        eraseLocked(entries.find(lru.back().file->path));
+    }
+
+    DEBUG << "cached " << path << " (" << file->footprint << " bytes, " << bytesUsed << " in use)" << ENDL;
+    return file;
+}
+
+void ContentCache::invalidate(const std::string &path) {
+    std::lock_guard<std::mutex> guard(lock);
+    generation++;
+    auto entry = entries.find(path);
+    if (entry == entries.end()) return;
+    DEBUG << path << " changed on disk, dropping it from the cache" << ENDL;
+    eraseLocked(entry);
+}
+
+void ContentCache::clear() {
+    std::lock_guard<std::mutex> guard(lock);
+    generation++;
+    entries.clear();
+    lru.clear();
+    bytesUsed = 0;
+    // nothing relies on any of the watches now.
+    for (auto &watch : watches) inotify_rm_watch(inotifyFd, watch.first);
+    watches.clear();
+    dirWatches.clear();
+}
+
+/*
+    Watched entries are fresh by definition (the watcher drops them the moment they change).
+    Anything else gets a stat() once it's been CACHE_REVALIDATE_MS since we last looked.
+*/
+bool ContentCache::stillFresh(Node &node) {
+    if (node.wd >= 0) return true;
+
+    auto now = std::chrono::steady_clock::now();
+    if (now - node.checkedAt < std::chrono::milliseconds(CACHE_REVALIDATE_MS)) return true;
+
+    struct stat st;
+    if (stat(node.file->path.c_str(), &st) < 0 || !sameVersion(st, *node.file)) return false;
+    node.checkedAt = now;
+    return true;
+}
+
+void ContentCache::eraseLocked(std::unordered_map<std::string, LruList::iterator>::iterator entry) {
+    int wd = entry->second->wd;
+    bytesUsed -= entry->second->file->footprint;
+    lru.erase(entry->second);
+    entries.erase(entry);
+
+    auto watch = watches.find(wd);
+    if (watch != watches.end() && watch->second.entries > 0) watch->second.entries--;
+    releaseWatchLocked(wd);
+}
+
+/*
+    The watch for dir (added if it's new, under its normalised name), or -1 if inotify won't have it.
+    It only counts once an entry actually gets cached under it, see insert().
+*/
+int ContentCache::watchDirectoryLocked(const std::string &dir) {
+    if (inotifyFd < 0) return -1;
+    auto known = dirWatches.find(dir);
+    if (known != dirWatches.end()) return known->second;
+
+    std::string normal = normalDir(dir);
+    int wd = inotify_add_watch(inotifyFd, normal.c_str(), WATCH_EVENTS);
+    if (wd < 0) {
+        WARNING << "inotify_add_watch(" << normal << ") failed: " << strerror(errno)
+                << ", files there get stat()ed instead" << ENDL;
+        return -1;
+    }
+    // (the same wd again if another spelling of this directory is already watched)
+    watches[wd].spellings.push_back(dir);
+    dirWatches[dir] = wd;
+    return wd;
+}
+
+// Nothing cached relies on watch wd any more (or it never got used): stop watching.
+void ContentCache::releaseWatchLocked(int wd) {
+    auto watch = watches.find(wd);
+    if (watch == watches.end() || watch->second.entries > 0) return;
+    inotify_rm_watch(inotifyFd, wd);
+    for (const std::string &dir : watch->second.spellings) dirWatches.erase(dir);
+    watches.erase(watch);
+}
+
+void ContentCache::releaseWatch(int wd) {
+    std::lock_guard<std::mutex> guard(lock);
+    releaseWatchLocked(wd);
+}
+
+// Background thread: turn inotify events into invalidations until the destructor pokes stopFd.
+void ContentCache::watchLoop() {
+    alignas(struct inotify_event) char buffer[4096];
+    struct pollfd fds[2] = {{inotifyFd, POLLIN, 0}, {stopFd, POLLIN, 0}};
+
+    while (1) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            ERROR << "poll() failed in cache watcher: " << strerror(errno) << ENDL;
+            return;
+        }
+        if (fds[1].revents) return;
+
+        ssize_t len = read(inotifyFd, buffer, sizeof(buffer));
+        if (len <= 0) continue;
+
+        for (char *p = buffer; p < buffer + len; ) {
+            auto *event = reinterpret_cast<struct inotify_event*>(p);
+            p += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                WARNING << "inotify queue overflowed, dropping the whole content cache" << ENDL;
+                clear();
+                continue;
+            }
+
+            std::vector<std::string> spellings;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                auto watch = watches.find(event->wd);
+                if (watch == watches.end()) continue; // (one we removed ourselves)
+                spellings = watch->second.spellings;
+                if (event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+                    // the directory itself went away, forget the watch (a re-created one gets a new watch on insert).
+                    for (const std::string &dir : spellings) dirWatches.erase(dir);
+                    watches.erase(watch);
+                }
+            }
+
+            if (event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+                clear();
+            } else if (event->len > 0) {
+                for (const std::string &dir : spellings) invalidate(dir + "/" + event->name);
+            }
+        }
+    }
+}
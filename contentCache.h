@@ -0,0 +1,121 @@
+#ifndef CONTENTCACHE_H
+#define CONTENTCACHE_H
+
+#include <chrono>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include "compression.h"
+
+#define DEFAULT_CACHE_MB 64          // byte budget for cached file bodies (compressed variants included)
+#define CACHE_REVALIDATE_MS 1000     // without inotify, how stale an entry may get before we stat() it again
+
+// One encoding of a cached file.
+struct CachedVariant {
+    std::string etag;        // each encoding is its own representation, so each has its own
+    std::string header;      // prebuilt 200 status line + headers, minus the Connection: line and blank line
+    std::string body;        // empty if we don't have this encoding (never made, or it didn't help)
+};
+
+/*
+    One file, read in full, plus what we need to answer for it without asking the filesystem.
+    Compressed variants are made once, when the file goes into the cache, never per request.
+*/
+struct CachedFile {
+    std::string path;        // resolved path (what check_for_file hands back), also the cache key
+    CachedVariant variants[CODING_COUNT]; // [CODING_IDENTITY] is the file as is, always there
+    std::string contentType;
+    uint64_t size = 0;       // of the file itself
+    std::size_t footprint = 0; // every variant's body, what counts against the cache budget
+    struct timespec mtime{};
+    std::string lastModified; // mtime as an HTTP-date
+    bool varies = false;      // has compressed variants, so every response says Vary: Accept-Encoding
+
+    const std::string &body() const { return variants[CODING_IDENTITY].body; }
+
+    // The best variant out of `accepted` (a CODING_BIT mask) that we have.
+    const CachedVariant &variantFor(unsigned accepted) const {
+        for (int coding = CODING_COUNT - 1; coding > CODING_IDENTITY; coding--) {
+            if ((accepted & CODING_BIT(coding)) && !variants[coding].body.empty()) return variants[coding];
+        }
+        return variants[CODING_IDENTITY];
+    }
+};
+
+/*
+    Bounded in-memory cache of file bodies, keyed by resolved path, evicting least recently used
+    entries once the byte budget is used up.
+    Staleness is picked up by an inotify watch on every directory we cache something from
+    (a background thread drops entries as their files change), so a hit never touches the filesystem.
+    If inotify isn't available we fall back to re-stat()ing an entry once it's CACHE_REVALIDATE_MS old
+    and dropping it if mtime or size moved.
+    Entries are handed out as shared_ptrs so a response can keep sending one after it's been evicted.
+    Safe to use from several threads.
+*/
+class ContentCache {
+public:
+    explicit ContentCache(std::size_t byteBudget);
+    ~ContentCache();
+
+    // Fresh entry for path, or nullptr if we don't have it (or it just went stale).
+    std::shared_ptr<const CachedFile> find(const std::string &path);
+
+    // Read the already opened file into the cache. nullptr if it's too big to cache or the read failed.
+    std::shared_ptr<const CachedFile> insert(const std::string &path, int fd);
+
+    void invalidate(const std::string &path);
+    void clear();
+
+    std::size_t maxEntryBytes() const { return maxEntry; }
+
+private:
+    struct Node {
+        std::shared_ptr<const CachedFile> file;
+        std::chrono::steady_clock::time_point checkedAt; // last time we confirmed it matches the disk
+        int wd;  // its directory's inotify watch, the watcher thread keeps it honest. -1 if none, it gets stat()ed
+    };
+
+    /*
+        One inotify watch. The kernel hands back the same wd for every spelling of a directory
+        ("data/x" and "data//x" both end up here), so we keep each one a cached path came in with and
+        an invalidation goes out under all of them. Counted by the entries relying on it, the watch
+        goes when the last of them does.
+    */
+    struct DirWatch {
+        std::vector<std::string> spellings;
+        std::size_t entries = 0;
+    };
+    using LruList = std::list<Node>; // front = most recently used
+
+    bool stillFresh(Node &node);
+    void eraseLocked(std::unordered_map<std::string, LruList::iterator>::iterator entry);
+    int watchDirectoryLocked(const std::string &dir);
+    void releaseWatchLocked(int wd);
+    void releaseWatch(int wd);
+    void watchLoop();
+
+    std::size_t budget;
+    std::size_t maxEntry;  // one file may use at most this much of the budget
+    std::size_t bytesUsed = 0;
+    uint64_t generation = 0; // bumped on every invalidation, lets insert() notice one raced with its read
+
+    std::mutex lock;
+    LruList lru;
+    std::unordered_map<std::string, LruList::iterator> entries;
+
+    // change notification
+    int inotifyFd = -1;
+    int stopFd = -1; // eventfd that tells the watcher thread to quit
+    std::unordered_map<int, DirWatch> watches;        // watch descriptor -> the directory it watches
+    std::unordered_map<std::string, int> dirWatches;  // directory, as spelled in a cached path -> watch descriptor
+    std::thread watcher;
+};
+
+#endif
@@ -0,0 +1,187 @@
+#include "coroScheduler.h"
+#include "eventLoop.h"
+#include "logging.h"
+
+#include <sys/epoll.h>
+#include <thread>
+
+AsyncSocket::AsyncSocket(CoroScheduler &scheduler, int fd) : scheduler(scheduler), sockFd(fd) {
+    scheduler.watch(*this);
+}
+
+AsyncSocket::~AsyncSocket() {
+    close(sockFd); // closing also drops it from the epoll set.
+}
+
+CoroScheduler::CoroScheduler() {
+    if ((epollFd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        FATAL << "epoll_create1() failed: " << strerror(errno) << ENDL;
+        exit(-1);
+    }
+}
+
+CoroScheduler::~CoroScheduler() {
+    if (epollFd >= 0) close(epollFd);
+}
+
+// Registered once for everything, edge-triggered: whatever is parked on the socket gets retried on any wakeup.
+void CoroScheduler::watch(AsyncSocket &sock) {
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = &sock;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, sock.fd(), &ev) < 0) {
+        // nothing will ever wake it, so its first parked operation fails instead of hanging forever.
+        ERROR << "epoll_ctl() failed to add fd " << sock.fd() << ": " << strerror(errno) << ENDL;
+    }
+}
+
+// Ran out of time (its deadline was armed, it's always parked by the time the wheel gets a look in).
+static bool timedOut(const Connection &conn, ssize_t result) {
+    if (result != -ETIMEDOUT) return false;
+    static const char *waitingFor[TIMEOUT_KINDS] = {"idle", "sending its request header", "taking its response"};
+    DEBUG << "connection on fd " << conn.fd << " took too long (" << waitingFor[conn.timeoutKind] << "), closing" << ENDL;
+    countTimeout(conn.timeoutKind);
+    return true;
+}
+
+/*
+    The connection, start to finish, as straight-line code: wait for a whole request, queue the
+    response(s) to it (and anything pipelined behind it), push it all out, go again while the
+    connection stays open. The request/response logic is the same as the other drivers'; the
+    coroutine only takes the place of the blocking read()/sendmsg()/sendfile() calls.
+*/
+static Detached serveConnection(CoroScheduler &scheduler, int connfd) {
+    AsyncSocket sock(scheduler, connfd);
+    Connection conn(connfd);
+
+    while (1) {
+        // (a request that was pipelined behind the last one has been waiting since this run started too)
+        conn.readyAt = scheduler.batchStarted();
+        while (!parseBufferedRequest(conn)) {
+            // (the parser gives up with a 431 before a request can outgrow the buffer, so there's always room)
+            conn.recv.compact();
+            if (conn.recv.size() > 0 && headerTimedOut(conn)) co_return;
+            char *dst = conn.recv.writePtr(); // (first, it's what allocates the buffer)
+            armDeadline(scheduler.timers(), conn, &sock, false);
+            ssize_t got = co_await sock.read(dst, conn.recv.writable());
+            if (got == 0) {
+                INFO << "Client Closed Connection (Empty Read)" << ENDL;
+                co_return;
+            }
+            if (got < 0) {
+                if (!timedOut(conn, got)) ERROR << "read() failed: " << strerror(static_cast<int>(-got)) << ENDL;
+                co_return;
+            }
+            conn.recv.commit(static_cast<std::size_t>(got));
+            conn.readyAt = scheduler.batchStarted();
+        }
+        queueResponses(conn);
+
+        // what to send comes from nextWrite (the same as writeResponse), the coroutine only does the waiting.
+        while (1) {
+            WriteStep step;
+            nextWrite(conn, step);
+            if (step.kind == WRITE_FAILED) co_return;
+            if (step.kind == WRITE_DONE) break;
+
+            armDeadline(scheduler.timers(), conn, &sock, true);
+            if (step.kind == WRITE_SENDFILE) {
+                ssize_t sent = co_await sock.sendfile(conn.fileFd, conn.fileOffset, step.sendfileCount);
+                if (sent < 0 && sendfileUnsupported(conn, static_cast<int>(-sent))) continue;
+                if (sent <= 0) {
+                    if (sent == 0) {
+                        // we already promised fileRemaining more bytes in Content-Length.
+                        WARNING << "Unexpected EOF while sending file" << ENDL;
+                    } else if (sent == -EPIPE || sent == -ECONNRESET) {
+                        WARNING << "Client closed connection while sending file." << ENDL;
+                    } else if (!timedOut(conn, sent)) {
+                        ERROR << "sendfile() failed while sending file: " << strerror(static_cast<int>(-sent)) << ENDL;
+                    }
+                    co_return;
+                }
+                consumeSendfile(conn, static_cast<std::size_t>(sent));
+                continue;
+            }
+
+            ssize_t sent = co_await sock.write(step.iov, step.iovCount, step.flags);
+            if (sent < 0) {
+                if (sent == -EPIPE || sent == -ECONNRESET) {
+                    WARNING << "write() failed: connection closed mid-write." << ENDL;
+                } else if (!timedOut(conn, sent)) {
+                    ERROR << "sendmsg() failed: " << strerror(static_cast<int>(-sent)) << ENDL;
+                }
+                co_return;
+            }
+            consumeWritten(conn, static_cast<std::size_t>(sent));
+        }
+
+        if (!conn.keepAlive) co_return;
+        resetRequest(conn);
+    }
+}
+
+// Hands every new connection its own coroutine. Runs for as long as the scheduler does.
+static Detached acceptConnections(CoroScheduler &scheduler, int listenFd) {
+    AsyncSocket listener(scheduler, listenFd);
+    while (1) {
+        ssize_t connfd = co_await listener.accept();
+        if (connfd < 0) {
+            // (running out of fds is handled in accept() itself, this is the odd one-off failure)
+            if (connfd != -ECONNABORTED) ERROR << "accept() failed: " << strerror(static_cast<int>(-connfd)) << ENDL;
+            continue;
+        }
+        TRACE << "accepted connection on fd " << connfd << ENDL;
+        serveConnection(scheduler, static_cast<int>(connfd)); // runs until its first wait, then comes back here
+    }
+}
+
+void CoroScheduler::run(int listenFd) {
+    if (!setNonBlocking(listenFd)) {
+        FATAL << "failed to make listening socket non-blocking: " << strerror(errno) << ENDL;
+        exit(-1);
+    }
+    acceptConnections(*this, listenFd);
+
+    epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        // with any deadline armed, wake up every tick to see to the wheel.
+        int ready = epoll_wait(epollFd, events, MAX_EVENTS, wheel.empty() ? -1 : TIMER_TICK_MS);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            FATAL << "epoll_wait() failed: " << strerror(errno) << ENDL;
+            exit(-1);
+        }
+        batchStart = std::chrono::steady_clock::now();
+
+        // each fd shows up at most once per epoll_wait, so a socket freed by the coroutine we resume
+        // can't come up again further down this batch.
+        for (int i = 0; i < ready; i++) {
+            AsyncSocket &sock = *static_cast<AsyncSocket*>(events[i].data.ptr);
+            IoWait *wait = sock.waiting;
+            if (!wait || !wait->attempt()) continue; // nobody waiting, or it was for the other direction
+            sock.waiting = nullptr;
+            wait->handle.resume();
+        }
+
+        wheel.expire(std::chrono::steady_clock::now(), [](void *owner) {
+            AsyncSocket &sock = *static_cast<AsyncSocket*>(owner);
+            IoWait *wait = sock.waiting;
+            if (!wait) return;
+            sock.waiting = nullptr;
+            wait->result = -ETIMEDOUT;
+            wait->handle.resume(); // (sock is most likely gone after this)
+        });
+    }
+}
+
+void runCoroSchedulers(const std::vector<int> &listenFds) {
+    std::vector<std::thread> threads;
+    for (int listenFd : listenFds) {
+        threads.emplace_back([listenFd] {
+            CoroScheduler scheduler;
+            scheduler.run(listenFd);
+        });
+    }
+    for (auto &thread : threads) thread.join();
+}
@@ -0,0 +1,163 @@
+#ifndef COROSCHEDULER_H
+#define COROSCHEDULER_H
+
+#include <coroutine>
+#include <exception>
+#include <vector>
+
+#include <sys/sendfile.h>
+
+#include "webServer.h"
+
+/*
+    Coroutine driver (-m coro). Every connection is one coroutine that reads like the old blocking
+    code (read the request, send the response, go again) but co_awaits its socket instead of
+    blocking in it, so a few scheduler threads carry thousands of connections.
+
+    An awaited operation is tried straight away. Only if the socket says EAGAIN does the coroutine
+    park on it; epoll (edge-triggered, registered once per socket) wakes the scheduler, which retries
+    the syscall and resumes the coroutine once it actually went through. A coroutine only ever waits
+    on one thing at a time, so a socket has at most one parked operation.
+*/
+
+class AsyncSocket;
+class CoroScheduler;
+
+// A parked operation: the syscall to retry when its socket is ready, and who to resume once it's done.
+struct IoWait {
+    std::coroutine_handle<> handle;
+    ssize_t result = 0; // what the syscall returned, or -errno (-ETIMEDOUT if its deadline ran out first)
+
+    virtual bool attempt() = 0; // true once it went through (result is set), false if it would still block
+    virtual ~IoWait() = default;
+};
+
+class AsyncSocket {
+public:
+    AsyncSocket(CoroScheduler &scheduler, int fd);
+    ~AsyncSocket(); // closes the fd
+
+    AsyncSocket(const AsyncSocket&) = delete;
+    AsyncSocket &operator=(const AsyncSocket&) = delete;
+
+    int fd() const { return sockFd; }
+
+    // co_await any of these for the syscall's result (>= 0), or -errno. Never EAGAIN.
+    auto read(char *buf, std::size_t len);
+    auto write(struct iovec *iov, int count, int flags = 0);
+    auto sendfile(int fileFd, uint64_t offset, std::size_t count);
+    auto accept();
+
+private:
+    friend class CoroScheduler;
+    template <typename Op> friend class IoAwaiter;
+
+    void park(IoWait *wait) { waiting = wait; }
+
+    CoroScheduler &scheduler;
+    int sockFd;
+    IoWait *waiting = nullptr;
+};
+
+template <typename Op>
+class IoAwaiter : public IoWait {
+public:
+    IoAwaiter(AsyncSocket &sock, Op op) : sock(sock), op(op) {}
+
+    bool await_ready() { return attempt(); }
+    void await_suspend(std::coroutine_handle<> waiter) {
+        handle = waiter;
+        sock.park(this);
+    }
+    ssize_t await_resume() { return result; }
+
+    bool attempt() override {
+        while (1) {
+            ssize_t got = op();
+            if (got < 0 && errno == EINTR) continue;
+            if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return false;
+            result = (got < 0) ? -errno : got;
+            return true;
+        }
+    }
+
+private:
+    AsyncSocket &sock;
+    Op op;
+};
+
+inline auto AsyncSocket::read(char *buf, std::size_t len) {
+    return IoAwaiter(*this, [this, buf, len] { return ::read(sockFd, buf, len); });
+}
+
+// sendmsg rather than writev for MSG_NOSIGNAL, same as writeResponse.
+inline auto AsyncSocket::write(struct iovec *iov, int count, int flags) {
+    return IoAwaiter(*this, [this, iov, count, flags] {
+        struct msghdr msg{};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = static_cast<std::size_t>(count);
+        return sendmsg(sockFd, &msg, flags | MSG_NOSIGNAL);
+    });
+}
+
+inline auto AsyncSocket::sendfile(int fileFd, uint64_t offset, std::size_t count) {
+    return IoAwaiter(*this, [this, fileFd, offset, count] {
+        off_t at = static_cast<off_t>(offset);
+        return ::sendfile(sockFd, fileFd, &at, count);
+    });
+}
+
+inline auto AsyncSocket::accept() {
+    return IoAwaiter(*this, [this] {
+        int connfd = accept4(sockFd, (sockaddr*) NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (connfd < 0 && (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)) {
+            // not worth killing the whole server over: stay parked and try again on the next wakeup
+            // (going round straight away would just spin on the same error).
+            ERROR << "accept() failed: " << strerror(errno) << ENDL;
+            errno = EAGAIN;
+        }
+        return static_cast<ssize_t>(connfd);
+    });
+}
+
+// Fire and forget: starts running straight away and frees itself when it returns.
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+/*
+    One thread's epoll set and the coroutines parked on it. Sockets register themselves when they're
+    made. A connection arms its deadline (armDeadline) before each wait; if it runs out first, the
+    parked operation is resumed with -ETIMEDOUT instead.
+*/
+class CoroScheduler {
+public:
+    CoroScheduler();
+    ~CoroScheduler();
+
+    void run(int listenFd); // never returns.
+
+    void watch(AsyncSocket &sock);
+    TimerWheel &timers() { return wheel; }
+    // when the epoll_wait whose batch is running now returned (so whatever we're doing has been ready since about then)
+    std::chrono::steady_clock::time_point batchStarted() const { return batchStart; }
+
+private:
+    int epollFd = -1;
+    TimerWheel wheel;
+    std::chrono::steady_clock::time_point batchStart = std::chrono::steady_clock::now();
+};
+
+/*
+    -t schedulers, one thread each, every one with its own SO_REUSEPORT listener so the kernel
+    spreads the connections across them. Never returns.
+*/
+void runCoroSchedulers(const std::vector<int> &listenFds);
+
+#endif
@@ -0,0 +1,193 @@
+#include "eventLoop.h"
+#include "logging.h"
+
+#include <sys/epoll.h>
+#include <sched.h>
+#include <pthread.h>
+#include <thread>
+
+bool setNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return false;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+EventLoop::EventLoop(int listenFd) : listenFd(listenFd) {
+    if (!setNonBlocking(listenFd)) {
+        FATAL << "failed to make listening socket non-blocking: " << strerror(errno) << ENDL;
+        exit(-1);
+    }
+
+    if ((epollFd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        FATAL << "epoll_create1() failed: " << strerror(errno) << ENDL;
+        exit(-1);
+    }
+
+    // the listener is the only thing registered with a null ptr, that's how run() tells them apart.
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &ev) < 0) {
+        FATAL << "epoll_ctl() failed to add listening socket: " << strerror(errno) << ENDL;
+        exit(-1);
+    }
+}
+
+EventLoop::~EventLoop() {
+    for (auto &entry : connections) close(entry.first);
+    if (epollFd >= 0) close(epollFd);
+}
+
+void EventLoop::run() {
+    epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        // with any deadline armed, wake up every tick to see to the wheel.
+        int ready = epoll_wait(epollFd, events, MAX_EVENTS, timers.empty() ? -1 : TIMER_TICK_MS);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            FATAL << "epoll_wait() failed: " << strerror(errno) << ENDL;
+            exit(-1);
+        }
+        // everything in this batch has been ready since about now, whatever we get to later has been waiting on the rest.
+        auto batchStart = std::chrono::steady_clock::now();
+
+        for (int i = 0; i < ready; i++) {
+            if (events[i].data.ptr == nullptr) {
+                acceptConnections();
+                continue;
+            }
+            // errors/hangups don't need special handling, the next read()/send() will report them.
+            Connection &conn = *static_cast<Connection*>(events[i].data.ptr);
+            conn.readyAt = batchStart;
+            serviceConnection(conn);
+        }
+
+        timers.expire(std::chrono::steady_clock::now(), [this](void *owner) {
+            closeExpired(*static_cast<Connection*>(owner));
+        });
+    }
+}
+
+// Ran out of time for whatever it was waiting on.
+void EventLoop::closeExpired(Connection &conn) {
+    static const char *waitingFor[TIMEOUT_KINDS] = {"idle", "sending its request header", "taking its response"};
+    DEBUG << "connection on fd " << conn.fd << " took too long (" << waitingFor[conn.timeoutKind] << "), closing" << ENDL;
+    countTimeout(conn.timeoutKind);
+    closeConnection(conn);
+}
+
+// Listener is non-blocking, so drain everything that is queued up until accept says EAGAIN.
+void EventLoop::acceptConnections() {
+    while (1) {
+        int connfd = accept4(listenFd, (sockaddr*) NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (connfd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            // EMFILE & friends: not worth killing the whole server over, try again on the next wakeup.
+            ERROR << "accept() failed: " << strerror(errno) << ENDL;
+            return;
+        }
+
+        auto conn = std::make_unique<Connection>(connfd);
+
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn.get();
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, connfd, &ev) < 0) {
+            ERROR << "epoll_ctl() failed to add connection: " << strerror(errno) << ENDL;
+            close(connfd);
+            continue;
+        }
+
+        TRACE << "accepted connection on fd " << connfd << ENDL;
+        armDeadline(timers, *conn, conn.get(), false); // (in case it never sends a thing, not even an edge)
+        connections.emplace(connfd, std::move(conn));
+    }
+}
+
+/*
+    Run the connection forward as far as it can go.
+    READING -> (request complete) -> queue the response -> WRITING -> (all sent) -> READING again on
+    keep-alive, or close. After a response we go straight back to readRequest: the next request may
+    already be sitting in conn.recv or the socket, and with edge-triggered epoll nobody will tell us twice.
+*/
+void EventLoop::serviceConnection(Connection &conn) {
+    while (1) {
+        if (conn.state == CONN_READING) {
+            StepStatus status = readRequest(conn);
+            if (status == STEP_AGAIN) {
+                armDeadline(timers, conn, &conn, false);
+                return;
+            }
+            if (status == STEP_CLOSED) {
+                closeConnection(conn);
+                return;
+            }
+
+            queueResponses(conn);
+        }
+
+        StepStatus status = writeResponse(conn);
+        if (status == STEP_AGAIN) {
+            armDeadline(timers, conn, &conn, true); // EPOLLOUT will bring us back here (hopefully in time).
+            return;
+        }
+
+        if (status != STEP_DONE || !conn.keepAlive) {
+            closeConnection(conn);
+            return;
+        }
+        resetRequest(conn);
+    }
+}
+
+void EventLoop::closeConnection(Connection &conn) {
+    int fd = conn.fd;
+    TRACE << "closing connection on fd " << fd << ENDL;
+    close(fd); // closing also drops it from the epoll set.
+    connections.erase(fd); // (conn is gone after this)
+}
+
+// CPUs we're actually allowed on (taskset/cgroups may hand us less than the whole box).
+static std::vector<int> allowedCpus() {
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &set)) cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+void runShards(const std::vector<int> &listenFds) {
+    std::vector<int> cpus = allowedCpus();
+    std::vector<std::thread> shards;
+
+    for (std::size_t i = 0; i < listenFds.size(); i++) {
+        int listenFd = listenFds[i];
+        int cpu = cpus.empty() ? -1 : cpus[i % cpus.size()]; // more shards than cores just doubles up.
+
+        shards.emplace_back([listenFd, cpu, i] {
+            if (cpu >= 0) {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(cpu, &set);
+                int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+                if (rc != 0) {
+                    WARNING << "shard " << i << " could not be pinned to cpu " << cpu << ": " << strerror(rc) << ENDL;
+                } else {
+                    DEBUG << "shard " << i << " pinned to cpu " << cpu << ENDL;
+                }
+            }
+
+            // built on the shard's own thread so its epoll set and connection table stay local to that core.
+            EventLoop loop(listenFd);
+            loop.run();
+        });
+    }
+
+    for (auto &shard : shards) shard.join();
+}
@@ -0,0 +1,48 @@
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "webServer.h"
+
+#define MAX_EVENTS 256 // how many epoll events we pull per epoll_wait()
+
+/*
+    Single threaded epoll reactor.
+    The listening socket and every client socket are non-blocking. Clients are registered
+    edge-triggered for both read and write, and each wakeup just runs readRequest()/writeResponse()
+    on the connection until they say STEP_AGAIN, so one slow client never holds up the others.
+    Every connection has one deadline on the timer wheel for what it's waiting on (idle, the rest of
+    a request header, the client taking more of a response); running out of it closes the connection.
+*/
+class EventLoop {
+public:
+    explicit EventLoop(int listenFd);
+    ~EventLoop();
+
+    void run(); // never returns.
+
+private:
+    void acceptConnections();
+    void serviceConnection(Connection &conn);
+    void closeConnection(Connection &conn);
+    void closeExpired(Connection &conn);
+
+    int listenFd;
+    int epollFd = -1;
+    TimerWheel timers; // (before connections, which cancel their timers on it as they go)
+    std::unordered_map<int, std::unique_ptr<Connection>> connections; // owns every open Connection, keyed by fd.
+};
+
+bool setNonBlocking(int fd);
+
+/*
+    Multi-reactor mode: one EventLoop thread per listening socket, each pinned to its own CPU.
+    The listeners are expected to share a port via SO_REUSEPORT, so the kernel spreads new
+    connections across them and a connection lives its whole life on one core. Never returns.
+*/
+void runShards(const std::vector<int> &listenFds);
+
+#endif
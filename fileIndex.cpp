@@ -0,0 +1,376 @@
+#include "fileIndex.h"
+#include "logging.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits>
+#include <poll.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define INDEX_WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE \
+                            | IN_ATTRIB | IN_DELETE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW)
+#define EMPTY_SLOT 0
+#define DEAD_SLOT std::numeric_limits<uint32_t>::max()
+#define INITIAL_SLOTS 16
+
+// FNV-1a, good enough spread for paths and cheap on short ones.
+static uint64_t hashPath(std::string_view path) {
+    uint64_t hash = 14695981039346656037ull;
+    for (char c : path) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static FileMeta metaFor(const struct stat &st) {
+    FileMeta meta;
+    meta.size = static_cast<uint64_t>(st.st_size);
+    meta.mtimeNs = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    return meta;
+}
+
+static std::string joinPath(const std::string &dir, const char *name) {
+    return dir.empty() ? std::string(name) : dir + "/" + name;
+}
+
+FileIndex::FileIndex(const std::string &root) : root(root) {
+    inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    stopFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (inotifyFd < 0 || stopFd < 0) {
+        WARNING << "no change notification for the file index (" << strerror(errno)
+                << "), misses will be checked against the filesystem" << ENDL;
+        degraded = true;
+    }
+}
+
+FileIndex::~FileIndex() {
+    if (watcher.joinable()) {
+        uint64_t one = 1;
+        if (write(stopFd, &one, sizeof(one)) < 0) {
+            ERROR << "could not stop the file index watcher: " << strerror(errno) << ENDL;
+        }
+        watcher.join();
+    }
+    if (inotifyFd >= 0) close(inotifyFd);
+    if (stopFd >= 0) close(stopFd);
+}
+
+void FileIndex::build(unsigned threads) {
+    auto start = std::chrono::steady_clock::now();
+    scanTree("", threads);
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    INFO << "indexed " << size() << " files under " << root << " in " << elapsed.count() << "ms ("
+         << threads << " threads)" << ENDL;
+
+    if (inotifyFd >= 0) watcher = std::thread(&FileIndex::watchLoop, this);
+}
+
+bool FileIndex::lookup(std::string_view relPath, FileMeta *meta) const {
+    uint64_t hash = hashPath(relPath);
+    const Shard &shard = shardFor(hash);
+    std::shared_lock<std::shared_mutex> guard(shard.lock);
+
+    std::size_t slot = findLocked(shard, hash, relPath);
+    if (slot == std::string::npos) return false;
+    if (meta) *meta = shard.slots[slot].meta;
+    return true;
+}
+
+std::size_t FileIndex::size() const {
+    std::size_t total = 0;
+    for (const Shard &shard : shards) {
+        std::shared_lock<std::shared_mutex> guard(shard.lock);
+        total += shard.live;
+    }
+    return total;
+}
+
+// Linear probing from the hash; a dead slot keeps the probe going, an empty one ends it.
+std::size_t FileIndex::findLocked(const Shard &shard, uint64_t hash, std::string_view relPath) {
+    if (shard.slots.empty()) return std::string::npos;
+    std::size_t mask = shard.slots.size() - 1;
+    for (std::size_t i = hash & mask; ; i = (i + 1) & mask) {
+        const Entry &entry = shard.slots[i];
+        if (entry.pathLen == EMPTY_SLOT) return std::string::npos;
+        if (entry.pathLen != DEAD_SLOT && entry.hash == hash && entry.pathLen == relPath.size()
+            && shard.arena.compare(entry.pathOffset, entry.pathLen, relPath) == 0) {
+            return i;
+        }
+    }
+}
+
+// New table of `capacity` slots holding only the live entries, and an arena without the dead paths.
+void FileIndex::rehashLocked(Shard &shard, std::size_t capacity) {
+    std::vector<Entry> slots(capacity, Entry{0, 0, EMPTY_SLOT, FileMeta{}});
+    std::string arena;
+    arena.reserve(shard.arena.size());
+
+    for (const Entry &entry : shard.slots) {
+        if (entry.pathLen == EMPTY_SLOT || entry.pathLen == DEAD_SLOT) continue;
+        std::size_t i = entry.hash & (capacity - 1);
+        while (slots[i].pathLen != EMPTY_SLOT) i = (i + 1) & (capacity - 1);
+        slots[i] = entry;
+        slots[i].pathOffset = static_cast<uint32_t>(arena.size());
+        arena.append(shard.arena, entry.pathOffset, entry.pathLen);
+    }
+    shard.slots.swap(slots);
+    shard.arena.swap(arena);
+    shard.dead = 0;
+}
+
+void FileIndex::put(std::string_view relPath, const FileMeta &meta) {
+    uint64_t hash = hashPath(relPath);
+    Shard &shard = shardFor(hash);
+    std::unique_lock<std::shared_mutex> guard(shard.lock);
+
+    std::size_t existing = findLocked(shard, hash, relPath);
+    if (existing != std::string::npos) {
+        shard.slots[existing].meta = meta;
+        return;
+    }
+    if (shard.arena.size() + relPath.size() >= DEAD_SLOT) {
+        WARNING << "file index shard is full, not indexing " << relPath << ENDL;
+        degraded = true;
+        return;
+    }
+
+    // keep used slots (live and dead) under 70%, growing if it's mostly live entries.
+    if (shard.slots.empty()) {
+        shard.slots.assign(INITIAL_SLOTS, Entry{0, 0, EMPTY_SLOT, FileMeta{}});
+    } else if ((shard.live + shard.dead + 1) * 10 > shard.slots.size() * 7) {
+        std::size_t capacity = shard.slots.size();
+        if ((shard.live + 1) * 10 > capacity * 5) capacity *= 2;
+        rehashLocked(shard, capacity);
+    }
+
+    std::size_t mask = shard.slots.size() - 1;
+    std::size_t i = hash & mask;
+    while (shard.slots[i].pathLen != EMPTY_SLOT && shard.slots[i].pathLen != DEAD_SLOT) i = (i + 1) & mask;
+    if (shard.slots[i].pathLen == DEAD_SLOT) shard.dead--;
+
+    shard.slots[i] = Entry{hash, static_cast<uint32_t>(shard.arena.size()), static_cast<uint32_t>(relPath.size()), meta};
+    shard.arena.append(relPath);
+    shard.live++;
+}
+
+void FileIndex::remove(std::string_view relPath) {
+    uint64_t hash = hashPath(relPath);
+    Shard &shard = shardFor(hash);
+    std::unique_lock<std::shared_mutex> guard(shard.lock);
+
+    std::size_t slot = findLocked(shard, hash, relPath);
+    if (slot == std::string::npos) return;
+    shard.slots[slot].pathLen = DEAD_SLOT; // (its bytes stay in the arena until the next rehash)
+    shard.live--;
+    shard.dead++;
+}
+
+// A directory went away: everything under it goes too. Walks every shard, but that's rare.
+void FileIndex::removeTree(std::string_view relDir) {
+    std::string prefix = std::string(relDir) + "/";
+    for (Shard &shard : shards) {
+        std::unique_lock<std::shared_mutex> guard(shard.lock);
+        for (Entry &entry : shard.slots) {
+            if (entry.pathLen == EMPTY_SLOT || entry.pathLen == DEAD_SLOT || entry.pathLen < prefix.size()) continue;
+            if (shard.arena.compare(entry.pathOffset, prefix.size(), prefix) != 0) continue;
+            entry.pathLen = DEAD_SLOT;
+            shard.live--;
+            shard.dead++;
+        }
+    }
+}
+
+void FileIndex::clear() {
+    for (Shard &shard : shards) {
+        std::unique_lock<std::shared_mutex> guard(shard.lock);
+        shard.slots.clear();
+        shard.arena.clear();
+        shard.live = shard.dead = 0;
+    }
+}
+
+std::string FileIndex::fullPath(const std::string &relPath) const {
+    return relPath.empty() ? root : root + "/" + relPath;
+}
+
+/*
+    Breadth-first walk with `threads` threads sharing one queue of directories. Each thread reads a
+    directory, indexes its files and queues its subdirectories. Done when the queue is empty and
+    nobody is still reading (who could add to it).
+*/
+void FileIndex::scanTree(const std::string &relDir, unsigned threads) {
+    std::mutex queueLock;
+    std::condition_variable queueChanged;
+    std::vector<std::string> queue{relDir};
+    unsigned busy = 0;
+
+    auto worker = [&]() {
+        std::vector<std::string> found;
+        std::unique_lock<std::mutex> guard(queueLock);
+        while (1) {
+            queueChanged.wait(guard, [&]() { return !queue.empty() || busy == 0; });
+            if (queue.empty()) return;
+
+            std::string dir = std::move(queue.back());
+            queue.pop_back();
+            busy++;
+            guard.unlock();
+
+            found.clear();
+            scanDirectory(dir, found);
+
+            guard.lock();
+            busy--;
+            for (std::string &subdir : found) queue.push_back(std::move(subdir));
+            queueChanged.notify_all();
+        }
+    };
+
+    std::vector<std::thread> helpers;
+    for (unsigned i = 1; i < threads; i++) helpers.emplace_back(worker);
+    worker();
+    for (std::thread &helper : helpers) helper.join();
+}
+
+void FileIndex::scanDirectory(const std::string &relDir, std::vector<std::string> &subdirs) {
+    watchDirectory(relDir); // first, so anything created while we read still shows up as an event.
+
+    DIR *dir = opendir(fullPath(relDir).c_str());
+    if (!dir) {
+        WARNING << "file index can't read " << fullPath(relDir) << ": " << strerror(errno) << ENDL;
+        return;
+    }
+
+    while (struct dirent *dirEntry = readdir(dir)) {
+        const char *name = dirEntry->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+        std::string relPath = joinPath(relDir, name);
+
+        if (dirEntry->d_type == DT_DIR) {
+            subdirs.push_back(std::move(relPath));
+            continue;
+        }
+
+        struct stat st;
+        if (fstatat(dirfd(dir), name, &st, 0) < 0) continue;
+        if (S_ISREG(st.st_mode)) {
+            put(relPath, metaFor(st));
+        } else if (S_ISDIR(st.st_mode)) {
+            if (dirEntry->d_type == DT_UNKNOWN) {
+                subdirs.push_back(std::move(relPath));
+            } else {
+                // a symlink to a directory: no watch can follow it (and it could loop), so we can't vouch for misses.
+                DEBUG << "not indexing through the symlinked directory " << relPath << ENDL;
+                degraded = true;
+            }
+        }
+    }
+    closedir(dir);
+}
+
+// Something happened to a (non directory) name: index it if it's a regular file now, forget it otherwise.
+void FileIndex::refreshFile(const std::string &relPath) {
+    struct stat st;
+    if (stat(fullPath(relPath).c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+        put(relPath, metaFor(st));
+    } else {
+        remove(relPath);
+    }
+}
+
+bool FileIndex::watchDirectory(const std::string &relDir) {
+    if (inotifyFd < 0) return false;
+
+    int wd = inotify_add_watch(inotifyFd, fullPath(relDir).c_str(), INDEX_WATCH_EVENTS);
+    if (wd < 0) {
+        if (!degraded.exchange(true)) {
+            WARNING << "inotify_add_watch(" << fullPath(relDir) << ") failed: " << strerror(errno)
+                    << ", file index misses will be checked against the filesystem" << ENDL;
+        }
+        return false;
+    }
+    std::lock_guard<std::mutex> guard(watchLock);
+    watchedDirs[wd] = relDir;
+    return true;
+}
+
+/*
+    relDir and everything under it has left the tree (moved somewhere else): stop watching it. The
+    watches would otherwise go on reporting under the old names, and a move back in gets new ones.
+*/
+void FileIndex::unwatchTree(const std::string &relDir) {
+    std::string prefix = relDir + "/";
+    std::lock_guard<std::mutex> guard(watchLock);
+    for (auto watch = watchedDirs.begin(); watch != watchedDirs.end(); ) {
+        const std::string &dir = watch->second;
+        if (dir == relDir || dir.compare(0, prefix.size(), prefix) == 0) {
+            inotify_rm_watch(inotifyFd, watch->first);
+            watch = watchedDirs.erase(watch);
+        } else {
+            ++watch;
+        }
+    }
+}
+
+// Background thread: apply inotify events to the index until the destructor pokes stopFd.
+void FileIndex::watchLoop() {
+    alignas(struct inotify_event) char buffer[16384];
+    struct pollfd fds[2] = {{inotifyFd, POLLIN, 0}, {stopFd, POLLIN, 0}};
+
+    while (1) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            ERROR << "poll() failed in file index watcher: " << strerror(errno) << ENDL;
+            degraded = true;
+            return;
+        }
+        if (fds[1].revents) return;
+
+        ssize_t len = read(inotifyFd, buffer, sizeof(buffer));
+        if (len <= 0) continue;
+
+        for (char *p = buffer; p < buffer + len; ) {
+            auto *event = reinterpret_cast<struct inotify_event*>(p);
+            p += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                // lost events, we have no idea what changed. Start over (misses go to the filesystem meanwhile).
+                WARNING << "inotify queue overflowed, rebuilding the file index" << ENDL;
+                rescanning = true;
+                clear();
+                scanTree("", 1);
+                rescanning = false;
+                continue;
+            }
+
+            std::string dir;
+            {
+                std::lock_guard<std::mutex> guard(watchLock);
+                auto watch = watchedDirs.find(event->wd);
+                if (watch == watchedDirs.end()) continue;
+                dir = watch->second;
+                if (event->mask & (IN_IGNORED | IN_DELETE_SELF)) {
+                    watchedDirs.erase(watch); // directory is gone, its parent's IN_DELETE cleans up the entries.
+                    continue;
+                }
+            }
+            if (event->len == 0) continue;
+
+            std::string relPath = joinPath(dir, event->name);
+            if (event->mask & IN_ISDIR) {
+                if (event->mask & (IN_DELETE | IN_MOVED_FROM)) removeTree(relPath);
+                if (event->mask & IN_MOVED_FROM) unwatchTree(relPath);
+                if (event->mask & (IN_CREATE | IN_MOVED_TO)) scanTree(relPath, 1);
+            } else {
+                refreshFile(relPath);
+            }
+        }
+    }
+}
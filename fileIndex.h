@@ -0,0 +1,92 @@
+#ifndef FILEINDEX_H
+#define FILEINDEX_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#define FILE_INDEX_SHARDS 64 // power of two. Independent tables picked by hash, so writers rarely meet.
+
+struct FileMeta {
+    uint64_t size = 0;
+    int64_t mtimeNs = 0;
+};
+
+/*
+    Every regular file under the web root, by path relative to it ("index1.html", "docs/a1.html"),
+    so check_for_file can answer (and 404) without asking the filesystem.
+
+    Built once at startup by a few threads walking the tree in parallel, then kept current by an
+    inotify watch on every directory (the watch goes on before a directory is read, so nothing
+    created in between gets missed). Each shard is an open addressing table of 32 byte slots,
+    with the paths packed end to end in one string per shard.
+
+    If something means we can't see every change (a watch couldn't be added, the inotify queue
+    overflowed and we're rescanning, a symlinked directory we won't follow) authoritative() is
+    false, and a miss should be double checked against the filesystem.
+*/
+class FileIndex {
+public:
+    explicit FileIndex(const std::string &root);
+    ~FileIndex();
+
+    void build(unsigned threads); // call once, before lookups start
+
+    bool lookup(std::string_view relPath, FileMeta *meta = nullptr) const;
+    bool authoritative() const { return !rescanning && !degraded; }
+    std::size_t size() const;
+
+private:
+    struct Entry {
+        uint64_t hash;
+        uint32_t pathOffset; // into the shard's arena
+        uint32_t pathLen;    // EMPTY_SLOT / DEAD_SLOT for unused slots
+        FileMeta meta;
+    };
+    struct Shard {
+        mutable std::shared_mutex lock;
+        std::vector<Entry> slots;
+        std::string arena;
+        std::size_t live = 0;
+        std::size_t dead = 0;
+    };
+
+    Shard &shardFor(uint64_t hash) { return shards[(hash >> 32) & (FILE_INDEX_SHARDS - 1)]; }
+    const Shard &shardFor(uint64_t hash) const { return shards[(hash >> 32) & (FILE_INDEX_SHARDS - 1)]; }
+    static std::size_t findLocked(const Shard &shard, uint64_t hash, std::string_view relPath);
+    static void rehashLocked(Shard &shard, std::size_t capacity);
+
+    void put(std::string_view relPath, const FileMeta &meta);
+    void remove(std::string_view relPath);
+    void removeTree(std::string_view relDir);
+    void clear();
+
+    void scanTree(const std::string &relDir, unsigned threads);
+    void scanDirectory(const std::string &relDir, std::vector<std::string> &subdirs);
+    void refreshFile(const std::string &relPath);
+    std::string fullPath(const std::string &relPath) const;
+
+    bool watchDirectory(const std::string &relDir);
+    void unwatchTree(const std::string &relDir);
+    void watchLoop();
+
+    std::string root;
+    Shard shards[FILE_INDEX_SHARDS];
+
+    std::atomic<bool> rescanning{false};
+    std::atomic<bool> degraded{false};
+
+    int inotifyFd = -1;
+    int stopFd = -1;
+    std::mutex watchLock;
+    std::unordered_map<int, std::string> watchedDirs; // watch descriptor -> relative dir
+    std::thread watcher;
+};
+
+#endif
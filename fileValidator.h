@@ -0,0 +1,291 @@
+#ifndef FILEVALIDATOR_H
+#define FILEVALIDATOR_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+/*
+    Filename validation without std::regex.
+
+    A policy is a pattern in a small regex dialect (literals, \ escapes, [a-z] / [^...] classes,
+    '.', ( | ) groups, postfix + * ?), always matched against the whole name. DfaValidator<Policy>
+    turns it into a DFA at compile time (Glushkov positions + subset construction, all constexpr),
+    so matching is one table lookup per byte: no allocation, no backtracking, nothing built at runtime.
+    A pattern too big for the fixed tables, or one that doesn't parse, fails the build.
+*/
+
+#define DFA_MAX_POSITIONS 64 // characters/classes in a pattern, one bit each in a uint64_t
+#define DFA_MAX_STATES 32
+
+struct ByteSet {
+    uint64_t bits[4] = {};
+
+    constexpr void add(unsigned char c) { bits[c >> 6] |= uint64_t(1) << (c & 63); }
+    constexpr bool has(unsigned char c) const { return (bits[c >> 6] >> (c & 63)) & 1; }
+};
+
+struct Dfa {
+    uint8_t next[DFA_MAX_STATES][256] = {}; // state 0 is dead, 1 is the start state
+    bool accepting[DFA_MAX_STATES] = {};
+    int stateCount = 0;
+    const char *error = nullptr;            // set if the pattern couldn't be compiled
+};
+
+class DfaCompiler {
+public:
+    constexpr DfaCompiler(const char *pattern, bool ignoreCase) : p(pattern), ignoreCase(ignoreCase) {}
+
+    constexpr Dfa compile() {
+        Dfa dfa;
+        Node root = parseAlternation();
+        if (!error && *p) error = "unbalanced ')'";
+        if (error) {
+            dfa.error = error;
+            return dfa;
+        }
+
+        // DFA state = the set of positions we could be at. Start is special: it has no positions,
+        // only root.first to move to. Everything reached after that is keyed by its position set.
+        uint64_t stateSets[DFA_MAX_STATES] = {};
+        dfa.accepting[1] = root.nullable;
+        dfa.stateCount = 2;
+
+        for (int state = 1; state < dfa.stateCount; state++) {
+            uint64_t candidates = 0;
+            if (state == 1) {
+                candidates = root.first;
+            } else {
+                for (int pos = 0; pos < positions; pos++) {
+                    if ((stateSets[state] >> pos) & 1) candidates |= follow[pos];
+                }
+            }
+
+            for (int c = 0; c < 256; c++) {
+                uint64_t target = 0;
+                for (int pos = 0; pos < positions; pos++) {
+                    if (((candidates >> pos) & 1) && sets[pos].has(static_cast<unsigned char>(c))) {
+                        target |= uint64_t(1) << pos;
+                    }
+                }
+                if (target == 0) continue; // dead
+
+                int found = 0;
+                for (int other = 2; other < dfa.stateCount; other++) {
+                    if (stateSets[other] == target) found = other;
+                }
+                if (found == 0) {
+                    if (dfa.stateCount == DFA_MAX_STATES) {
+                        dfa.error = "pattern needs more than DFA_MAX_STATES states";
+                        return dfa;
+                    }
+                    found = dfa.stateCount++;
+                    stateSets[found] = target;
+                    dfa.accepting[found] = (target & root.last) != 0;
+                }
+                dfa.next[state][c] = static_cast<uint8_t>(found);
+            }
+        }
+        return dfa;
+    }
+
+private:
+    struct Node {
+        bool nullable = true;
+        uint64_t first = 0; // positions that can start a match of this node
+        uint64_t last = 0;  // positions that can end one
+    };
+
+    // everything in `from` can be followed by everything in `to`
+    constexpr void link(uint64_t from, uint64_t to) {
+        for (int pos = 0; pos < positions; pos++) {
+            if ((from >> pos) & 1) follow[pos] |= to;
+        }
+    }
+
+    constexpr void addByte(ByteSet &set, char c) {
+        set.add(static_cast<unsigned char>(c));
+        if (!ignoreCase) return;
+        if (c >= 'a' && c <= 'z') set.add(static_cast<unsigned char>(c - 'a' + 'A'));
+        if (c >= 'A' && c <= 'Z') set.add(static_cast<unsigned char>(c - 'A' + 'a'));
+    }
+
+    constexpr Node position(const ByteSet &set) {
+        if (positions == DFA_MAX_POSITIONS) {
+            error = "pattern has more than DFA_MAX_POSITIONS characters";
+            return Node{};
+        }
+        sets[positions] = set;
+        uint64_t bit = uint64_t(1) << positions++;
+        return Node{false, bit, bit};
+    }
+
+    constexpr Node parseAlternation() {
+        Node result = parseSequence();
+        while (!error && *p == '|') {
+            p++;
+            Node other = parseSequence();
+            result.nullable = result.nullable || other.nullable;
+            result.first |= other.first;
+            result.last |= other.last;
+        }
+        return result;
+    }
+
+    constexpr Node parseSequence() {
+        Node result; // empty sequence: matches nothing, nullable
+        while (!error && *p && *p != '|' && *p != ')') {
+            Node next = parseRepeat();
+            link(result.last, next.first);
+            if (result.nullable) result.first |= next.first;
+            result.last = next.nullable ? (result.last | next.last) : next.last;
+            result.nullable = result.nullable && next.nullable;
+        }
+        return result;
+    }
+
+    constexpr Node parseRepeat() {
+        Node node = parseAtom();
+        while (!error && (*p == '+' || *p == '*' || *p == '?')) {
+            if (*p != '?') link(node.last, node.first);
+            if (*p != '+') node.nullable = true;
+            p++;
+        }
+        return node;
+    }
+
+    constexpr Node parseAtom() {
+        ByteSet set;
+        char c = *p++;
+        if (c == '(') {
+            Node inner = parseAlternation();
+            if (*p != ')') {
+                error = "missing ')'";
+                return Node{};
+            }
+            p++;
+            return inner;
+        }
+        if (c == '[') return parseClass();
+        if (c == '.') {
+            for (int b = 1; b < 256; b++) set.add(static_cast<unsigned char>(b));
+            return position(set);
+        }
+        if (c == '+' || c == '*' || c == '?') {
+            error = "repeat with nothing before it";
+            return Node{};
+        }
+        if (c == '\\') {
+            if (!*p) {
+                error = "pattern ends in '\\'";
+                return Node{};
+            }
+            c = *p++;
+        }
+        addByte(set, c);
+        return position(set);
+    }
+
+    // after the '[': "A-Za-z]", "^/]" ...
+    constexpr Node parseClass() {
+        ByteSet set;
+        bool negate = (*p == '^');
+        if (negate) p++;
+        while (*p && *p != ']') {
+            char from = *p++;
+            if (from == '\\' && *p) from = *p++;
+            char to = from;
+            if (*p == '-' && p[1] && p[1] != ']') {
+                p++;
+                to = *p++;
+                if (to == '\\' && *p) to = *p++;
+            }
+            for (int b = static_cast<unsigned char>(from); b <= static_cast<unsigned char>(to); b++) {
+                addByte(set, static_cast<char>(b));
+            }
+        }
+        if (*p != ']') {
+            error = "missing ']'";
+            return Node{};
+        }
+        p++;
+        if (negate) {
+            for (auto &word : set.bits) word = ~word;
+            set.bits[0] &= ~uint64_t(1); // never match '\0'
+        }
+        return position(set);
+    }
+
+    const char *p;
+    bool ignoreCase;
+    const char *error = nullptr;
+    ByteSet sets[DFA_MAX_POSITIONS] = {};
+    uint64_t follow[DFA_MAX_POSITIONS] = {};
+    int positions = 0;
+};
+
+/*
+    Policy = a struct with `name`, `pattern` and `ignoreCase`. One compiled table per policy,
+    living in read-only data.
+*/
+template <typename Policy>
+struct DfaValidator {
+    static constexpr Dfa dfa = DfaCompiler(Policy::pattern, Policy::ignoreCase).compile();
+    static_assert(dfa.error == nullptr, "filename policy pattern did not compile (see Dfa::error)");
+
+    static bool matches(std::string_view name) {
+        int state = 1;
+        for (char c : name) {
+            state = dfa.next[state][static_cast<unsigned char>(c)];
+            if (state == 0) return false;
+        }
+        return dfa.accepting[state];
+    }
+};
+
+// The original assignment rule: letters, then digits, then .html or .jpg.
+struct AssignmentFilePolicy {
+    static constexpr const char *name = "assignment";
+    static constexpr const char *pattern = "[A-Za-z]+[0-9]+\\.(html|jpg)";
+    static constexpr bool ignoreCase = true;
+};
+
+// Any plain name with an extension we know a Content-Type for.
+struct WebFilePolicy {
+    static constexpr const char *name = "web";
+    static constexpr const char *pattern = "[A-Za-z0-9_\\-]+(\\.[A-Za-z0-9_\\-]+)*\\.(html?|jpe?g|png|gif|css|js|txt)";
+    static constexpr bool ignoreCase = true;
+};
+
+// Anything that isn't a hidden file.
+struct AnyFilePolicy {
+    static constexpr const char *name = "any";
+    static constexpr const char *pattern = "[A-Za-z0-9_\\-][A-Za-z0-9_.\\-]*";
+    static constexpr bool ignoreCase = false;
+};
+
+struct FilePolicy {
+    const char *name;
+    bool (*matches)(std::string_view basename);
+};
+
+#define FILE_POLICY(P) FilePolicy{P::name, &DfaValidator<P>::matches}
+
+inline constexpr FilePolicy filePolicies[] = {
+    FILE_POLICY(AssignmentFilePolicy),
+    FILE_POLICY(WebFilePolicy),
+    FILE_POLICY(AnyFilePolicy),
+};
+
+// -p picks one of filePolicies by name, set before any connection is served.
+inline const FilePolicy *activeFilePolicy = &filePolicies[0];
+
+// nullptr if there is no policy called `name`.
+inline const FilePolicy *findFilePolicy(std::string_view name) {
+    for (const FilePolicy &policy : filePolicies) {
+        if (name == policy.name) return &policy;
+    }
+    return nullptr;
+}
+
+#endif
@@ -0,0 +1,115 @@
+#ifndef HTTPHEADERS_H
+#define HTTPHEADERS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+/*
+    The header names we actually care about, resolved to an id once while the request is parsed
+    so nothing after that has to compare header names again.
+    Add a name: give it an id here and its lowercase spelling in knownHeaderNames, the hash below
+    picks itself a new seed at compile time (and refuses to build if it can't find one).
+*/
+enum HeaderId : uint8_t {
+    HDR_UNKNOWN = 0,
+    HDR_HOST,
+    HDR_CONNECTION,
+    HDR_KEEP_ALIVE,
+    HDR_ACCEPT,
+    HDR_ACCEPT_ENCODING,
+    HDR_ACCEPT_LANGUAGE,
+    HDR_IF_NONE_MATCH,
+    HDR_IF_MODIFIED_SINCE,
+    HDR_IF_RANGE,
+    HDR_RANGE,
+    HDR_USER_AGENT,
+    HDR_REFERER,
+    HDR_CACHE_CONTROL,
+    HDR_CONTENT_LENGTH,
+    HDR_TRANSFER_ENCODING,
+    HDR_EXPECT,
+    HDR_UPGRADE,
+    HDR_COUNT
+};
+
+inline constexpr std::string_view knownHeaderNames[HDR_COUNT] = {
+    "",
+    "host",
+    "connection",
+    "keep-alive",
+    "accept",
+    "accept-encoding",
+    "accept-language",
+    "if-none-match",
+    "if-modified-since",
+    "if-range",
+    "range",
+    "user-agent",
+    "referer",
+    "cache-control",
+    "content-length",
+    "transfer-encoding",
+    "expect",
+    "upgrade",
+};
+
+#define HEADER_HASH_SLOTS 64 // power of two, comfortably more than HDR_COUNT
+
+constexpr char asciiLower(char c) {
+    return (c >= 'A' && c <= 'Z') ? static_cast<char>(c + ('a' - 'A')) : c;
+}
+
+// Only looks at the length and three characters, so it's a handful of instructions per header.
+constexpr std::size_t headerHash(const char *name, std::size_t len, uint32_t seed) {
+    uint32_t h = static_cast<uint32_t>(len) * 0x9e3779b1u;
+    h = (h ^ static_cast<unsigned char>(asciiLower(name[0]))) * seed;
+    h = (h ^ static_cast<unsigned char>(asciiLower(name[len / 2]))) * seed;
+    h = (h ^ static_cast<unsigned char>(asciiLower(name[len - 1]))) * seed;
+    return (h >> 16) & (HEADER_HASH_SLOTS - 1);
+}
+
+struct HeaderHashTable {
+    uint32_t seed = 0;
+    HeaderId slots[HEADER_HASH_SLOTS] = {};
+};
+
+// Try odd seeds until every known name lands in its own slot.
+constexpr HeaderHashTable buildHeaderHashTable() {
+    for (uint32_t seed = 1; seed < 100000; seed += 2) {
+        HeaderHashTable table;
+        table.seed = seed;
+        bool collided = false;
+        for (int id = HDR_UNKNOWN + 1; id < HDR_COUNT && !collided; id++) {
+            std::string_view name = knownHeaderNames[id];
+            std::size_t slot = headerHash(name.data(), name.size(), seed);
+            if (table.slots[slot] != HDR_UNKNOWN) collided = true;
+            table.slots[slot] = static_cast<HeaderId>(id);
+        }
+        if (!collided) return table;
+    }
+    return HeaderHashTable{};
+}
+
+inline constexpr HeaderHashTable headerHashTable = buildHeaderHashTable();
+static_assert(headerHashTable.seed != 0, "no perfect hash seed for knownHeaderNames, bump HEADER_HASH_SLOTS");
+
+/*
+    Header name (any case) -> id. One hash and, at most, one compare against the single name that
+    could live in that slot.
+*/
+constexpr HeaderId lookupHeaderId(const char *name, std::size_t len) {
+    if (len == 0) return HDR_UNKNOWN;
+    HeaderId id = headerHashTable.slots[headerHash(name, len, headerHashTable.seed)];
+    std::string_view known = knownHeaderNames[id];
+    if (id == HDR_UNKNOWN || known.size() != len) return HDR_UNKNOWN;
+    for (std::size_t i = 0; i < len; i++) {
+        if (asciiLower(name[i]) != known[i]) return HDR_UNKNOWN;
+    }
+    return id;
+}
+
+static_assert(lookupHeaderId("Accept-Encoding", 15) == HDR_ACCEPT_ENCODING, "header hash is broken");
+static_assert(lookupHeaderId("X-Whatever", 10) == HDR_UNKNOWN, "header hash is broken");
+
+#endif
@@ -0,0 +1,143 @@
+#include "httpParser.h"
+
+#include <cstring>
+
+static bool isSpace(char c) {
+    return c == ' ' || c == '\t';
+}
+
+char *RecvBuffer::writePtr() {
+    if (!storage) {
+        capacity = parserLimits.maxHeaderBytes;
+        storage = std::make_unique<char[]>(capacity);
+    }
+    return storage.get() + end;
+}
+
+void RecvBuffer::consume(std::size_t bytes) {
+    start += bytes;
+    if (start == end) start = end = 0; // empty, so start over at the front for free.
+}
+
+void RecvBuffer::compact() {
+    if (start == 0) return;
+    std::memmove(storage.get(), storage.get() + start, end - start);
+    end -= start;
+    start = 0;
+}
+
+void HttpParser::reset() {
+    state = REQUEST_LINE;
+    scanPos = lineStart = consumedBytes = 0;
+    headerCount = 0;
+    for (Span &part : requestParts) part = Span{0, 0};
+    req.method = req.target = req.version = std::string_view();
+    req.headerCount = 0;
+    std::memset(req.known, 0, sizeof(req.known));
+}
+
+/*
+    Walk forward from scanPos looking for line ends. Only "\r\n" ends a line, a bare "\n" is just
+    another byte of it (same as the old line splitter).
+*/
+ParseStatus HttpParser::parse(const char *buf, std::size_t len) {
+    if (state == PARSED) reset(); // last request was already handed out, this is a new one.
+
+    while (scanPos < len) {
+        const char *newline = static_cast<const char*>(std::memchr(buf + scanPos, '\n', len - scanPos));
+        if (!newline) {
+            scanPos = len;
+            break;
+        }
+
+        std::size_t newlinePos = static_cast<std::size_t>(newline - buf);
+        scanPos = newlinePos + 1;
+        if (newlinePos == lineStart || buf[newlinePos - 1] != '\r') continue;
+
+        std::size_t lineEnd = newlinePos - 1; // the '\r'
+        if (scanPos > parserLimits.maxHeaderBytes) return finish(PARSE_HEADERS_TOO_LARGE, buf, len);
+
+        if (state == REQUEST_LINE) {
+            if (lineEnd - lineStart > parserLimits.maxRequestLine) return finish(PARSE_URI_TOO_LONG, buf, len);
+            // a blank line straight away ends the request too, it just has nothing in it (-> 400).
+            if (lineEnd == lineStart) return finish(PARSE_DONE, buf, scanPos);
+            if (!parseRequestLine(buf, lineStart, lineEnd)) return finish(PARSE_BAD, buf, len);
+            state = HEADER_LINES;
+        } else {
+            if (lineEnd == lineStart) return finish(PARSE_DONE, buf, scanPos); // the blank line
+            if (headerCount >= parserLimits.maxHeaders) return finish(PARSE_HEADERS_TOO_LARGE, buf, len);
+            if (!parseHeaderLine(buf, lineStart, lineEnd)) return finish(PARSE_BAD, buf, len);
+        }
+        lineStart = scanPos;
+    }
+
+    // still waiting on the end of a line, but it may already be past what we're willing to hold.
+    if (state == REQUEST_LINE && scanPos - lineStart > parserLimits.maxRequestLine) {
+        return finish(PARSE_URI_TOO_LONG, buf, len);
+    }
+    if (scanPos >= parserLimits.maxHeaderBytes) return finish(PARSE_HEADERS_TOO_LARGE, buf, len);
+    return PARSE_INCOMPLETE;
+}
+
+/*
+    Wrap up: turn the spans into views into buf. On an error we can't tell where the request
+    ends, so we claim everything we were given (the connection gets closed after the response anyway).
+*/
+ParseStatus HttpParser::finish(ParseStatus status, const char *buf, std::size_t consumedLen) {
+    state = PARSED;
+    consumedBytes = consumedLen;
+
+    if (status == PARSE_DONE && requestParts[0].len > 0) {
+        req.method = std::string_view(buf + requestParts[0].offset, requestParts[0].len);
+        req.target = std::string_view(buf + requestParts[1].offset, requestParts[1].len);
+        req.version = std::string_view(buf + requestParts[2].offset, requestParts[2].len);
+    }
+    req.headerCount = 0;
+    if (status == PARSE_DONE) {
+        for (std::size_t i = 0; i < headerCount; i++) {
+            req.headers[i].name = std::string_view(buf + headerSpans[i][0].offset, headerSpans[i][0].len);
+            req.headers[i].value = std::string_view(buf + headerSpans[i][1].offset, headerSpans[i][1].len);
+            req.headers[i].id = headerIds[i];
+            if (headerIds[i] != HDR_UNKNOWN && req.known[headerIds[i]] == 0) {
+                req.known[headerIds[i]] = static_cast<uint8_t>(i + 1);
+            }
+        }
+        req.headerCount = headerCount;
+    }
+    return status;
+}
+
+// "GET /file1.html HTTP/1.1" -> three whitespace separated parts, anything after the third is ignored.
+bool HttpParser::parseRequestLine(const char *buf, std::size_t lineStart, std::size_t lineEnd) {
+    std::size_t pos = lineStart;
+    for (Span &part : requestParts) {
+        while (pos < lineEnd && isSpace(buf[pos])) pos++;
+        std::size_t partStart = pos;
+        while (pos < lineEnd && !isSpace(buf[pos])) pos++;
+        if (pos == partStart) return false; // missing a part
+        part = Span{static_cast<uint32_t>(partStart), static_cast<uint32_t>(pos - partStart)};
+    }
+    return true;
+}
+
+// "Name: value" -> name up to the colon (no whitespace allowed in it), value with the whitespace trimmed.
+bool HttpParser::parseHeaderLine(const char *buf, std::size_t lineStart, std::size_t lineEnd) {
+    const char *colon = static_cast<const char*>(std::memchr(buf + lineStart, ':', lineEnd - lineStart));
+    if (!colon || colon == buf + lineStart) return false;
+
+    std::size_t nameEnd = static_cast<std::size_t>(colon - buf);
+    for (std::size_t i = lineStart; i < nameEnd; i++) {
+        if (isSpace(buf[i])) return false;
+    }
+
+    std::size_t valueStart = nameEnd + 1;
+    std::size_t valueEnd = lineEnd;
+    while (valueStart < valueEnd && isSpace(buf[valueStart])) valueStart++;
+    while (valueEnd > valueStart && isSpace(buf[valueEnd - 1])) valueEnd--;
+
+    headerSpans[headerCount][0] = Span{static_cast<uint32_t>(lineStart), static_cast<uint32_t>(nameEnd - lineStart)};
+    headerSpans[headerCount][1] = Span{static_cast<uint32_t>(valueStart), static_cast<uint32_t>(valueEnd - valueStart)};
+    headerIds[headerCount] = lookupHeaderId(buf + lineStart, nameEnd - lineStart);
+    headerCount++;
+    return true;
+}
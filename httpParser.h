@@ -0,0 +1,126 @@
+#ifndef HTTPPARSER_H
+#define HTTPPARSER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+
+#include "httpHeaders.h"
+
+#define MAX_HEADER_COUNT 100              // hard ceiling, -n can only lower it
+#define DEFAULT_MAX_REQUEST_LINE 8192     // bytes in "GET /path HTTP/1.1"
+#define DEFAULT_MAX_HEADER_BYTES 16384    // request line + every header line + the blank line
+
+/*
+    Limits on what a client may send us before we give up on it.
+    Set from the command line in main() before any connection is served, read-only after that.
+*/
+struct ParserLimits {
+    std::size_t maxRequestLine = DEFAULT_MAX_REQUEST_LINE;
+    std::size_t maxHeaders = MAX_HEADER_COUNT;
+    std::size_t maxHeaderBytes = DEFAULT_MAX_HEADER_BYTES;
+};
+inline ParserLimits parserLimits;
+
+enum ParseStatus {
+    PARSE_INCOMPLETE,        // need more bytes
+    PARSE_DONE,              // request() is filled in
+    PARSE_BAD,               // malformed -> 400
+    PARSE_URI_TOO_LONG,      // request line over the limit -> 414
+    PARSE_HEADERS_TOO_LARGE  // too many headers / too many header bytes -> 431
+};
+
+struct HttpHeader {
+    HeaderId id;            // HDR_UNKNOWN for anything not in knownHeaderNames
+    std::string_view name;
+    std::string_view value; // leading/trailing whitespace already trimmed
+};
+
+/*
+    A parsed request. Everything points into the receive buffer, so it's only good until that
+    buffer is read into again (i.e. for as long as it takes to queue the response).
+    method is empty if the request line was blank.
+    headers is every header in the order it came in, known[] indexes the well-known ones so
+    header(HDR_RANGE) is a single array lookup. (A repeated header: known[] points at the first one.)
+*/
+struct HttpRequest {
+    std::string_view method;
+    std::string_view target;
+    std::string_view version;
+    HttpHeader headers[MAX_HEADER_COUNT];
+    std::size_t headerCount = 0;
+    uint8_t known[HDR_COUNT] = {}; // index into headers + 1, 0 if the client didn't send it
+
+    bool has(HeaderId id) const { return known[id] != 0; }
+    std::string_view header(HeaderId id) const {
+        return known[id] ? headers[known[id] - 1].value : std::string_view();
+    }
+};
+static_assert(MAX_HEADER_COUNT < 255, "HttpRequest::known stores header indexes in a uint8_t");
+
+/*
+    One reusable receive buffer per connection. Bytes are read in at end(), requests are consumed
+    from the front, and compact() slides whatever is left back to the start before the next read.
+    It's allocated once (on first use) at parserLimits.maxHeaderBytes, which also caps how much of a
+    request we'll ever hold on to.
+*/
+class RecvBuffer {
+public:
+    const char *data() const { return storage.get() + start; }
+    std::size_t size() const { return end - start; }
+
+    char *writePtr();
+    std::size_t writable() const { return capacity - end; }
+    void commit(std::size_t bytes) { end += bytes; }
+
+    void consume(std::size_t bytes);
+    void compact();
+
+private:
+    std::unique_ptr<char[]> storage;
+    std::size_t capacity = 0;
+    std::size_t start = 0;
+    std::size_t end = 0;
+};
+
+/*
+    Incremental request parser. Call parse() with everything buffered so far (same start every time,
+    more bytes at the end); it picks up scanning where the last call stopped, so a header trickling
+    in a few bytes at a time is only ever looked at once. Positions are kept as offsets, so it doesn't
+    mind the buffer being compacted between calls. No allocation anywhere.
+*/
+class HttpParser {
+public:
+    ParseStatus parse(const char *buf, std::size_t len);
+    void reset();
+
+    bool done() const { return state == PARSED; }
+    const HttpRequest &request() const { return req; }
+    std::size_t consumed() const { return consumedBytes; } // bytes of buf that belonged to this request
+
+private:
+    struct Span {
+        uint32_t offset;
+        uint32_t len;
+    };
+    enum State { REQUEST_LINE, HEADER_LINES, PARSED };
+
+    ParseStatus finish(ParseStatus status, const char *buf, std::size_t consumedLen);
+    bool parseRequestLine(const char *buf, std::size_t lineStart, std::size_t lineEnd);
+    bool parseHeaderLine(const char *buf, std::size_t lineStart, std::size_t lineEnd);
+
+    State state = REQUEST_LINE;
+    std::size_t scanPos = 0;   // first byte we haven't looked at yet
+    std::size_t lineStart = 0; // where the line being scanned starts
+    std::size_t consumedBytes = 0;
+
+    Span requestParts[3] = {};
+    Span headerSpans[MAX_HEADER_COUNT][2];
+    HeaderId headerIds[MAX_HEADER_COUNT];
+    std::size_t headerCount = 0;
+
+    HttpRequest req;
+};
+
+#endif
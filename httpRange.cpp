@@ -0,0 +1,78 @@
+#include "httpRange.h"
+
+#include <algorithm>
+#include <strings.h>
+
+static std::string_view trim(std::string_view text) {
+    while (!text.empty() && (text.front() == ' ' || text.front() == '\t')) text.remove_prefix(1);
+    while (!text.empty() && (text.back() == ' ' || text.back() == '\t')) text.remove_suffix(1);
+    return text;
+}
+
+// All digits, and small enough to not overflow. -1 if not.
+static int64_t parseNumber(std::string_view digits) {
+    if (digits.empty() || digits.size() > 18) return -1;
+    int64_t value = 0;
+    for (char c : digits) {
+        if (c < '0' || c > '9') return -1;
+        value = value * 10 + (c - '0');
+    }
+    return value;
+}
+
+void parseRangeHeader(std::string_view value, RangeRequest &request) {
+    request.present = false;
+    request.count = 0;
+
+    value = trim(value);
+    if (value.size() < 6 || strncasecmp(value.data(), "bytes=", 6) != 0) return;
+    value.remove_prefix(6);
+
+    while (1) {
+        std::size_t comma = value.find(',');
+        std::string_view item = trim(value.substr(0, comma));
+
+        if (!item.empty()) { // (empty list elements are allowed, "bytes=0-1,,5-6")
+            std::size_t dash = item.find('-');
+            if (dash == std::string_view::npos || request.count == MAX_RANGES) return;
+
+            std::string_view firstText = trim(item.substr(0, dash));
+            std::string_view lastText = trim(item.substr(dash + 1));
+            RangeSpec spec{-1, -1};
+            if (firstText.empty()) {
+                spec.last = parseNumber(lastText); // "-500"
+                if (spec.last < 0) return;
+            } else {
+                spec.first = parseNumber(firstText);
+                if (spec.first < 0) return;
+                if (!lastText.empty()) { // "0-499", or "500-" when empty
+                    spec.last = parseNumber(lastText);
+                    if (spec.last < spec.first) return;
+                }
+            }
+            request.specs[request.count++] = spec;
+        }
+
+        if (comma == std::string_view::npos) break;
+        value.remove_prefix(comma + 1);
+    }
+    request.present = request.count > 0;
+}
+
+int resolveRanges(const RangeRequest &request, uint64_t size, ByteRange *out) {
+    int count = 0;
+    for (int i = 0; i < request.count; i++) {
+        const RangeSpec &spec = request.specs[i];
+        if (spec.first < 0) {
+            uint64_t length = std::min<uint64_t>(static_cast<uint64_t>(spec.last), size);
+            if (length == 0) continue;
+            out[count++] = ByteRange{size - length, length};
+        } else {
+            uint64_t first = static_cast<uint64_t>(spec.first);
+            if (first >= size) continue;
+            uint64_t last = (spec.last < 0 || static_cast<uint64_t>(spec.last) >= size) ? size - 1 : static_cast<uint64_t>(spec.last);
+            out[count++] = ByteRange{first, last - first + 1};
+        }
+    }
+    return count;
+}
@@ -0,0 +1,36 @@
+#ifndef HTTPRANGE_H
+#define HTTPRANGE_H
+
+#include <cstdint>
+#include <string_view>
+
+#define MAX_RANGES 8 // more than this in one Range header and we just send the whole file
+
+// One "first-last" out of a Range header, before we know how big the file is.
+struct RangeSpec {
+    int64_t first; // -1: suffix range, the last `last` bytes
+    int64_t last;  // -1: open ended, through to the end of the file
+};
+
+struct RangeRequest {
+    bool present = false; // a Range header we understood (bytes=, at most MAX_RANGES, well formed)
+    int count = 0;
+    RangeSpec specs[MAX_RANGES];
+};
+
+// A range resolved against the file size: always inside the file, never empty.
+struct ByteRange {
+    uint64_t offset;
+    uint64_t length;
+};
+
+/*
+    "bytes=0-499, 1000-, -200" -> request. Anything we don't understand (another unit, bad syntax,
+    too many ranges) leaves present false, and the Range header is ignored (that's what RFC 7233 wants).
+*/
+void parseRangeHeader(std::string_view value, RangeRequest &request);
+
+// Fills `out` with the ranges that fall inside a `size` byte file and returns how many. 0 means 416.
+int resolveRanges(const RangeRequest &request, uint64_t size, ByteRange *out);
+
+#endif
@@ -0,0 +1,572 @@
+/*
+    loadGen: drive the server over loopback with N concurrent connections and report throughput
+    and latency percentiles. Not part of the server.
+
+    Closed loop (default): every connection sends its next request as soon as the last response is in,
+    so the server sets the pace. Open loop (-r RATE): every connection has its own fixed schedule of
+    RATE/N requests a second, and a request's latency counts from when it was *supposed* to go out.
+    A slow response delays the requests queued behind it, and they pay for it, instead of silently not
+    being sent (coordinated omission). For closed loop the same correction is made afterwards the way
+    HdrHistogram does it, against an expected interval (-e, default the mean latency).
+
+    make loadGen && ./loadGen [-p PORT] [-c CONNECTIONS] [-t THREADS] [-d SECONDS] [-m keepalive|close]
+                              [-r REQUESTS_PER_SECOND] [-e EXPECTED_INTERVAL_US] [-u MIX]
+    MIX is PATH=WEIGHT,... where PATH "!bad" sends a malformed request (400). The default is every
+    file in data/ at weight 10, plus a missing file (404) and a malformed request (400) at weight 1.
+*/
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "metrics.h" // just the histogram layout (latencyBucket & co)
+
+using Clock = std::chrono::steady_clock;
+
+#define BAD_REQUEST_PATH "!bad"
+#define READ_BUFFER_BYTES (64 * 1024)
+#define DRAIN_SECONDS 2 // how long in-flight requests get to finish once the run is over
+#define RETRY_MS 10     // closed loop: pause after a failed request before the connection tries again
+
+struct Options {
+    int port = 1993;
+    int connections = 16;
+    int threads = 0; // 0: min(connections, cores)
+    int seconds = 10;
+    bool keepAlive = true;
+    double rate = 0; // total requests/s, 0 is closed loop
+    double expectedIntervalUs = 0; // closed loop correction, 0: the mean latency
+    std::string dataDir = "data";
+    std::string mix;
+};
+
+struct MixEntry {
+    std::string request; // the whole request, ready to send
+    std::string label;
+    unsigned weight;
+};
+
+struct Histogram {
+    uint64_t buckets[LATENCY_BUCKETS] = {};
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+
+    void record(uint64_t us, uint64_t times = 1) {
+        uint32_t clamped = static_cast<uint32_t>(std::min<uint64_t>(us, 0xffffffffu));
+        buckets[latencyBucket(clamped)] += times;
+        count += times;
+        sum += us * times;
+        max = std::max(max, us);
+    }
+
+    void add(const Histogram &other) {
+        for (unsigned i = 0; i < LATENCY_BUCKETS; i++) buckets[i] += other.buckets[i];
+        count += other.count;
+        sum += other.sum;
+        max = std::max(max, other.max);
+    }
+
+    uint64_t percentile(double p) const {
+        uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(p * static_cast<double>(count) + 0.999999));
+        uint64_t seen = 0;
+        for (unsigned i = 0; i < LATENCY_BUCKETS; i++) {
+            seen += buckets[i];
+            if (seen >= rank) return std::min(latencyBucketTop(i), max);
+        }
+        return max;
+    }
+
+    /*
+        HdrHistogram's copyCorrectedForCoordinatedOmission: a closed loop client waiting on one slow
+        response didn't send the requests it would have in the meantime, so for every value above the
+        expected interval add the ones those missing requests would have seen (value - interval, - 2x...).
+    */
+    Histogram corrected(uint64_t intervalUs) const {
+        Histogram out;
+        for (unsigned i = 0; i < LATENCY_BUCKETS; i++) {
+            if (buckets[i] == 0) continue;
+            uint64_t value = std::min(latencyBucketTop(i), max);
+            out.record(value, buckets[i]);
+            if (intervalUs == 0) continue;
+            for (uint64_t missing = value; missing > intervalUs; ) {
+                missing -= intervalUs;
+                out.record(missing, buckets[i]);
+            }
+        }
+        return out;
+    }
+};
+
+struct Results {
+    Histogram latency;
+    uint64_t completed = 0;
+    uint64_t bytes = 0;
+    uint64_t errors = 0;   // connect failures, resets, responses we couldn't make sense of
+    uint64_t connects = 0;
+    std::map<int, uint64_t> statuses;
+};
+
+enum ConnPhase {
+    PHASE_IDLE,      // waiting for nextDue: its next scheduled send (open loop) or a retry
+    PHASE_CONNECTING,
+    PHASE_WRITING,
+    PHASE_READING
+};
+
+struct LoadConn {
+    int fd = -1;
+    ConnPhase phase = PHASE_IDLE;
+    const MixEntry *entry = nullptr;
+    std::size_t sent = 0;
+    std::string in;
+    Clock::time_point intended; // when this request should have gone out, latency counts from here
+    Clock::time_point nextDue;  // open loop schedule, or when to retry after a failure
+};
+
+// xorshift, one per thread: the mix pick shouldn't be what we end up measuring.
+struct Random {
+    uint64_t state;
+    explicit Random(uint64_t seed) : state(seed * 0x9e3779b97f4a7c15ull + 1) {}
+    uint64_t next() {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    }
+};
+
+static std::string buildRequest(const std::string &path, bool keepAlive) {
+    if (path == BAD_REQUEST_PATH) return "BOGUS / HTTP/1.1\r\n\r\n";
+    return "GET " + path + " HTTP/1.1\r\nHost: localhost\r\nUser-Agent: loadGen\r\nConnection: "
+        + (keepAlive ? "keep-alive" : "close") + "\r\n\r\n";
+}
+
+static std::vector<MixEntry> buildMix(const Options &options) {
+    std::vector<std::pair<std::string, unsigned>> weighted;
+    if (!options.mix.empty()) {
+        std::string mix = options.mix;
+        std::size_t start = 0;
+        while (start <= mix.size()) {
+            std::size_t comma = mix.find(',', start);
+            std::string item = mix.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+            std::size_t equals = item.find('=');
+            unsigned weight = (equals == std::string::npos) ? 1 : static_cast<unsigned>(std::stoul(item.substr(equals + 1)));
+            if (!item.empty()) weighted.emplace_back(item.substr(0, equals), weight);
+            if (comma == std::string::npos) break;
+            start = comma + 1;
+        }
+    } else {
+        std::error_code error;
+        for (const auto &file : std::filesystem::directory_iterator(options.dataDir, error)) {
+            if (file.is_regular_file()) weighted.emplace_back("/" + file.path().filename().string(), 10);
+        }
+        weighted.emplace_back("/missing1.html", 1);
+        weighted.emplace_back(BAD_REQUEST_PATH, 1);
+    }
+
+    std::vector<MixEntry> mix;
+    for (const auto &item : weighted) {
+        if (item.second == 0) continue;
+        mix.push_back(MixEntry{buildRequest(item.first, options.keepAlive), item.first, item.second});
+    }
+    return mix;
+}
+
+/*
+    One thread's share of the connections, on its own epoll. Everything is non-blocking, so a
+    connection stuck waiting on the server doesn't hold up the others on the same thread.
+*/
+class Worker {
+public:
+    Worker(const Options &options, const std::vector<MixEntry> &mix, int connections, unsigned seed)
+        : options(options), mix(mix), conns(connections), random(seed) {
+        for (const MixEntry &entry : mix) totalWeight += entry.weight;
+        buffer.resize(READ_BUFFER_BYTES);
+    }
+
+    void run(Clock::time_point start, Clock::time_point stop);
+    Results results;
+
+private:
+    const MixEntry *pick() {
+        uint64_t roll = random.next() % totalWeight;
+        for (const MixEntry &entry : mix) {
+            if (roll < entry.weight) return &entry;
+            roll -= entry.weight;
+        }
+        return &mix.back();
+    }
+
+    void startRequest(LoadConn &conn, Clock::time_point intended);
+    bool openSocket(LoadConn &conn);
+    void closeSocket(LoadConn &conn);
+    void fail(LoadConn &conn);
+    void onReady(LoadConn &conn, uint32_t events);
+    bool writeSome(LoadConn &conn);
+    bool readSome(LoadConn &conn);
+    void finished(LoadConn &conn, int status, std::size_t bytes, bool serverCloses);
+    void next(LoadConn &conn);
+
+    const Options &options;
+    const std::vector<MixEntry> &mix;
+    std::vector<LoadConn> conns;
+    Random random;
+    uint64_t totalWeight = 0;
+    std::vector<char> buffer;
+    int epollFd = -1;
+    bool stopping = false;
+    std::chrono::nanoseconds interval{0}; // open loop, per connection
+};
+
+bool Worker::openSocket(LoadConn &conn) {
+    conn.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (conn.fd < 0) return false;
+    int one = 1;
+    setsockopt(conn.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(static_cast<uint16_t>(options.port));
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(conn.fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 && errno != EINPROGRESS) {
+        close(conn.fd);
+        conn.fd = -1;
+        return false;
+    }
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = &conn;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, conn.fd, &ev);
+    results.connects++;
+    return true;
+}
+
+void Worker::closeSocket(LoadConn &conn) {
+    if (conn.fd >= 0) close(conn.fd);
+    conn.fd = -1;
+}
+
+void Worker::startRequest(LoadConn &conn, Clock::time_point intended) {
+    conn.entry = pick();
+    conn.sent = 0;
+    conn.in.clear();
+    conn.intended = intended;
+    if (conn.fd < 0) {
+        if (!openSocket(conn)) {
+            fail(conn);
+            return;
+        }
+        conn.phase = PHASE_CONNECTING; // EPOLLOUT says when it's through
+        return;
+    }
+    conn.phase = PHASE_WRITING;
+    if (!writeSome(conn)) fail(conn);
+}
+
+/*
+    Something went wrong with this request: count it, and leave the connection idle for run() to start
+    over on a new socket (not straight away from here, a refused connect would just come right back).
+*/
+void Worker::fail(LoadConn &conn) {
+    results.errors++;
+    closeSocket(conn);
+    conn.phase = PHASE_IDLE;
+    if (interval.count() == 0) {
+        conn.nextDue = Clock::now() + std::chrono::milliseconds(RETRY_MS);
+    } else {
+        conn.nextDue += interval;
+    }
+}
+
+// Request done (one way or another), line up the next one.
+void Worker::next(LoadConn &conn) {
+    conn.phase = PHASE_IDLE;
+    if (stopping) return;
+    if (interval.count() == 0) {
+        startRequest(conn, Clock::now());
+        return;
+    }
+    conn.nextDue += interval;
+    // behind schedule: go now, but the latency still counts from when it was due.
+    if (conn.nextDue <= Clock::now()) startRequest(conn, conn.nextDue);
+}
+
+bool Worker::writeSome(LoadConn &conn) {
+    const std::string &request = conn.entry->request;
+    while (conn.sent < request.size()) {
+        ssize_t wrote = send(conn.fd, request.data() + conn.sent, request.size() - conn.sent, MSG_NOSIGNAL);
+        if (wrote < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) return true;
+            return false;
+        }
+        conn.sent += static_cast<std::size_t>(wrote);
+    }
+    conn.phase = PHASE_READING;
+    return readSome(conn);
+}
+
+static int parseStatus(const std::string &head) {
+    if (head.compare(0, 5, "HTTP/") != 0) return -1;
+    std::size_t space = head.find(' ');
+    if (space == std::string::npos || space + 4 > head.size()) return -1;
+    return std::atoi(head.c_str() + space + 1);
+}
+
+// Value of a header in the head block (case-insensitive name), "" if it isn't there.
+static std::string headerValue(const std::string &head, const char *name) {
+    std::size_t nameLen = strlen(name);
+    for (std::size_t line = head.find("\r\n"); line != std::string::npos; line = head.find("\r\n", line + 2)) {
+        std::size_t start = line + 2;
+        if (start + nameLen + 1 <= head.size() && strncasecmp(head.c_str() + start, name, nameLen) == 0
+            && head[start + nameLen] == ':') {
+            std::size_t value = head.find_first_not_of(' ', start + nameLen + 1);
+            std::size_t end = head.find("\r\n", start);
+            if (value == std::string::npos || value > end) return "";
+            return head.substr(value, end - value);
+        }
+    }
+    return "";
+}
+
+// Returns false if the connection broke before the response was whole.
+bool Worker::readSome(LoadConn &conn) {
+    while (1) {
+        ssize_t got = recv(conn.fd, buffer.data(), buffer.size(), 0);
+        bool eof = (got == 0);
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) return true;
+            return false;
+        }
+        conn.in.append(buffer.data(), static_cast<std::size_t>(got));
+
+        std::size_t headEnd = conn.in.find("\r\n\r\n");
+        if (headEnd == std::string::npos) {
+            if (eof) return false;
+            continue;
+        }
+        std::string head = conn.in.substr(0, headEnd + 2);
+        int status = parseStatus(head);
+        if (status < 0) return false;
+        std::string length = headerValue(head, "Content-Length");
+        bool serverCloses = strcasecmp(headerValue(head, "Connection").c_str(), "close") == 0;
+        std::size_t total = headEnd + 4 + (length.empty() ? 0 : std::stoull(length));
+        if (length.empty() && !eof) continue; // no length: the body runs to the end of the connection
+        if (conn.in.size() < total) {
+            if (eof) return false;
+            continue;
+        }
+        finished(conn, status, length.empty() ? conn.in.size() : total, serverCloses || eof);
+        return true;
+    }
+}
+
+void Worker::finished(LoadConn &conn, int status, std::size_t bytes, bool serverCloses) {
+    auto latency = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - conn.intended).count();
+    results.latency.record(static_cast<uint64_t>(std::max<int64_t>(0, latency)));
+    results.completed++;
+    results.bytes += bytes;
+    results.statuses[status]++;
+    if (serverCloses || !options.keepAlive) closeSocket(conn);
+    next(conn);
+}
+
+void Worker::onReady(LoadConn &conn, uint32_t events) {
+    if (conn.phase == PHASE_CONNECTING) {
+        if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) return;
+        int error = 0;
+        socklen_t len = sizeof(error);
+        getsockopt(conn.fd, SOL_SOCKET, SO_ERROR, &error, &len);
+        if (error != 0) {
+            fail(conn);
+            return;
+        }
+        conn.phase = PHASE_WRITING;
+    }
+    if (conn.phase == PHASE_WRITING) {
+        if (!writeSome(conn)) fail(conn);
+        return;
+    }
+    if (conn.phase == PHASE_READING && !readSome(conn)) fail(conn);
+}
+
+void Worker::run(Clock::time_point start, Clock::time_point stop) {
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd < 0) {
+        std::cerr << "epoll_create1() failed: " << strerror(errno) << std::endl;
+        return;
+    }
+
+    int total = options.connections;
+    if (options.rate > 0) {
+        interval = std::chrono::nanoseconds(static_cast<int64_t>(1e9 * total / options.rate));
+    }
+    for (std::size_t i = 0; i < conns.size(); i++) {
+        LoadConn &conn = conns[i];
+        if (interval.count() == 0) {
+            startRequest(conn, Clock::now());
+        } else {
+            // spread the first sends over one interval, so they don't all land at once.
+            conn.nextDue = start + interval * static_cast<int64_t>(random.next() % 1000) / 1000;
+        }
+    }
+
+    epoll_event events[64];
+    while (1) {
+        auto now = Clock::now();
+        if (!stopping && now >= stop) stopping = true;
+        if (stopping) {
+            bool busy = std::any_of(conns.begin(), conns.end(), [](const LoadConn &c) { return c.phase != PHASE_IDLE; });
+            if (!busy || now >= stop + std::chrono::seconds(DRAIN_SECONDS)) break;
+        }
+
+        // send whatever is due (open loop schedule, or a retry), and sleep no longer than until the next one is.
+        int timeout = 100;
+        if (!stopping) {
+            for (LoadConn &conn : conns) {
+                if (conn.phase != PHASE_IDLE) continue;
+                if (conn.nextDue <= now) {
+                    startRequest(conn, interval.count() > 0 ? conn.nextDue : now);
+                    continue;
+                }
+                auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(conn.nextDue - now).count();
+                timeout = std::min<int>(timeout, static_cast<int>(wait));
+            }
+        }
+
+        int ready = epoll_wait(epollFd, events, 64, timeout);
+        for (int i = 0; i < ready; i++) {
+            onReady(*static_cast<LoadConn*>(events[i].data.ptr), events[i].events);
+        }
+    }
+
+    for (LoadConn &conn : conns) {
+        if (conn.phase != PHASE_IDLE) results.errors++; // never finished
+        closeSocket(conn);
+    }
+    close(epollFd);
+}
+
+static void printLatency(const char *title, const Histogram &latency) {
+    if (latency.count == 0) return;
+    std::cout << title << " (us): mean " << latency.sum / latency.count
+              << ", p50 " << latency.percentile(0.50) << ", p90 " << latency.percentile(0.90)
+              << ", p99 " << latency.percentile(0.99) << ", p99.9 " << latency.percentile(0.999)
+              << ", max " << latency.max << std::endl;
+}
+
+static void usage(const char *prog) {
+    std::cerr << "usage: " << prog << " [-p PORT] [-c CONNECTIONS] [-t THREADS] [-d SECONDS] [-m keepalive|close]"
+              << " [-r REQUESTS_PER_SECOND] [-e EXPECTED_INTERVAL_US] [-D DATA_DIR] [-u PATH=WEIGHT,...]" << std::endl;
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    Options options;
+    int opt;
+    try {
+        while ((opt = getopt(argc, argv, "p:c:t:d:m:r:e:D:u:")) != -1) {
+            switch (opt) {
+            case 'p': options.port = std::stoi(optarg); break;
+            case 'c': options.connections = std::stoi(optarg); break;
+            case 't': options.threads = std::stoi(optarg); break;
+            case 'd': options.seconds = std::stoi(optarg); break;
+            case 'r': options.rate = std::stod(optarg); break;
+            case 'e': options.expectedIntervalUs = std::stod(optarg); break;
+            case 'D': options.dataDir = optarg; break;
+            case 'u': options.mix = optarg; break;
+            case 'm':
+                if (std::string(optarg) == "close") {
+                    options.keepAlive = false;
+                } else if (std::string(optarg) != "keepalive") {
+                    usage(argv[0]);
+                }
+                break;
+            default:
+                usage(argv[0]);
+            }
+        }
+    } catch (const std::exception&) {
+        usage(argv[0]);
+    }
+    if (options.connections < 1 || options.seconds < 1 || options.rate < 0) usage(argv[0]);
+
+    std::vector<MixEntry> mix = buildMix(options);
+    if (mix.empty()) {
+        std::cerr << "nothing to request (empty mix, or no files in " << options.dataDir << ")" << std::endl;
+        return 1;
+    }
+
+    int threads = options.threads > 0 ? options.threads
+        : std::min(options.connections, static_cast<int>(std::max(1u, std::thread::hardware_concurrency())));
+    threads = std::min(threads, options.connections);
+
+    std::cout << "loadGen: " << options.connections << " connections on " << threads << " threads, "
+              << options.seconds << "s, " << (options.keepAlive ? "keep-alive" : "one connection per request") << ", "
+              << (options.rate > 0 ? "open loop at " + std::to_string(static_cast<long>(options.rate)) + " req/s"
+                                   : std::string("closed loop")) << std::endl;
+    std::cout << "mix:";
+    for (const MixEntry &entry : mix) std::cout << " " << entry.label << "=" << entry.weight;
+    std::cout << std::endl;
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    for (int i = 0; i < threads; i++) {
+        int share = options.connections / threads + (i < options.connections % threads ? 1 : 0);
+        workers.push_back(std::make_unique<Worker>(options, mix, share, static_cast<unsigned>(i + 1)));
+    }
+
+    auto start = Clock::now();
+    auto stop = start + std::chrono::seconds(options.seconds);
+    std::vector<std::thread> running;
+    for (auto &worker : workers) running.emplace_back(&Worker::run, worker.get(), start, stop);
+    for (auto &thread : running) thread.join();
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    elapsed = std::min(elapsed, static_cast<double>(options.seconds)); // the drain at the end isn't load
+
+    Results total;
+    for (auto &worker : workers) {
+        Results &r = worker->results;
+        total.latency.add(r.latency);
+        total.completed += r.completed;
+        total.bytes += r.bytes;
+        total.errors += r.errors;
+        total.connects += r.connects;
+        for (const auto &status : r.statuses) total.statuses[status.first] += status.second;
+    }
+
+    std::cout << "requests:   " << total.completed << " (" << total.completed / elapsed << " req/s, "
+              << total.bytes / elapsed / (1024 * 1024) << " MB/s)" << std::endl;
+    std::cout << "connects:   " << total.connects << ", errors: " << total.errors << std::endl;
+    std::cout << "status:    ";
+    for (const auto &status : total.statuses) std::cout << " " << status.first << "=" << status.second;
+    std::cout << std::endl;
+
+    if (options.rate > 0) {
+        // measured from each request's scheduled time, so the correction is already in there.
+        printLatency("latency, from scheduled send", total.latency);
+    } else if (total.latency.count > 0) {
+        printLatency("latency, as measured", total.latency);
+        double mean = total.latency.count ? static_cast<double>(total.latency.sum) / total.latency.count : 0;
+        uint64_t interval = static_cast<uint64_t>(options.expectedIntervalUs > 0 ? options.expectedIntervalUs : mean);
+        std::cout << "coordinated omission correction, expected interval " << interval << "us:" << std::endl;
+        printLatency("latency, corrected", total.latency.corrected(interval));
+    }
+    return total.completed > 0 ? 0 : 1;
+}
@@ -10,22 +10,93 @@
 #ifndef LOGGING_H
 #define LOGGING_H
 
+#include <cstring>
 #include <iostream>
-#include <filesystem>
 #include <string>
+#include <atomic>
 
-#ifndef  __FILE_NAME__
-#define __FILE_NAME__ std::filesystem::path(__FILE__).filename().string()
+#include "asyncLog.h"
+
+/*
+    The most verbose level compiled in at all, on the same scale as -d (6 = TRACE ... 1 = FATAL).
+    Anything above it is gone from the binary, not just skipped: make LOG_COMPILED_LEVEL=4 leaves
+    no trace of the TRACE and DEBUG statements in a release build. -d still filters at runtime
+    among the levels that are left.
+*/
+#ifndef LOG_COMPILED_LEVEL
+#define LOG_COMPILED_LEVEL 6
+#endif
+
+// atomic so worker threads can read it while main is (only ever at startup) writing it.
+inline std::atomic<int> LOG_LEVEL{4};
+
+/*
+    Where a message came from, " (file.cpp:123)". With __FILE_NAME__ (gcc 12+, clang) the whole thing
+    is one string literal; otherwise the directory gets stripped off __FILE__ by the compiler, either
+    way nothing is worked out when the line is logged.
+*/
+#define LOG_STRINGIFY2(x) #x
+#define LOG_STRINGIFY(x) LOG_STRINGIFY2(x)
+#ifdef __FILE_NAME__
+#define LOG_LOCATION " (" __FILE_NAME__ ":" LOG_STRINGIFY(__LINE__) ")"
+#else
+constexpr const char *logFileName(const char *path) {
+    const char *name = path;
+    for (const char *p = path; *p; p++) {
+        if (*p == '/') name = p + 1;
+    }
+    return name;
+}
+#define LOG_LOCATION " (" << [] { constexpr const char *name = logFileName(__FILE__); return name; }() \
+                     << ":" LOG_STRINGIFY(__LINE__) ")"
 #endif
 
-inline int LOG_LEVEL = 4;
-#define TRACE   if (LOG_LEVEL > 5) { std::cerr << "TRACE: "
-#define DEBUG   if (LOG_LEVEL > 4) { std::cerr << "DEBUG: "
-#define INFO    if (LOG_LEVEL > 3) { std::cerr << "INFO: "
-#define WARNING if (LOG_LEVEL > 2) { std::cerr << "WARNING: "
-#define ERROR   if (LOG_LEVEL > 1) { std::cerr << "ERROR: "
-#define FATAL   if (LOG_LEVEL > 0) { std::cerr << "FATAL: "
-#define ENDL  " (" << __FILE_NAME__ << ":" << __LINE__ << ")" << std::endl; }
+// if constexpr, so a level that isn't compiled in doesn't even leave the runtime check behind.
+#define LOG_AT(level, prefix) \
+    if constexpr (LOG_COMPILED_LEVEL >= level) if (__builtin_expect(LOG_LEVEL.load(std::memory_order_relaxed) >= level, 0)) { LogLine() << prefix
+
+/*
+    Collects one message in a fixed buffer on the stack (no allocation) and hands it to the
+    background writer in asyncLog.cpp when the statement ends, so logging never blocks on stderr
+    and messages from different threads can't get spliced into each other mid-line.
+*/
+class LogLine {
+public:
+    LogLine() : out(&buffer) {}
+    LogLine(const LogLine&) = delete;
+    ~LogLine() { logSubmit(buffer.text, buffer.length()); }
+
+    template <typename T>
+    LogLine &operator<<(const T &value) { out << value; return *this; }
+    LogLine &operator<<(std::ostream &(*manip)(std::ostream &)) { out << manip; return *this; }
+
+private:
+    // streambuf over a plain array; once it's full the rest of the line is cut and marked with "...".
+    struct LineBuffer : std::streambuf {
+        char text[LOG_RECORD_MAX];
+        bool truncated = false;
+        LineBuffer() { setp(text, text + sizeof(text)); }
+        int_type overflow(int_type) override {
+            if (!truncated) {
+                truncated = true;
+                std::memcpy(text + sizeof(text) - 3, "...", 3);
+            }
+            return traits_type::eof();
+        }
+        std::size_t length() const { return static_cast<std::size_t>(pptr() - pbase()); }
+    };
+
+    LineBuffer buffer;
+    std::ostream out;
+};
+
+#define TRACE   LOG_AT(6, "TRACE: ")
+#define DEBUG   LOG_AT(5, "DEBUG: ")
+#define INFO    LOG_AT(4, "INFO: ")
+#define WARNING LOG_AT(3, "WARNING: ")
+#define ERROR   LOG_AT(2, "ERROR: ")
+#define FATAL   LOG_AT(1, "FATAL: ")
+#define ENDL  LOG_LOCATION; }
 
 
 #endif //LOGGING_H
\ No newline at end of file
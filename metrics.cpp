@@ -0,0 +1,251 @@
+#include "metrics.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdarg>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace {
+
+const char *statusNames[STATUS_SLOTS] = {"200", "206", "304", "400", "404", "414", "416", "431", "503", "other"};
+const char *timeoutNames[TIMEOUT_KINDS] = {"idle", "header", "write"};
+
+StatusSlot slotFor(int status) {
+    switch (status) {
+        case 200: return STATUS_200;
+        case 206: return STATUS_206;
+        case 304: return STATUS_304;
+        case 400: return STATUS_400;
+        case 404: return STATUS_404;
+        case 414: return STATUS_414;
+        case 416: return STATUS_416;
+        case 431: return STATUS_431;
+        case 503: return STATUS_503;
+        default: return STATUS_OTHER;
+    }
+}
+
+// Only the owning thread writes, so a load and a store is enough (no locked add), and a scrape
+// reading it at the same time just sees the old or the new value.
+void bump(std::atomic<uint64_t> &counter, uint64_t by = 1) {
+    counter.store(counter.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+}
+
+struct alignas(64) StatusCounters {
+    std::atomic<uint64_t> requests;
+    std::atomic<uint64_t> bytes;
+    std::atomic<uint64_t> latencySum;
+    std::atomic<uint64_t> latencyMax;
+    std::atomic<uint64_t> buckets[LATENCY_BUCKETS];
+};
+
+struct ThreadMetrics {
+    alignas(64) std::atomic<uint64_t> opened;
+    std::atomic<uint64_t> closed;
+    std::atomic<uint64_t> timeouts[TIMEOUT_KINDS];
+    std::atomic<uint64_t> scrapes;
+    StatusCounters status[STATUS_SLOTS];
+};
+
+// Every thread's block. Blocks outlive their threads, so what an exited pool worker counted still adds up.
+std::mutex registryLock;
+std::vector<ThreadMetrics*> registry;
+const auto startedAt = std::chrono::steady_clock::now();
+
+ThreadMetrics &mine() {
+    thread_local ThreadMetrics *metrics = [] {
+        auto *created = new ThreadMetrics(); // () so it all starts zeroed
+        std::lock_guard<std::mutex> guard(registryLock);
+        registry.push_back(created);
+        return created;
+    }();
+    return *metrics;
+}
+
+// What a scrape adds up from every thread.
+struct StatusTotals {
+    uint64_t requests = 0;
+    uint64_t bytes = 0;
+    uint64_t latencySum = 0;
+    uint64_t latencyMax = 0;
+    uint64_t buckets[LATENCY_BUCKETS] = {};
+
+    // HdrHistogram's valueAtPercentile: the top of the bucket the p'th value falls in (never above the max seen).
+    uint64_t percentile(double p) const {
+        uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(p * static_cast<double>(requests))));
+        uint64_t seen = 0;
+        for (unsigned bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+            seen += buckets[bucket];
+            if (seen >= rank) return std::min(latencyBucketTop(bucket), latencyMax);
+        }
+        return latencyMax;
+    }
+};
+
+struct Totals {
+    double uptime = 0;
+    uint64_t opened = 0;
+    uint64_t closed = 0;
+    uint64_t requests = 0;
+    uint64_t bytes = 0;
+    uint64_t timeouts[TIMEOUT_KINDS] = {};
+    uint64_t scrapes = 0;
+    StatusTotals status[STATUS_SLOTS];
+};
+
+void addUp(Totals &totals) {
+    totals.uptime = std::chrono::duration<double>(std::chrono::steady_clock::now() - startedAt).count();
+
+    std::lock_guard<std::mutex> guard(registryLock);
+    for (ThreadMetrics *metrics : registry) {
+        totals.opened += metrics->opened.load(std::memory_order_relaxed);
+        totals.closed += metrics->closed.load(std::memory_order_relaxed);
+        for (int kind = 0; kind < TIMEOUT_KINDS; kind++) {
+            totals.timeouts[kind] += metrics->timeouts[kind].load(std::memory_order_relaxed);
+        }
+        totals.scrapes += metrics->scrapes.load(std::memory_order_relaxed);
+        for (int slot = 0; slot < STATUS_SLOTS; slot++) {
+            const StatusCounters &counters = metrics->status[slot];
+            StatusTotals &sum = totals.status[slot];
+            sum.requests += counters.requests.load(std::memory_order_relaxed);
+            sum.bytes += counters.bytes.load(std::memory_order_relaxed);
+            sum.latencySum += counters.latencySum.load(std::memory_order_relaxed);
+            sum.latencyMax = std::max(sum.latencyMax, counters.latencyMax.load(std::memory_order_relaxed));
+            for (unsigned bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+                sum.buckets[bucket] += counters.buckets[bucket].load(std::memory_order_relaxed);
+            }
+        }
+    }
+    for (const StatusTotals &sum : totals.status) {
+        totals.requests += sum.requests;
+        totals.bytes += sum.bytes;
+    }
+    // (a connection can close between us reading opened and closed on another thread)
+    if (totals.closed > totals.opened) totals.closed = totals.opened;
+}
+
+std::string format(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+std::string format(const char *fmt, ...) {
+    char text[512];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(text, sizeof(text), fmt, args);
+    va_end(args);
+    return text;
+}
+
+} // namespace
+
+void countResponse(int status, uint64_t bytes, uint32_t latencyUs) {
+    StatusCounters &counters = mine().status[slotFor(status)];
+    bump(counters.requests);
+    bump(counters.bytes, bytes);
+    bump(counters.latencySum, latencyUs);
+    bump(counters.buckets[latencyBucket(latencyUs)]);
+    if (latencyUs > counters.latencyMax.load(std::memory_order_relaxed)) {
+        counters.latencyMax.store(latencyUs, std::memory_order_relaxed);
+    }
+}
+
+void countConnectionOpened() {
+    bump(mine().opened);
+}
+
+void countConnectionClosed() {
+    bump(mine().closed);
+}
+
+void countTimeout(TimeoutKind kind) {
+    bump(mine().timeouts[kind]);
+}
+
+void countScrape() {
+    bump(mine().scrapes);
+}
+
+/*
+    One metric per line, Prometheus style, so it can be scraped as is (or just read):
+    requests{status="200"} 6504
+    latency_us{status="200",quantile="0.99"} 37
+*/
+std::string statsText() {
+    auto totals = std::make_unique<Totals>();
+    addUp(*totals);
+
+    std::string text = format("uptime_seconds %.3f\n", totals->uptime)
+        + format("connections_active %llu\n", static_cast<unsigned long long>(totals->opened - totals->closed))
+        + format("connections_total %llu\n", static_cast<unsigned long long>(totals->opened))
+        + format("requests_total %llu\n", static_cast<unsigned long long>(totals->requests))
+        + format("bytes_sent_total %llu\n", static_cast<unsigned long long>(totals->bytes))
+        + format("scrapes_total %llu\n", static_cast<unsigned long long>(totals->scrapes));
+    for (int kind = 0; kind < TIMEOUT_KINDS; kind++) {
+        text += format("timeouts_total{kind=\"%s\"} %llu\n", timeoutNames[kind],
+                       static_cast<unsigned long long>(totals->timeouts[kind]));
+    }
+
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    for (int slot = 0; slot < STATUS_SLOTS; slot++) {
+        const StatusTotals &sum = totals->status[slot];
+        if (sum.requests == 0) continue;
+        const char *name = statusNames[slot];
+        text += format("requests{status=\"%s\"} %llu\n", name, static_cast<unsigned long long>(sum.requests));
+        text += format("bytes_sent{status=\"%s\"} %llu\n", name, static_cast<unsigned long long>(sum.bytes));
+        text += format("latency_us_mean{status=\"%s\"} %llu\n", name,
+                       static_cast<unsigned long long>(sum.latencySum / sum.requests));
+        for (double q : quantiles) {
+            text += format("latency_us{status=\"%s\",quantile=\"%g\"} %llu\n", name, q,
+                           static_cast<unsigned long long>(sum.percentile(q)));
+        }
+        text += format("latency_us_max{status=\"%s\"} %llu\n", name, static_cast<unsigned long long>(sum.latencyMax));
+    }
+    return text;
+}
+
+// The same numbers, plus every non-empty histogram bucket as [top of bucket in us, count].
+std::string statsJson() {
+    auto totals = std::make_unique<Totals>();
+    addUp(*totals);
+
+    std::string json = format("{\"uptime_seconds\":%.3f,\"connections\":{\"active\":%llu,\"total\":%llu},"
+                              "\"requests\":%llu,\"bytes_sent\":%llu,\"scrapes\":%llu,\"timeouts\":{\"%s\":%llu,\"%s\":%llu,\"%s\":%llu},"
+                              "\"status\":{",
+                              totals->uptime, static_cast<unsigned long long>(totals->opened - totals->closed),
+                              static_cast<unsigned long long>(totals->opened),
+                              static_cast<unsigned long long>(totals->requests),
+                              static_cast<unsigned long long>(totals->bytes),
+                              static_cast<unsigned long long>(totals->scrapes),
+                              timeoutNames[TIMEOUT_IDLE], static_cast<unsigned long long>(totals->timeouts[TIMEOUT_IDLE]),
+                              timeoutNames[TIMEOUT_HEADER], static_cast<unsigned long long>(totals->timeouts[TIMEOUT_HEADER]),
+                              timeoutNames[TIMEOUT_WRITE], static_cast<unsigned long long>(totals->timeouts[TIMEOUT_WRITE]));
+    bool first = true;
+    for (int slot = 0; slot < STATUS_SLOTS; slot++) {
+        const StatusTotals &sum = totals->status[slot];
+        if (sum.requests == 0) continue;
+        if (!first) json += ",";
+        first = false;
+        json += format("\"%s\":{\"requests\":%llu,\"bytes_sent\":%llu,\"latency_us\":{\"mean\":%llu,"
+                       "\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu,\"buckets\":[",
+                       statusNames[slot], static_cast<unsigned long long>(sum.requests),
+                       static_cast<unsigned long long>(sum.bytes),
+                       static_cast<unsigned long long>(sum.latencySum / sum.requests),
+                       static_cast<unsigned long long>(sum.percentile(0.5)),
+                       static_cast<unsigned long long>(sum.percentile(0.9)),
+                       static_cast<unsigned long long>(sum.percentile(0.99)),
+                       static_cast<unsigned long long>(sum.percentile(0.999)),
+                       static_cast<unsigned long long>(sum.latencyMax));
+        bool firstBucket = true;
+        for (unsigned bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+            if (sum.buckets[bucket] == 0) continue;
+            json += format("%s[%llu,%llu]", firstBucket ? "" : ",",
+                           static_cast<unsigned long long>(latencyBucketTop(bucket)),
+                           static_cast<unsigned long long>(sum.buckets[bucket]));
+            firstBucket = false;
+        }
+        json += "]}}";
+    }
+    return json + "}}\n";
+}
@@ -0,0 +1,85 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+/*
+    Counters behind /__stats. Every thread that serves connections gets its own block of them
+    (each on its own cache lines) and only ever writes to that one, so counting a response is a few
+    plain stores with no lock and no shared cache line. Nothing gets added up until someone asks:
+    a scrape walks every thread's block.
+*/
+
+#define STATS_PATH "/__stats"            // text
+#define STATS_JSON_PATH "/__stats.json"  // the same, as JSON
+
+/*
+    Latency histogram, log-linear like HdrHistogram: values below 2^LATENCY_SUB_BITS microseconds
+    each get their own bucket, above that every power of two is split into 2^LATENCY_SUB_BITS equal
+    buckets, so any value lands in a bucket within ~3% of it. Covers the whole uint32_t range of us.
+*/
+#define LATENCY_SUB_BITS 5
+#define LATENCY_SUB_BUCKETS (1u << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS (LATENCY_SUB_BUCKETS + (32 - LATENCY_SUB_BITS) * LATENCY_SUB_BUCKETS)
+
+// Status codes we send, each with its own counters. Anything else would go in STATUS_OTHER.
+enum StatusSlot {
+    STATUS_200,
+    STATUS_206,
+    STATUS_304,
+    STATUS_400,
+    STATUS_404,
+    STATUS_414,
+    STATUS_416,
+    STATUS_431,
+    STATUS_503,
+    STATUS_OTHER,
+    STATUS_SLOTS
+};
+
+// Deadlines a connection can run out of (see timerWheel.h), each counted when it hangs one up.
+enum TimeoutKind {
+    TIMEOUT_IDLE,    // nothing of the next request after keepAliveTimeout
+    TIMEOUT_HEADER,  // a request header that didn't finish within headerTimeout
+    TIMEOUT_WRITE,   // a response that made no progress for writeTimeout
+    TIMEOUT_KINDS
+};
+
+constexpr unsigned latencyBucket(uint32_t us) {
+    if (us < LATENCY_SUB_BUCKETS) return us;
+    unsigned shift = 31 - static_cast<unsigned>(__builtin_clz(us)) - LATENCY_SUB_BITS;
+    return LATENCY_SUB_BUCKETS + shift * LATENCY_SUB_BUCKETS + ((us >> shift) - LATENCY_SUB_BUCKETS);
+}
+
+// Largest value that lands in bucket (what a percentile falling in it gets reported as).
+constexpr uint64_t latencyBucketTop(unsigned bucket) {
+    if (bucket < LATENCY_SUB_BUCKETS) return bucket;
+    unsigned shift = (bucket - LATENCY_SUB_BUCKETS) / LATENCY_SUB_BUCKETS;
+    uint64_t top = LATENCY_SUB_BUCKETS + (bucket - LATENCY_SUB_BUCKETS) % LATENCY_SUB_BUCKETS;
+    return ((top + 1) << shift) - 1;
+}
+
+static_assert(latencyBucket(0xffffffffu) == LATENCY_BUCKETS - 1, "histogram covers every uint32_t");
+static_assert(latencyBucketTop(latencyBucket(1000)) >= 1000 && latencyBucketTop(latencyBucket(1000) - 1) < 1000,
+              "bucket tops line up with latencyBucket");
+
+// A response finished: count it against its status, with its size and how long it took.
+void countResponse(int status, uint64_t bytes, uint32_t latencyUs);
+
+// Connection opened/closed on this thread (active = opened - closed, summed over every thread).
+void countConnectionOpened();
+void countConnectionClosed();
+
+// A connection was closed for running out of time.
+void countTimeout(TimeoutKind kind);
+
+// A /__stats response went out. Only counted here, never in the status/latency numbers it reports.
+void countScrape();
+
+// Add up every thread's counters into the /__stats body.
+std::string statsText();
+std::string statsJson();
+
+#endif
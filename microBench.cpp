@@ -0,0 +1,325 @@
+/*
+    microBench: the server's hot functions timed on their own, linked against the real objects
+    (webServer.cpp is compiled again with its main() renamed, see the Makefile).
+
+    readRequest   fed through a socketpair: whole request in one write, split in three, a byte at a
+                  time, and eight pipelined in one write
+    check_for_file  hit and miss, with the file index, with only the content cache, with neither
+    is_file_valid   a valid and an invalid name
+    sendLine        one header line queued
+    sendFile        every file in data/, from the content cache and straight from disk
+
+    Each one is run in batches of about BATCH_MS for ROUNDS rounds, and the fastest round's ns/op is
+    kept: interference only ever makes a round slower, so the minimum is the steadiest number.
+    Results go to -o as JSON. With -b the results are compared against that baseline, and anything
+    more than -t percent (default 20) slower fails the run, unless re-running the suite (up to
+    CONFIRM_RUNS times, best number kept) brings it back within bounds.
+
+    make bench            (compare against bench_baseline.json)
+    make bench-baseline   (store this machine's numbers as the baseline)
+*/
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <sys/socket.h>
+
+#include "webServer.h"
+#include "contentCache.h"
+#include "logging.h"
+
+#define BATCH_MS 20
+#define ROUNDS 9
+#define DEFAULT_TOLERANCE 20
+#define CONFIRM_RUNS 2
+
+struct BenchResult {
+    std::string name;
+    double nsPerOp;
+    uint64_t iterations;
+};
+
+static std::vector<BenchResult> results;
+
+/*
+    Time op() (one operation per call). The batch size is grown until a batch takes BATCH_MS, then
+    ROUNDS batches are timed and the fastest kept, so one descheduling doesn't decide the number.
+*/
+static void measure(const std::string &name, const std::function<void()> &op) {
+    using Clock = std::chrono::steady_clock;
+    uint64_t batch = 1;
+    while (1) {
+        auto start = Clock::now();
+        for (uint64_t i = 0; i < batch; i++) op();
+        if (Clock::now() - start >= std::chrono::milliseconds(BATCH_MS) || batch >= (1ull << 30)) break;
+        batch *= 2;
+    }
+
+    std::vector<double> rounds;
+    for (int round = 0; round < ROUNDS; round++) {
+        auto start = Clock::now();
+        for (uint64_t i = 0; i < batch; i++) op();
+        rounds.push_back(std::chrono::duration<double, std::nano>(Clock::now() - start).count() / batch);
+    }
+    double best = *std::min_element(rounds.begin(), rounds.end());
+    auto known = std::find_if(results.begin(), results.end(), [&](const BenchResult &r) { return r.name == name; });
+    if (known == results.end()) {
+        results.push_back(BenchResult{name, best, batch * ROUNDS});
+    } else {
+        known->nsPerOp = std::min(known->nsPerOp, best);
+        known->iterations += batch * ROUNDS;
+    }
+    printf("%-44s %12.1f ns/op\n", name.c_str(), best);
+    fflush(stdout);
+}
+
+static void writeAll(int fd, const char *data, std::size_t len) {
+    while (len > 0) {
+        ssize_t wrote = write(fd, data, len);
+        if (wrote <= 0) {
+            perror("write to socketpair");
+            exit(1);
+        }
+        data += wrote;
+        len -= static_cast<std::size_t>(wrote);
+    }
+}
+
+/*
+    readRequest on the server end of a socketpair, the request written into the other end in
+    `chunks` pieces with a readRequest after each (all but the last should say STEP_AGAIN).
+    pipelined writes `pipelined` requests at once and reads them all back, the cost is per request.
+*/
+static void benchReadRequest(const std::string &name, int chunks, int pipelined = 1) {
+    const std::string request = "GET /index1.html HTTP/1.1\r\nHost: localhost:1993\r\nUser-Agent: curl/7.88.1\r\n"
+                                "Accept: */*\r\nAccept-Encoding: gzip, br\r\n\r\n";
+    std::string payload;
+    for (int i = 0; i < pipelined; i++) payload += request;
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) < 0) {
+        perror("socketpair");
+        exit(1);
+    }
+    {
+        Connection conn(fds[0]);
+        int step = 0;
+        measure(name, [&] {
+            if (step == 0) {
+                if (chunks == 1) {
+                    writeAll(fds[1], payload.data(), payload.size());
+                } else {
+                    std::size_t per = (payload.size() + chunks - 1) / chunks;
+                    for (std::size_t offset = 0; offset < payload.size(); offset += per) {
+                        writeAll(fds[1], payload.data() + offset, std::min(per, payload.size() - offset));
+                        if (offset + per < payload.size() && readRequest(conn) != STEP_AGAIN) {
+                            std::cerr << name << ": request finished early" << std::endl;
+                            exit(1);
+                        }
+                    }
+                }
+            }
+            if (readRequest(conn) != STEP_DONE || conn.rtnCode != 200) {
+                std::cerr << name << ": request didn't come back as a 200" << std::endl;
+                exit(1);
+            }
+            resetRequest(conn);
+            step = (step + 1) % pipelined;
+        });
+    }
+    close(fds[1]);
+}
+
+static void benchCheckForFile(const std::string &config) {
+    std::string resolved;
+    measure("check_for_file/" + config + "/hit", [&] {
+        if (!check_for_file("/index1.html", resolved)) exit(1);
+    });
+    measure("check_for_file/" + config + "/miss", [&] {
+        if (check_for_file("/nope1.html", resolved)) exit(1);
+    });
+}
+
+static void benchSendFile(const std::string &config, const std::vector<std::string> &files) {
+    Connection conn(-1);
+    for (const std::string &file : files) {
+        std::string path = (webRoot / file).string();
+        measure("sendFile/" + config + "/" + file, [&] {
+            sendFile(conn, path);
+            if (conn.fileFd >= 0) { // a body that would have streamed: nothing to stream it to here
+                close(conn.fileFd);
+                conn.fileFd = -1;
+            }
+            resetRequest(conn);
+        });
+    }
+}
+
+// {"name": "...", "ns_per_op": 12.3, "iterations": 456} per line, between "benchmarks": [ and ].
+static void writeJson(const std::string &path) {
+    std::ofstream out(path);
+    out << "{\n  \"benchmarks\": [\n";
+    for (std::size_t i = 0; i < results.size(); i++) {
+        char line[256];
+        snprintf(line, sizeof(line), "    {\"name\": \"%s\", \"ns_per_op\": %.2f, \"iterations\": %llu}%s\n",
+                 results[i].name.c_str(), results[i].nsPerOp, static_cast<unsigned long long>(results[i].iterations),
+                 i + 1 < results.size() ? "," : "");
+        out << line;
+    }
+    out << "  ]\n}\n";
+    if (!out) {
+        std::cerr << "could not write " << path << std::endl;
+        exit(1);
+    }
+}
+
+// Only reads what writeJson writes.
+static bool readBaseline(const std::string &path, std::map<std::string, double> &baseline) {
+    std::ifstream in(path);
+    if (!in) return false;
+    std::string line;
+    while (std::getline(in, line)) {
+        char name[200];
+        double ns;
+        if (sscanf(line.c_str(), " {\"name\": \"%199[^\"]\", \"ns_per_op\": %lf", name, &ns) == 2) baseline[name] = ns;
+    }
+    return true;
+}
+
+static bool regressed(const BenchResult &result, const std::map<std::string, double> &baseline, double tolerance) {
+    auto base = baseline.find(result.name);
+    return base != baseline.end() && (result.nsPerOp / base->second - 1) * 100 > tolerance;
+}
+
+static int countRegressions(const std::map<std::string, double> &baseline, double tolerance) {
+    return static_cast<int>(std::count_if(results.begin(), results.end(),
+                                          [&](const BenchResult &r) { return regressed(r, baseline, tolerance); }));
+}
+
+// Every benchmark in both, side by side. Returns how many got slower by more than tolerance percent.
+static int compare(const std::map<std::string, double> &baseline, double tolerance) {
+    int regressions = 0;
+    printf("\n%-44s %12s %12s %8s\n", "compared with baseline", "baseline", "now", "change");
+    for (const BenchResult &result : results) {
+        auto base = baseline.find(result.name);
+        if (base == baseline.end()) {
+            printf("%-44s %12s %12.1f %8s\n", result.name.c_str(), "-", result.nsPerOp, "new");
+            continue;
+        }
+        double change = (result.nsPerOp / base->second - 1) * 100;
+        bool slower = regressed(result, baseline, tolerance);
+        regressions += slower;
+        printf("%-44s %12.1f %12.1f %+7.1f%%%s\n", result.name.c_str(), base->second, result.nsPerOp, change,
+               slower ? "  <-- REGRESSION" : "");
+    }
+    return regressions;
+}
+
+// Everything, once. Running it again only keeps a benchmark's new number if it's faster.
+static void runSuite(const std::vector<std::string> &files) {
+    setupFileServices(DEFAULT_CACHE_MB, 1);
+    benchReadRequest("readRequest/whole", 1);
+    benchReadRequest("readRequest/split3", 3);
+    benchReadRequest("readRequest/bytewise", 1000);
+    benchReadRequest("readRequest/pipelined8", 1, 8);
+
+    benchCheckForFile("index");
+    setupFileServices(DEFAULT_CACHE_MB, 0);
+    {
+        Connection warm(-1);
+        sendFile(warm, (webRoot / "index1.html").string()); // so the hit comes out of the cache
+    }
+    benchCheckForFile("cache");
+    setupFileServices(0, 0);
+    benchCheckForFile("filesystem");
+
+    std::string valid = (webRoot / "index1.html").string();
+    std::string invalid = (webRoot / "donotserve.txt").string();
+    measure("is_file_valid/valid", [&] { if (!is_file_valid(valid)) exit(1); });
+    measure("is_file_valid/invalid", [&] { if (is_file_valid(invalid)) exit(1); });
+
+    {
+        Connection conn(-1);
+        int queued = 0;
+        const std::string line = "Content-Type: text/html; charset=utf-8";
+        measure("sendLine", [&] {
+            sendLine(conn, line);
+            if (++queued == 64) {
+                conn.response.clear();
+                queued = 0;
+            }
+        });
+    }
+
+    setupFileServices(DEFAULT_CACHE_MB, 0);
+    benchSendFile("cached", files);
+    setupFileServices(0, 0);
+    benchSendFile("disk", files);
+}
+
+int main(int argc, char *argv[]) {
+    std::string outPath = "bench_results.json";
+    std::string baselinePath;
+    double tolerance = DEFAULT_TOLERANCE;
+    int opt;
+    while ((opt = getopt(argc, argv, "o:b:t:")) != -1) {
+        switch (opt) {
+        case 'o': outPath = optarg; break;
+        case 'b': baselinePath = optarg; break;
+        case 't': tolerance = std::stod(optarg); break;
+        default:
+            std::cerr << "usage: " << argv[0] << " [-o RESULTS.json] [-b BASELINE.json] [-t TOLERANCE_PERCENT]" << std::endl;
+            return 1;
+        }
+    }
+
+    LOG_LEVEL = 0; // handleRequest logs every request otherwise
+    signal(SIGPIPE, SIG_IGN);
+    buildPrebuiltResponses();
+
+    std::vector<std::string> files;
+    for (const auto &entry : std::filesystem::directory_iterator(webRoot)) {
+        if (entry.is_regular_file() && is_file_valid(entry.path().string())) files.push_back(entry.path().filename().string());
+    }
+    std::sort(files.begin(), files.end());
+    if (files.empty()) {
+        std::cerr << "no servable files in " << webRoot << " (run it from the directory holding data/)" << std::endl;
+        return 1;
+    }
+
+    std::map<std::string, double> baseline;
+    bool haveBaseline = !baselinePath.empty() && readBaseline(baselinePath, baseline);
+
+    /*
+        A slower number might just be a noisy neighbour: before calling it a regression, run the whole
+        suite again (up to CONFIRM_RUNS more times). Only benchmarks slower every single time fail.
+    */
+    runSuite(files);
+    for (int rerun = 0; haveBaseline && rerun < CONFIRM_RUNS && countRegressions(baseline, tolerance) > 0; rerun++) {
+        std::cout << "\nslower than the baseline, running everything again to make sure" << std::endl;
+        runSuite(files);
+    }
+
+    writeJson(outPath);
+    std::cout << "\nresults written to " << outPath << std::endl;
+
+    if (baselinePath.empty()) return 0;
+    if (!haveBaseline) {
+        std::cout << "no baseline at " << baselinePath << " yet, make bench-baseline stores one" << std::endl;
+        return 0;
+    }
+    int regressions = compare(baseline, tolerance);
+    if (regressions > 0) {
+        std::cout << "\n*** " << regressions << " benchmark(s) more than " << tolerance << "% slower than the baseline ***" << std::endl;
+        return 1;
+    }
+    std::cout << "\nno regressions beyond " << tolerance << "%" << std::endl;
+    return 0;
+}
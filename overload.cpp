@@ -0,0 +1,53 @@
+#include "overload.h"
+
+#include <cmath>
+
+OverloadControl &overloadControl() {
+    thread_local OverloadControl control;
+    return control;
+}
+
+// Has the delay been at or over the target for at least an interval now?
+bool OverloadControl::staysAbove(Clock::time_point now, Clock::duration delay) {
+    if (delay < std::chrono::milliseconds(shedTargetMs)) {
+        firstAbove = {};
+        return false;
+    }
+    if (firstAbove == Clock::time_point{}) {
+        firstAbove = now + std::chrono::milliseconds(shedIntervalMs);
+        return false;
+    }
+    return now >= firstAbove;
+}
+
+// The more we've shed without the delay coming down, the sooner the next one.
+OverloadControl::Clock::time_point OverloadControl::controlLaw(Clock::time_point from) const {
+    auto gap = std::chrono::duration<double, std::milli>(shedIntervalMs / std::sqrt(static_cast<double>(count)));
+    return from + std::chrono::duration_cast<Clock::duration>(gap);
+}
+
+bool OverloadControl::shouldShed(Clock::time_point now, Clock::duration delay) {
+    if (shedTargetMs <= 0) return false;
+
+    bool above = staysAbove(now, delay);
+    if (shedding) {
+        if (!above) {
+            shedding = false;
+            return false;
+        }
+        if (now < shedNext) return false;
+        count++;
+        shedNext = controlLaw(shedNext);
+        return true;
+    }
+    if (!above) return false;
+
+    // starting again soon after the last spell: pick up roughly where that one left off, it was
+    // evidently shedding too little (RFC 8289 section 5.5).
+    shedding = true;
+    uint32_t delta = count - lastCount;
+    count = (delta > 1 && now - shedNext < 16 * std::chrono::milliseconds(shedIntervalMs)) ? delta : 1;
+    lastCount = count;
+    shedNext = controlLaw(now);
+    return true;
+}
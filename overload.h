@@ -0,0 +1,47 @@
+#ifndef OVERLOAD_H
+#define OVERLOAD_H
+
+#include <chrono>
+#include <cstdint>
+
+#define DEFAULT_LISTEN_BACKLOG 4096   // listen() queue (the kernel quietly caps it at net.core.somaxconn)
+#define DEFAULT_SHED_TARGET_MS 5      // queueing delay we're happy to live with, 0 never sheds
+#define DEFAULT_SHED_INTERVAL_MS 100  // how long it has to stay above that before we start shedding
+#define RETRY_AFTER_SECONDS 1         // what the 503 tells the client
+
+// set from the command line in main() before any connection is served, read-only after that.
+inline int shedTargetMs = DEFAULT_SHED_TARGET_MS;
+inline int shedIntervalMs = DEFAULT_SHED_INTERVAL_MS;
+
+/*
+    CoDel (Nichols & Jacobson, RFC 8289) pointed at requests instead of packets. The queueing delay
+    of a request is how long it sat there after its driver found out about it (the epoll/io_uring
+    batch it came in with, or the accept that handed it to the pool) before we got round to
+    handling it. A short burst that drains again is fine, so nothing happens until the delay has
+    stayed above the target for a whole interval. From then on requests get a prebuilt 503 instead
+    of being served, one straight away and then more often (interval / sqrt(count) apart) for as
+    long as the delay stays up; the first request that comes in under the target ends it.
+    One per thread (see overloadControl()), so no locking.
+*/
+class OverloadControl {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // A request that waited `delay` is about to be handled. True if it should get the 503.
+    bool shouldShed(Clock::time_point now, Clock::duration delay);
+
+private:
+    bool staysAbove(Clock::time_point now, Clock::duration delay);
+    Clock::time_point controlLaw(Clock::time_point from) const;
+
+    bool shedding = false;
+    Clock::time_point firstAbove{};  // when it'll have been above the target for an interval, {} while it's below
+    Clock::time_point shedNext{};    // next 503 while shedding
+    uint32_t count = 0;              // 503s since we started shedding this time
+    uint32_t lastCount = 0;          // ...and what count was when that started
+};
+
+// This thread's controller.
+OverloadControl &overloadControl();
+
+#endif
@@ -0,0 +1,108 @@
+#include "responseBuilder.h"
+#include "webServer.h"
+#include "contentCache.h"
+
+PrebuiltResponses prebuiltResponses;
+
+static std::string line(const std::string &text) {
+    return text + std::string(LINE_TERMINATOR);
+}
+
+void buildPrebuiltResponses() {
+    PrebuiltResponses &p = prebuiltResponses;
+
+    // the body needs a Content-Length, otherwise a keep-alive client can't tell where it ends.
+    std::string notFoundBody = line("<!DOCTYPE html>")
+        + line("<html lang=\"en\"><head><meta charset=\"utf-8\"><title>404</title></head>")
+        + line("<body><h1>404 :(</h1><p>The requested file was not found.</p></body></html>");
+
+    p.endHeadersClose = line("Connection: close") + line("");
+    p.endHeadersKeepAlive = line("Connection: keep-alive")
+        + line("Keep-Alive: timeout=" + std::to_string(keepAliveTimeout)) + line("");
+
+    std::string notFoundHead = line("HTTP/1.1 404 Not Found ")
+        + line("Content-Type: text/html; charset=UTF-8")
+        + line("Content-Length: " + std::to_string(notFoundBody.size()));
+    p.notFoundClose = notFoundHead + p.endHeadersClose + notFoundBody;
+    p.notFoundKeepAlive = notFoundHead + p.endHeadersKeepAlive + notFoundBody;
+
+    p.badRequest = line("HTTP/1.1 400 Bad Request") + line("Content-Length: 0") + p.endHeadersClose;
+    p.uriTooLong = line("HTTP/1.1 414 URI Too Long") + line("Content-Length: 0") + p.endHeadersClose;
+    p.headersTooLarge = line("HTTP/1.1 431 Request Header Fields Too Large") + line("Content-Length: 0") + p.endHeadersClose;
+    p.serviceUnavailable = line("HTTP/1.1 503 Service Unavailable")
+        + line("Retry-After: " + std::to_string(RETRY_AFTER_SECONDS)) + line("Content-Length: 0") + p.endHeadersClose;
+}
+
+std::string buildFileHeader(const std::string &contentType, uint64_t size,
+                            const char *contentEncoding, bool varyOnEncoding,
+                            const std::string &extraLines) {
+    std::string header = line("HTTP/1.1 200 OK")
+        + line("Content-Type: " + contentType)
+        + line("Content-Length: " + std::to_string(size))
+        + line("Accept-Ranges: bytes");
+    if (*contentEncoding) header += line(std::string("Content-Encoding: ") + contentEncoding);
+    if (varyOnEncoding) header += line("Vary: Accept-Encoding");
+    return header + extraLines;
+}
+
+std::string validatorLines(const std::string &etag, const std::string &lastModified) {
+    return line("ETag: " + etag) + line("Last-Modified: " + lastModified);
+}
+
+void ResponseBuilder::addStatic(std::string_view bytes) {
+    if (bytes.empty()) return;
+    segments.push_back(Segment{bytes.data(), 0, bytes.size()});
+    pending += bytes.size();
+}
+
+void ResponseBuilder::addShared(std::shared_ptr<const CachedFile> owner, std::string_view bytes) {
+    if (pins.empty() || pins.back() != owner) pins.push_back(std::move(owner));
+    addStatic(bytes);
+}
+
+void ResponseBuilder::addCopy(std::string_view bytes) {
+    if (bytes.empty()) return;
+    // tack onto the previous segment if that one is also ours and ends where we're about to write.
+    if (segments.size() > current && segments.back().data == nullptr
+        && segments.back().offset + segments.back().len == owned.size()) {
+        segments.back().len += bytes.size();
+    } else {
+        segments.push_back(Segment{nullptr, owned.size(), bytes.size()});
+    }
+    owned.append(bytes);
+    pending += bytes.size();
+}
+
+int ResponseBuilder::fillIov(struct iovec *iov, int max) const {
+    int count = 0;
+    for (std::size_t i = current; i < segments.size() && count < max; i++) {
+        const Segment &seg = segments[i];
+        const char *base = seg.data ? seg.data : owned.data() + seg.offset;
+        std::size_t skip = (i == current) ? currentSent : 0;
+        iov[count].iov_base = const_cast<char*>(base + skip);
+        iov[count].iov_len = seg.len - skip;
+        count++;
+    }
+    return count;
+}
+
+void ResponseBuilder::consume(std::size_t bytes) {
+    pending -= bytes;
+    while (bytes > 0 && current < segments.size()) {
+        std::size_t left = segments[current].len - currentSent;
+        if (bytes < left) {
+            currentSent += bytes;
+            return;
+        }
+        bytes -= left;
+        current++;
+        currentSent = 0;
+    }
+}
+
+void ResponseBuilder::clear() {
+    segments.clear();
+    pins.clear();
+    owned.clear();
+    current = currentSent = pending = 0;
+}
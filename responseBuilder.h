@@ -0,0 +1,81 @@
+#ifndef RESPONSEBUILDER_H
+#define RESPONSEBUILDER_H
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <sys/uio.h>
+
+#define MAX_IOVECS 64 // segments handed to one sendmsg()
+
+struct CachedFile;
+
+/*
+    Response bytes that never change, built once at startup (after the command line is read,
+    since the Keep-Alive header depends on -k) and then sent byte for byte, straight out of here.
+*/
+struct PrebuiltResponses {
+    std::string badRequest;        // complete 400, always closes the connection
+    std::string uriTooLong;        // complete 414, ditto
+    std::string headersTooLarge;   // complete 431, ditto
+    std::string serviceUnavailable; // complete 503 with Retry-After, for when we're shedding load (overload.h)
+    std::string notFoundClose;     // complete 404s, one per Connection: header
+    std::string notFoundKeepAlive;
+    std::string endHeadersClose;   // Connection: line + the blank line that ends a header block
+    std::string endHeadersKeepAlive;
+};
+
+extern PrebuiltResponses prebuiltResponses;
+void buildPrebuiltResponses();
+
+/*
+    "HTTP/1.1 200 OK" + Content-Type + Content-Length, everything up to (not including) the Connection: line.
+    Plus Content-Encoding if contentEncoding isn't "", Vary: Accept-Encoding if the file has other variants,
+    and any extra (already terminated) lines, e.g. validatorLines().
+*/
+std::string buildFileHeader(const std::string &contentType, uint64_t size,
+                            const char *contentEncoding = "", bool varyOnEncoding = false,
+                            const std::string &extraLines = "");
+
+// "ETag: ...\r\nLast-Modified: ...\r\n"
+std::string validatorLines(const std::string &etag, const std::string &lastModified);
+
+/*
+    Everything queued to go out on a connection, as a list of segments that become one iovec array.
+    Segments either point at bytes that outlive the response (prebuilt blocks), at bytes owned by a
+    cache entry (which we hold a reference to until they're sent), or at our own buffer for the
+    odd header we had to build on the spot. Nothing gets copied into one big string any more.
+*/
+class ResponseBuilder {
+public:
+    void addStatic(std::string_view bytes);
+    void addShared(std::shared_ptr<const CachedFile> owner, std::string_view bytes);
+    void addCopy(std::string_view bytes); // adjacent copies share one segment
+
+    // Fill up to `max` iovecs with what's left to send, returns how many it used.
+    int fillIov(struct iovec *iov, int max) const;
+    void consume(std::size_t bytes); // the first `bytes` of what fillIov described went out.
+
+    bool empty() const { return pending == 0; }
+    std::size_t pendingBytes() const { return pending; }
+    std::size_t pendingSegments() const { return segments.size() - current; }
+    void clear();
+
+private:
+    struct Segment {
+        const char *data;   // nullptr means the bytes live in `owned` at `offset` (it may have moved since)
+        std::size_t offset;
+        std::size_t len;
+    };
+
+    std::vector<Segment> segments;
+    std::vector<std::shared_ptr<const CachedFile>> pins; // cache entries our segments point into
+    std::string owned;
+    std::size_t current = 0;     // first segment not fully sent
+    std::size_t currentSent = 0; // how much of it did go out
+    std::size_t pending = 0;     // bytes not sent yet
+};
+
+#endif
@@ -0,0 +1,399 @@
+/*
+    selfTest: checks of the things that are easy to get wrong and hard to see from the outside,
+    linked against the real objects like microBench (webServer.cpp compiled again with its main()
+    renamed, see the Makefile).
+
+    timer wheel   a connection closing with its deadline still armed leaves the wheel empty
+                  (otherwise the reactors go on waking up every tick for nothing)
+    uring         a keep-alive connection's second request header gets headerTimeout too, a byte
+                  every so often doesn't keep it open (skipped if io_uring isn't available)
+    overload      a client that's slow with its request header (or slow to start sending it) isn't
+                  mistaken for queueing delay by the blocking driver, while requests that really did
+                  wait behind the others do get shed
+    content cache one directory cached under two spellings ("dir/x", "dir//y"): dropping everything
+                  cached under one doesn't take the watch away from the other, and a change to
+                  a file still invalidates it under either spelling
+    file index    a directory moved out of the web root stays out: what happens in it later doesn't
+                  show up under its old path (or make the index give up on vouching for misses)
+    async log     lines other threads are still logging while flushLogs() shuts the writer down
+                  all make it out (last, there's no starting the writer again)
+
+    make check    (exits non-zero if anything failed)
+*/
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <future>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+#include "webServer.h"
+#include "contentCache.h"
+#include "uring.h"
+#include "asyncLog.h"
+#include "fileIndex.h"
+#include "logging.h"
+
+static int failures = 0;
+
+static void check(bool ok, const std::string &what) {
+    printf("%-4s %s\n", ok ? "ok" : "FAIL", what.c_str());
+    if (!ok) failures++;
+}
+
+// A connected pair of sockets, [0] for the server's Connection and [1] for the "client".
+static bool socketPair(int fds[2]) {
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0) return true;
+    perror("socketpair");
+    return false;
+}
+
+static void checkTimerWheel() {
+    TimerWheel timers;
+    int fds[2];
+    if (!socketPair(fds)) return;
+    {
+        Connection conn(fds[0]);
+        armDeadline(timers, conn, &conn, false);
+        check(!timers.empty(), "deadline armed on an open connection");
+    }
+    check(timers.empty(), "wheel empty after a connection closed with its deadline armed");
+
+    {
+        Connection conn(fds[0]);
+        armDeadline(timers, conn, &conn, false);
+        armDeadline(timers, conn, &conn, true);
+        timers.expire(std::chrono::steady_clock::now() + std::chrono::seconds(writeTimeout + 1), [](void*) {});
+        check(timers.empty(), "wheel empty after the (re-armed) deadline fired");
+    }
+    check(timers.empty(), "...and still empty once that connection closed");
+    close(fds[0]);
+    close(fds[1]);
+}
+
+// A listening socket on some free loopback port, -1 if that didn't work.
+static int listenLoopback(uint16_t &port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (fd < 0 || bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(fd, 16) < 0
+        || getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len) < 0) {
+        perror("listening socket");
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    port = ntohs(addr.sin_port);
+    return fd;
+}
+
+/*
+    The server closes (or resets) the connection within `limit` while the client keeps trickling
+    it a byte of a request header every `pause`.
+*/
+static bool closesTrickle(int fd, std::chrono::milliseconds pause, std::chrono::milliseconds limit) {
+    const std::string header = "GET /index1.html HTTP/1.1\r\nHost: localhost\r\nX-Padding: aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa";
+    auto giveUp = std::chrono::steady_clock::now() + limit;
+    for (std::size_t i = 0; std::chrono::steady_clock::now() < giveUp; i = (i + 1) % header.size()) {
+        if (send(fd, &header[i], 1, MSG_NOSIGNAL) < 0) return true;
+        pollfd waiting{fd, POLLIN, 0};
+        if (poll(&waiting, 1, static_cast<int>(pause.count())) > 0) {
+            char byte;
+            if (recv(fd, &byte, 1, 0) <= 0) return true;
+        }
+    }
+    return false;
+}
+
+// -m uring: the header deadline has to hold for every request on a connection, not just the first.
+static void checkUringHeaderDeadline() {
+    uint16_t port;
+    int listenFd = listenLoopback(port);
+    if (listenFd < 0) return;
+    headerTimeout = 1;
+    keepAliveTimeout = 30;
+    // set up on the thread that runs it (the ring is IORING_SETUP_SINGLE_ISSUER), which is until we exit.
+    std::promise<bool> ready;
+    std::future<bool> isReady = ready.get_future();
+    std::thread([listenFd, ready = std::move(ready)]() mutable {
+        UringLoop loop(listenFd);
+        ready.set_value(loop.ready());
+        if (loop.ready()) loop.run();
+    }).detach();
+    if (!isReady.get()) {
+        printf("skip io_uring isn't available here\n");
+        close(listenFd);
+        headerTimeout = DEFAULT_HEADER_TIMEOUT;
+        keepAliveTimeout = DEFAULT_KEEPALIVE_TIMEOUT;
+        return;
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        perror("connecting to the uring loop");
+        if (fd >= 0) close(fd);
+        return;
+    }
+
+    // one whole request first, so the trickle is the connection's second one.
+    const std::string request = "GET /index1.html HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    bool answered = send(fd, request.data(), request.size(), MSG_NOSIGNAL) == static_cast<ssize_t>(request.size());
+    std::string reply;
+    char buffer[4096];
+    while (answered && reply.find("\r\n\r\n") == std::string::npos) {
+        ssize_t got = recv(fd, buffer, sizeof(buffer), 0);
+        if (got <= 0) answered = false;
+        else reply.append(buffer, static_cast<std::size_t>(got));
+    }
+    answered = answered && reply.find("Connection: close") == std::string::npos;
+    check(answered, "uring: first request on a keep-alive connection answered");
+    if (answered) {
+        // drain the body so all that's left to come is the close.
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        while (recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT) > 0) {}
+        check(closesTrickle(fd, std::chrono::milliseconds(200), std::chrono::seconds(4)),
+              "uring: a trickled second request header is cut off at headerTimeout");
+    }
+    close(fd);
+    headerTimeout = DEFAULT_HEADER_TIMEOUT;
+    keepAliveTimeout = DEFAULT_KEEPALIVE_TIMEOUT;
+}
+
+/*
+    One connection through the blocking driver (processConnection, as the pool runs it), accepted at
+    acceptedAt. The client sends the request in pieces, pause apart, and we return the status it got.
+*/
+static int servedStatus(std::chrono::steady_clock::time_point acceptedAt, const std::vector<std::string> &pieces,
+                        std::chrono::milliseconds pause) {
+    int fds[2];
+    if (!socketPair(fds)) return -1;
+    std::thread client([&] {
+        for (std::size_t i = 0; i < pieces.size(); i++) {
+            if (i > 0 || pause.count() > 0) std::this_thread::sleep_for(pause);
+            if (write(fds[1], pieces[i].data(), pieces[i].size()) < 0) break;
+        }
+    });
+    if (pause.count() == 0) {
+        // everything's in before we start, like a connection that sat in the pool's queue.
+        client.join();
+        processConnection(fds[0], acceptedAt);
+    } else {
+        processConnection(fds[0], acceptedAt);
+        client.join();
+    }
+    close(fds[0]);
+    char reply[64] = {};
+    ssize_t got = read(fds[1], reply, sizeof(reply) - 1);
+    close(fds[1]);
+    if (got < 12) return -1;
+    return std::atoi(reply + 9); // "HTTP/1.1 200"
+}
+
+static void checkOverload() {
+    shedTargetMs = 5;
+    shedIntervalMs = 20;
+    const std::string request = "GET /index1.html HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+    const std::vector<std::string> trickled = {"GET /index1.html HT", "TP/1.1\r\nHost: loc", "alhost\r\nConnection: close\r\n\r\n"};
+    auto ms = [](int n) { return std::chrono::milliseconds(n); };
+
+    bool shed = false;
+    for (int i = 0; i < 5; i++) {
+        shed |= servedStatus(std::chrono::steady_clock::now(), trickled, ms(30)) == 503;
+    }
+    check(!shed, "slow header from an idle server's client is never shed");
+
+    shed = false;
+    for (int i = 0; i < 5; i++) {
+        shed |= servedStatus(std::chrono::steady_clock::now(), {request}, ms(60)) == 503;
+    }
+    check(!shed, "client slow to start sending is never shed");
+
+    // control: requests that were all there and waited 50ms behind the others do get the 503.
+    shed = false;
+    for (int i = 0; i < 5; i++) {
+        shed |= servedStatus(std::chrono::steady_clock::now() - ms(50), {request}, ms(0)) == 503;
+        std::this_thread::sleep_for(ms(10));
+    }
+    check(shed, "requests that sat in the queue past the target are shed");
+
+    shedTargetMs = DEFAULT_SHED_TARGET_MS;
+    shedIntervalMs = DEFAULT_SHED_INTERVAL_MS;
+}
+
+static bool writeFile(const std::string &path, const std::string &body) {
+    FILE *file = fopen(path.c_str(), "w");
+    if (!file) return false;
+    fwrite(body.data(), 1, body.size(), file);
+    return fclose(file) == 0;
+}
+
+static bool cacheFile(ContentCache &cache, const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    bool cached = cache.insert(path, fd) != nullptr && cache.find(path) != nullptr;
+    close(fd);
+    return cached;
+}
+
+// Give the watcher thread a moment to see the change: true once path has dropped out.
+static bool dropsOut(ContentCache &cache, const std::string &path) {
+    for (int i = 0; i < 100; i++) {
+        if (!cache.find(path)) return true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return false;
+}
+
+static void checkContentCache() {
+    char dirTemplate[] = "/tmp/selfTestXXXXXX";
+    if (!mkdtemp(dirTemplate)) {
+        perror("mkdtemp");
+        return;
+    }
+    const std::string dir = dirTemplate;
+    const std::string x = dir + "/x.html", y = dir + "//y.html", z = dir + "//z.html";
+    if (!writeFile(x, "x") || !writeFile(y, "y") || !writeFile(z, "z")) {
+        perror("writing test files");
+        return;
+    }
+
+    ContentCache cache(1024 * 1024);
+    check(cacheFile(cache, x) && cacheFile(cache, y) && cacheFile(cache, z), "files cached under both spellings of their directory");
+
+    // the last "dir/" entry goes, the "dir//" ones still need the (shared) watch.
+    cache.invalidate(x);
+    writeFile(dir + "/y.html", "y again");
+    check(dropsOut(cache, y), "change seen through the other spelling once one spelling's entries are gone");
+
+    check(cacheFile(cache, x), "file cached again under the first spelling");
+    writeFile(dir + "/z.html", "z again");
+    writeFile(dir + "/x.html", "x again");
+    check(dropsOut(cache, z) && dropsOut(cache, x), "changes seen under both spellings");
+
+    unlink((dir + "/x.html").c_str());
+    unlink((dir + "/y.html").c_str());
+    unlink((dir + "/z.html").c_str());
+    rmdir(dir.c_str());
+}
+
+// Give the index's watcher a moment: true once lookup(relPath) says `present`.
+static bool indexSettles(const FileIndex &index, const std::string &relPath, bool present) {
+    for (int i = 0; i < 100; i++) {
+        if (index.lookup(relPath) == present) return true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return false;
+}
+
+static void checkFileIndexMoves() {
+    char dirTemplate[] = "/tmp/selfTestIndexXXXXXX";
+    if (!mkdtemp(dirTemplate)) {
+        perror("mkdtemp");
+        return;
+    }
+    const std::string top = dirTemplate, root = top + "/root", away = top + "/away";
+    if (mkdir(root.c_str(), 0755) < 0 || mkdir((root + "/sub").c_str(), 0755) < 0 || !writeFile(root + "/sub/a.html", "a")) {
+        perror("making the test tree");
+        return;
+    }
+
+    {
+        FileIndex index(root);
+        index.build(1);
+        check(index.lookup("sub/a.html"), "file index has sub/a.html");
+
+        rename((root + "/sub").c_str(), away.c_str());
+        check(indexSettles(index, "sub/a.html", false), "...and drops it when sub is moved out of the root");
+
+        // changes in the moved directory, then one in the root to know the watcher got past them.
+        writeFile(away + "/b.html", "b");
+        mkdir((away + "/deeper").c_str(), 0755);
+        writeFile(root + "/later.html", "later");
+        check(indexSettles(index, "later.html", true) && !index.lookup("sub/b.html"),
+              "a file created in the moved-out directory isn't indexed under its old path");
+        check(index.authoritative(), "...and a directory created there doesn't leave the index unsure of its misses");
+    }
+
+    rmdir((away + "/deeper").c_str());
+    unlink((away + "/a.html").c_str());
+    unlink((away + "/b.html").c_str());
+    unlink((root + "/later.html").c_str());
+    rmdir(away.c_str());
+    rmdir(root.c_str());
+    rmdir(top.c_str());
+}
+
+static void checkLogShutdown() {
+    const int threads = 4, lines = 20000;
+    LOG_FULL_POLICY = LOG_BLOCK; // (dropping lines is allowed when it's full, losing them isn't)
+
+    // stderr into a file while this runs.
+    char pathTemplate[] = "/tmp/selfTestLogXXXXXX";
+    int captured = mkstemp(pathTemplate);
+    if (captured < 0) {
+        perror("mkstemp");
+        return;
+    }
+    unlink(pathTemplate);
+    fflush(stderr);
+    int savedStderr = dup(STDERR_FILENO);
+    dup2(captured, STDERR_FILENO);
+
+    std::vector<std::thread> producers;
+    for (int t = 0; t < threads; t++) {
+        producers.emplace_back([] {
+            for (int i = 0; i < lines; i++) logSubmit("selfTest line", 13);
+        });
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    flushLogs();
+    for (std::thread &producer : producers) producer.join();
+
+    dup2(savedStderr, STDERR_FILENO);
+    close(savedStderr);
+
+    std::string written;
+    char buffer[65536];
+    ssize_t got;
+    lseek(captured, 0, SEEK_SET);
+    while ((got = read(captured, buffer, sizeof(buffer))) > 0) written.append(buffer, static_cast<std::size_t>(got));
+    close(captured);
+
+    int seen = 0;
+    for (std::size_t at = written.find("selfTest line\n"); at != std::string::npos; at = written.find("selfTest line\n", at + 1)) seen++;
+    check(seen == threads * lines, "every line logged around flushLogs() written (" + std::to_string(seen) + " of "
+          + std::to_string(threads * lines) + ")");
+}
+
+int main() {
+    LOG_LEVEL = 0;
+    signal(SIGPIPE, SIG_IGN);
+    buildPrebuiltResponses();
+
+    checkTimerWheel();
+    checkUringHeaderDeadline();
+    checkOverload();
+    checkContentCache();
+    checkFileIndexMoves();
+    checkLogShutdown();
+
+    if (failures > 0) {
+        printf("\n*** %d check(s) failed ***\n", failures);
+        return 1;
+    }
+    printf("\nall checks passed\n");
+    return 0;
+}
@@ -0,0 +1,83 @@
+#include "threadPool.h"
+#include "logging.h"
+
+unsigned ThreadPool::defaultThreadCount() {
+    unsigned cores = std::thread::hardware_concurrency();
+    return cores > 0 ? cores : 1; // (hardware_concurrency is allowed to just say 0)
+}
+
+ThreadPool::ThreadPool(unsigned threadCount) {
+    if (threadCount == 0) threadCount = 1;
+
+    for (unsigned i = 0; i < threadCount; i++) {
+        workers.push_back(std::make_unique<Worker>());
+    }
+    // only start the threads once every deque exists, they go looking in each other's right away.
+    for (unsigned i = 0; i < threadCount; i++) {
+        threads.emplace_back(&ThreadPool::workerMain, this, i);
+    }
+    DEBUG << "thread pool started with " << threadCount << " workers" << ENDL;
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(sleepLock);
+        stopping = true;
+    }
+    wakeup.notify_all();
+    for (auto &thread : threads) thread.join();
+}
+
+void ThreadPool::submit(Task task) {
+    unsigned target = nextWorker.fetch_add(1, std::memory_order_relaxed) % workers.size();
+    {
+        std::lock_guard<std::mutex> lock(workers[target]->lock);
+        workers[target]->queue.push_back(std::move(task));
+    }
+    {
+        // bump pending under the sleep lock so a worker that is just about to wait can't miss it.
+        std::lock_guard<std::mutex> lock(sleepLock);
+        pending++;
+    }
+    wakeup.notify_one();
+}
+
+// Owner takes from the front: connections were queued in arrival order, serve them that way.
+bool ThreadPool::popLocal(unsigned id, Task &task) {
+    Worker &self = *workers[id];
+    std::lock_guard<std::mutex> lock(self.lock);
+    if (self.queue.empty()) return false;
+    task = std::move(self.queue.front());
+    self.queue.pop_front();
+    return true;
+}
+
+// Thieves take from the back, away from the owner's end, starting at the next worker over.
+bool ThreadPool::steal(unsigned thief, Task &task) {
+    for (unsigned offset = 1; offset < workers.size(); offset++) {
+        Worker &victim = *workers[(thief + offset) % workers.size()];
+        std::unique_lock<std::mutex> lock(victim.lock, std::try_to_lock);
+        if (!lock.owns_lock() || victim.queue.empty()) continue; // busy or empty, try the next one.
+        task = std::move(victim.queue.back());
+        victim.queue.pop_back();
+        TRACE << "worker " << thief << " stole a task" << ENDL;
+        return true;
+    }
+    return false;
+}
+
+void ThreadPool::workerMain(unsigned id) {
+    while (1) {
+        Task task;
+        if (popLocal(id, task) || steal(id, task)) {
+            pending--;
+            task();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(sleepLock);
+        if (pending > 0) continue; // something is queued, we just lost a try_lock race for it.
+        if (stopping) return;
+        wakeup.wait(lock, [this] { return stopping || pending > 0; });
+    }
+}
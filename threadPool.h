@@ -0,0 +1,52 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+    Fixed size pool of worker threads with one deque per worker.
+    submit() deals tasks out round-robin, a worker runs its own queue oldest-first and
+    when that runs dry it steals from the other end of someone else's queue, so one worker
+    stuck on a slow client doesn't leave the connections queued behind it waiting.
+*/
+class ThreadPool {
+public:
+    using Task = std::function<void()>;
+
+    explicit ThreadPool(unsigned threadCount = defaultThreadCount());
+    ~ThreadPool(); // finishes whatever is queued, then joins.
+
+    void submit(Task task);
+    unsigned size() const { return static_cast<unsigned>(workers.size()); }
+
+    static unsigned defaultThreadCount();
+
+private:
+    struct Worker {
+        std::mutex lock;
+        std::deque<Task> queue;
+    };
+
+    void workerMain(unsigned id);
+    bool popLocal(unsigned id, Task &task);
+    bool steal(unsigned thief, Task &task);
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+    std::atomic<unsigned> nextWorker{0};
+
+    // idle workers park here until pending goes non-zero.
+    std::mutex sleepLock;
+    std::condition_variable wakeup;
+    std::atomic<long> pending{0};
+    bool stopping = false; // guarded by sleepLock
+};
+
+#endif
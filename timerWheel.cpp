@@ -0,0 +1,39 @@
+#include "timerWheel.h"
+
+#include <algorithm>
+
+TimerWheel::TimerWheel() {
+    for (TimerNode &head : slots) head.prev = head.next = &head;
+}
+
+// Whatever is still armed just gets forgotten (the nodes are left unarmed, not pointing at us).
+TimerWheel::~TimerWheel() {
+    for (TimerNode &head : slots) {
+        while (head.next != &head) {
+            head.next->wheel = nullptr;
+            head.next->unlink();
+        }
+        head.prev = head.next = nullptr;
+    }
+}
+
+// Ticks since the wheel started. Deadlines round up and now rounds down, so a timer never fires early.
+uint64_t TimerWheel::tickOf(std::chrono::steady_clock::time_point when, bool roundUp) const {
+    if (when <= start) return 0;
+    auto ms = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(when - start).count());
+    return (roundUp ? ms + TIMER_TICK_MS : ms) / TIMER_TICK_MS;
+}
+
+void TimerWheel::arm(TimerNode &node, void *owner, std::chrono::steady_clock::time_point when) {
+    cancel(node);
+    node.owner = owner;
+    node.wheel = this;
+    node.expiry = std::max(tickOf(when, true), lastTick + 1);
+
+    TimerNode &head = slots[node.expiry & (TIMER_SLOTS - 1)];
+    node.prev = head.prev;
+    node.next = &head;
+    head.prev->next = &node;
+    head.prev = &node;
+    count++;
+}
@@ -0,0 +1,118 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <chrono>
+#include <cstdint>
+
+#define TIMER_TICK_MS 100   // deadlines are only as precise as this
+#define TIMER_SLOTS 1024    // one turn of the wheel is TIMER_SLOTS ticks (~100s), must be a power of two
+
+class TimerWheel;
+
+/*
+    A timer that lives inside whatever it times (a Connection), so arming it never allocates.
+    Cancels itself if it's destroyed while still armed, so closing a connection needn't remember to.
+*/
+struct TimerNode {
+    TimerNode *prev = nullptr;
+    TimerNode *next = nullptr;
+    uint64_t expiry = 0;          // tick it fires on
+    void *owner = nullptr;        // handed back to whoever runs the wheel when it fires
+    TimerWheel *wheel = nullptr;  // the one it's armed on (its count has to come down with it)
+
+    TimerNode() = default;
+    TimerNode(const TimerNode&) = delete;
+    TimerNode &operator=(const TimerNode&) = delete;
+    inline ~TimerNode();
+
+    bool armed() const { return next != nullptr; }
+    void unlink() {
+        if (!next) return;
+        prev->next = next;
+        next->prev = prev;
+        prev = next = nullptr;
+    }
+};
+
+/*
+    Hashed timing wheel (Varghese & Lauck): a timer goes in the slot for its expiry tick modulo
+    TIMER_SLOTS, in a doubly linked list, so arming, re-arming and cancelling are all O(1) however many
+    connections there are. Each tick only looks at its own slot; anything in there that's due on a
+    later turn of the wheel just stays put. One wheel per thread, no locking.
+*/
+class TimerWheel {
+public:
+    TimerWheel();
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel &operator=(const TimerWheel&) = delete;
+    ~TimerWheel();
+
+    // (Re)arm node to fire at when (rounded up to the next tick). owner is what expire() hands back.
+    void arm(TimerNode &node, void *owner, std::chrono::steady_clock::time_point when);
+    void cancel(TimerNode &node) {
+        if (!node.armed()) return;
+        node.unlink();
+        node.wheel = nullptr;
+        count--;
+    }
+
+    bool empty() const { return count == 0; }
+
+    // Fire everything that's due by now. fired(owner) may arm or cancel any timer, this one included.
+    template <typename Fired>
+    void expire(std::chrono::steady_clock::time_point now, Fired fired);
+
+private:
+    uint64_t tickOf(std::chrono::steady_clock::time_point when, bool roundUp) const;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    uint64_t lastTick = 0; // every slot up to here has been looked at, nothing gets armed this early
+    std::size_t count = 0;
+    TimerNode slots[TIMER_SLOTS]; // list heads, each one a circle through its own timers
+};
+
+TimerNode::~TimerNode() {
+    if (wheel) wheel->cancel(*this);
+}
+
+template <typename Fired>
+void TimerWheel::expire(std::chrono::steady_clock::time_point now, Fired fired) {
+    uint64_t nowTick = tickOf(now, false);
+    if (nowTick <= lastTick) return;
+    // (after a long stall there's no point going round the wheel more than once)
+    uint64_t first = (nowTick - lastTick > TIMER_SLOTS) ? nowTick - TIMER_SLOTS + 1 : lastTick + 1;
+    for (uint64_t tick = first; tick <= nowTick; tick++) {
+        lastTick = tick; // (anything fired() arms from here on lands after this slot)
+        TimerNode &head = slots[tick & (TIMER_SLOTS - 1)];
+        // pull them off one at a time, so fired() can touch anything in this slot without upsetting us.
+        TimerNode later;
+        later.prev = later.next = &later;
+        while (head.next != &head) {
+            TimerNode *node = head.next;
+            node->unlink();
+            if (node->expiry > nowTick) {
+                // a later turn of the wheel.
+                node->prev = later.prev;
+                node->next = &later;
+                later.prev->next = node;
+                later.prev = node;
+                continue;
+            }
+            count--;
+            node->wheel = nullptr;
+            fired(node->owner);
+        }
+        // and back in the slot with the ones still waiting.
+        while (later.next != &later) {
+            TimerNode *node = later.next;
+            node->unlink();
+            node->prev = head.prev;
+            node->next = &head;
+            head.prev->next = node;
+            head.prev = node;
+        }
+        later.prev = later.next = nullptr;
+    }
+}
+
+#endif
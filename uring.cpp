@@ -0,0 +1,498 @@
+#include "uring.h"
+#include "logging.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// the two completions that aren't a connection's. Anything else in user_data is a UringConnection*.
+#define URING_TAG_ACCEPT 1
+#define URING_TAG_TIMER 2
+
+static int uringSetup(unsigned entries, io_uring_params *params) {
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int uringEnter(int ringFd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+    return static_cast<int>(syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, flags, nullptr, 0));
+}
+
+static int uringRegister(int ringFd, unsigned opcode, void *arg, unsigned count) {
+    return static_cast<int>(syscall(__NR_io_uring_register, ringFd, opcode, arg, count));
+}
+
+UringLoop::UringLoop(int listenFd) : listenFd(listenFd) {
+    if (!setupRing()) return;
+    if (!supportsOps()) {
+        close(ringFd);
+        ringFd = -1;
+        return;
+    }
+    registerBuffers();
+}
+
+UringLoop::~UringLoop() {
+    for (auto &entry : connections) close(entry.first);
+    if (sqes) munmap(sqes, sqesSize);
+    if (cqRing && cqRing != sqRing) munmap(cqRing, cqRingSize);
+    if (sqRing) munmap(sqRing, sqRingSize);
+    if (ringFd >= 0) close(ringFd);
+}
+
+/*
+    Make the ring and map its two queues. The newer setup flags (one thread submitting, no
+    interrupting us to run completions) are only hints, so if this kernel doesn't know them we try
+    again without. We do need FAST_POLL: without it every recv waiting on a quiet socket ties up
+    one of the kernel's worker threads, which is worse than just using epoll.
+*/
+bool UringLoop::setupRing() {
+    io_uring_params params{};
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER;
+    params.cq_entries = URING_CQ_ENTRIES;
+    ringFd = uringSetup(URING_ENTRIES, &params);
+    if (ringFd < 0 && errno == EINVAL) {
+        params = io_uring_params{};
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = URING_CQ_ENTRIES;
+        ringFd = uringSetup(URING_ENTRIES, &params);
+    }
+    if (ringFd < 0) {
+        WARNING << "io_uring_setup() failed: " << strerror(errno) << ENDL;
+        return false;
+    }
+    if (!(params.features & IORING_FEAT_FAST_POLL) || !(params.features & IORING_FEAT_NODROP)) {
+        WARNING << "this kernel's io_uring is too old (no fast poll / no-drop completions)" << ENDL;
+        close(ringFd);
+        ringFd = -1;
+        return false;
+    }
+
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMmap) sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+
+    sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    if (sqRing == MAP_FAILED) sqRing = nullptr;
+    cqRing = singleMmap ? sqRing
+                        : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+    if (cqRing == MAP_FAILED) cqRing = nullptr;
+    sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    void *sqeMap = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+    sqes = (sqeMap == MAP_FAILED) ? nullptr : static_cast<io_uring_sqe*>(sqeMap);
+    if (!sqRing || !cqRing || !sqes) {
+        WARNING << "failed to map the io_uring queues: " << strerror(errno) << ENDL;
+        close(ringFd);
+        ringFd = -1;
+        return false;
+    }
+
+    char *sq = static_cast<char*>(sqRing);
+    sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sqEntries = params.sq_entries;
+    // slot i of the sqe array always goes in position i, so the index array is filled in once here.
+    unsigned *array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    for (unsigned i = 0; i < sqEntries; i++) array[i] = i;
+
+    char *cq = static_cast<char*>(cqRing);
+    cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+    DEBUG << "io_uring ready: " << sqEntries << " sq / " << params.cq_entries << " cq entries" << ENDL;
+    return true;
+}
+
+// Every opcode we use has to be there (an old kernel may have the ring but not e.g. accept or send).
+bool UringLoop::supportsOps() {
+    std::size_t size = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+    auto storage = std::make_unique<char[]>(size);
+    std::memset(storage.get(), 0, size);
+    auto *probe = reinterpret_cast<io_uring_probe*>(storage.get());
+    if (uringRegister(ringFd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+        WARNING << "io_uring probe failed: " << strerror(errno) << ENDL;
+        return false;
+    }
+
+    static const int needed[] = {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_SEND,
+                                 IORING_OP_READ, IORING_OP_READ_FIXED, IORING_OP_TIMEOUT};
+    for (int op : needed) {
+        if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+            WARNING << "io_uring on this kernel can't do opcode " << op << ENDL;
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+    File bodies are read into buffers registered with the ring up front, so the kernel doesn't have
+    to look up and pin the pages again on every read. If registering fails (RLIMIT_MEMLOCK on older
+    kernels) we just carry on with plain reads into each connection's own buffer.
+*/
+void UringLoop::registerBuffers() {
+    bufferPool = std::make_unique<char[]>(static_cast<std::size_t>(URING_BUFFERS) * URING_BUFFER_SIZE);
+    struct iovec iov[URING_BUFFERS];
+    for (int i = 0; i < URING_BUFFERS; i++) {
+        iov[i].iov_base = bufferPool.get() + static_cast<std::size_t>(i) * URING_BUFFER_SIZE;
+        iov[i].iov_len = URING_BUFFER_SIZE;
+    }
+    if (uringRegister(ringFd, IORING_REGISTER_BUFFERS, iov, URING_BUFFERS) < 0) {
+        WARNING << "could not register io_uring buffers (" << strerror(errno) << "), file bodies use plain reads" << ENDL;
+        bufferPool.reset();
+        return;
+    }
+    for (int i = URING_BUFFERS - 1; i >= 0; i--) freeBuffers.push_back(i);
+}
+
+// A blank sqe at the end of the submission queue. If it's full we hand what's there to the kernel first.
+io_uring_sqe *UringLoop::nextSqe() {
+    unsigned tail = *sqTail;
+    while (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) submit(0);
+
+    io_uring_sqe *sqe = &sqes[tail & sqMask];
+    std::memset(sqe, 0, sizeof(*sqe));
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    toSubmit++;
+    return sqe;
+}
+
+// Hand everything queued since last time to the kernel and wait until at least waitFor completions are in.
+void UringLoop::submit(unsigned waitFor) {
+    while (1) {
+        int submitted = uringEnter(ringFd, toSubmit, waitFor, waitFor ? IORING_ENTER_GETEVENTS : 0);
+        if (submitted < 0) {
+            if (errno == EINTR) continue;
+            // completion queue backed up: draining it is the fix, and that's what the caller does next.
+            if (errno == EAGAIN || errno == EBUSY) return;
+            FATAL << "io_uring_enter() failed: " << strerror(errno) << ENDL;
+            exit(-1);
+        }
+        toSubmit -= std::min(toSubmit, static_cast<unsigned>(submitted));
+        return;
+    }
+}
+
+void UringLoop::run() {
+    queueAccept();
+
+    while (1) {
+        if (!tickPending && !timers.empty()) queueTimer();
+        submit(1);
+        batchStart = std::chrono::steady_clock::now();
+
+        // everything that has completed, in one go. Handlers queue their follow-ups for the next submit.
+        unsigned head = *cqHead;
+        unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            io_uring_cqe cqe = cqes[head & cqMask];
+            head++;
+            __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+            handleCompletion(cqe);
+        }
+    }
+}
+
+/*
+    One accept that keeps producing a completion per new connection (multishot, 5.19+).
+    Older kernels turn that down with EINVAL, then it's one accept queued at a time.
+*/
+void UringLoop::queueAccept() {
+    io_uring_sqe *sqe = nextSqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listenFd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    if (multishotAccept) sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = URING_TAG_ACCEPT;
+}
+
+// Wakes us a tick from now for the timer wheel, like epoll_wait's timeout does in EventLoop.
+void UringLoop::queueTimer() {
+    io_uring_sqe *sqe = nextSqe();
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = reinterpret_cast<uint64_t>(&tickInterval);
+    sqe->len = 1;
+    sqe->user_data = URING_TAG_TIMER;
+    tickPending = true;
+}
+
+// Straight into the connection's receive buffer, so the parser picks up where it left off like it does after read().
+void UringLoop::queueRecv(UringConnection &uc) {
+    Connection &conn = uc.conn;
+    conn.recv.compact();
+    io_uring_sqe *sqe = nextSqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn.fd;
+    sqe->addr = reinterpret_cast<uint64_t>(conn.recv.writePtr());
+    sqe->len = static_cast<unsigned>(conn.recv.writable());
+    sqe->user_data = reinterpret_cast<uint64_t>(&uc);
+    uc.pending = URING_RECV;
+    armDeadline(timers, conn, &uc, false);
+}
+
+// Every batched response segment we can fit, as one sendmsg (MSG_MORE if a file body follows).
+void UringLoop::queueSendmsg(UringConnection &uc) {
+    Connection &conn = uc.conn;
+    uc.msg = msghdr{};
+    uc.msg.msg_iov = uc.iov;
+    uc.msg.msg_iovlen = static_cast<std::size_t>(conn.response.fillIov(uc.iov, MAX_IOVECS));
+
+    io_uring_sqe *sqe = nextSqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = conn.fd;
+    sqe->addr = reinterpret_cast<uint64_t>(&uc.msg);
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL | (conn.fileFd >= 0 ? MSG_MORE : 0);
+    sqe->user_data = reinterpret_cast<uint64_t>(&uc);
+    uc.pending = URING_SENDMSG;
+    armDeadline(timers, conn, &uc, true);
+}
+
+// The next piece of the body, into a registered buffer if one is free.
+void UringLoop::queueFileRead(UringConnection &uc) {
+    Connection &conn = uc.conn;
+    if (uc.bufIndex < 0 && !freeBuffers.empty()) {
+        uc.bufIndex = freeBuffers.back();
+        freeBuffers.pop_back();
+    }
+
+    io_uring_sqe *sqe = nextSqe();
+    if (uc.bufIndex >= 0) {
+        uc.body = bufferPool.get() + static_cast<std::size_t>(uc.bufIndex) * URING_BUFFER_SIZE;
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->buf_index = static_cast<uint16_t>(uc.bufIndex);
+    } else {
+        if (!uc.spare) uc.spare = std::make_unique<char[]>(URING_BUFFER_SIZE);
+        uc.body = uc.spare.get();
+        sqe->opcode = IORING_OP_READ;
+    }
+    sqe->fd = conn.fileFd;
+    sqe->off = conn.fileOffset;
+    sqe->addr = reinterpret_cast<uint64_t>(uc.body);
+    sqe->len = static_cast<unsigned>(std::min<uint64_t>(conn.fileRemaining, URING_BUFFER_SIZE));
+    sqe->user_data = reinterpret_cast<uint64_t>(&uc);
+    uc.pending = URING_READ;
+}
+
+void UringLoop::queueBodySend(UringConnection &uc) {
+    Connection &conn = uc.conn;
+    io_uring_sqe *sqe = nextSqe();
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn.fd;
+    sqe->addr = reinterpret_cast<uint64_t>(uc.body + uc.bodySent);
+    sqe->len = static_cast<unsigned>(uc.bodyLen - uc.bodySent);
+    sqe->msg_flags = MSG_NOSIGNAL | (conn.fileRemaining > 0 ? MSG_MORE : 0);
+    sqe->user_data = reinterpret_cast<uint64_t>(&uc);
+    uc.pending = URING_SEND_BODY;
+    armDeadline(timers, conn, &uc, true);
+}
+
+void UringLoop::handleCompletion(const io_uring_cqe &cqe) {
+    if (cqe.user_data == URING_TAG_ACCEPT) {
+        acceptDone(cqe);
+        return;
+    }
+    if (cqe.user_data == URING_TAG_TIMER) {
+        tickPending = false;
+        timers.expire(std::chrono::steady_clock::now(), [this](void *owner) {
+            timedOut(*static_cast<UringConnection*>(owner));
+        });
+        return;
+    }
+    connectionDone(*reinterpret_cast<UringConnection*>(cqe.user_data), cqe.res);
+}
+
+void UringLoop::acceptDone(const io_uring_cqe &cqe) {
+    // without F_MORE the accept is finished (single shot, or the kernel stopped the multishot one).
+    bool rearm = !(cqe.flags & IORING_CQE_F_MORE);
+
+    if (cqe.res < 0) {
+        if (cqe.res == -EINVAL && multishotAccept) {
+            DEBUG << "no multishot accept on this kernel, accepting one at a time" << ENDL;
+            multishotAccept = false;
+        } else if (cqe.res != -EINTR && cqe.res != -ECONNABORTED) {
+            // EMFILE & friends: not worth killing the whole server over.
+            ERROR << "accept() failed: " << strerror(-cqe.res) << ENDL;
+        }
+        if (rearm) queueAccept();
+        return;
+    }
+    if (rearm) queueAccept();
+
+    int connfd = cqe.res;
+    TRACE << "accepted connection on fd " << connfd << ENDL;
+    auto created = std::make_unique<UringConnection>(connfd);
+    UringConnection &uc = *created;
+    connections.emplace(connfd, std::move(created));
+    advance(uc);
+}
+
+// One of the connection's operations came back with res (bytes, or -errno).
+void UringLoop::connectionDone(UringConnection &uc, int res) {
+    Connection &conn = uc.conn;
+    UringOp op = uc.pending;
+    uc.pending = URING_NONE;
+    conn.readyAt = batchStart; // (for whatever request advance() gets to next)
+
+    if (uc.timedOut) {
+        // (already counted and logged when it ran out of time)
+        closeConnection(uc);
+        return;
+    }
+
+    if (res == -EINTR || res == -EAGAIN) {
+        // nothing happened, just go again.
+        if (op == URING_READ) queueFileRead(uc);
+        else if (op == URING_SEND_BODY) queueBodySend(uc);
+        else advance(uc);
+        return;
+    }
+
+    switch (op) {
+    case URING_RECV:
+        if (res == 0) {
+            INFO << "Client Closed Connection (Empty Read)" << ENDL;
+            closeConnection(uc);
+            return;
+        }
+        if (res < 0) {
+            ERROR << "recv() failed: " << strerror(-res) << ENDL;
+            closeConnection(uc);
+            return;
+        }
+        conn.recv.commit(static_cast<std::size_t>(res));
+        advance(uc);
+        return;
+
+    case URING_SENDMSG:
+        if (res < 0) {
+            if (res == -EPIPE || res == -ECONNRESET) {
+                WARNING << "write() failed: connection closed mid-write." << ENDL;
+            } else {
+                ERROR << "sendmsg() failed: " << strerror(-res) << ENDL;
+            }
+            closeConnection(uc);
+            return;
+        }
+        conn.bytesSent += static_cast<uint64_t>(res);
+        conn.response.consume(static_cast<std::size_t>(res));
+        advance(uc);
+        return;
+
+    case URING_READ:
+        if (res <= 0) {
+            if (res == 0) {
+                // we already promised fileRemaining more bytes in Content-Length.
+                WARNING << "Unexpected EOF while sending file" << ENDL;
+            } else {
+                ERROR << "read() failed while sending file: " << strerror(-res) << ENDL;
+            }
+            closeConnection(uc);
+            return;
+        }
+        uc.bodyLen = static_cast<std::size_t>(res);
+        uc.bodySent = 0;
+        conn.fileOffset += static_cast<uint64_t>(res);
+        conn.fileRemaining -= static_cast<uint64_t>(res);
+        queueBodySend(uc);
+        return;
+
+    case URING_SEND_BODY:
+        if (res < 0) {
+            if (res == -EPIPE || res == -ECONNRESET) {
+                WARNING << "Client closed connection while sending file." << ENDL;
+            } else {
+                ERROR << "send() failed while sending file: " << strerror(-res) << ENDL;
+            }
+            closeConnection(uc);
+            return;
+        }
+        conn.bytesSent += static_cast<uint64_t>(res);
+        uc.bodySent += static_cast<std::size_t>(res);
+        if (uc.bodySent < uc.bodyLen) {
+            queueBodySend(uc);
+            return;
+        }
+        releaseBuffer(uc);
+        advance(uc);
+        return;
+
+    case URING_NONE:
+        break;
+    }
+    ERROR << "completion for fd " << conn.fd << " with nothing pending" << ENDL;
+}
+
+/*
+    Queue whatever the connection needs next, the same steps serviceConnection goes through in EventLoop:
+    READING -> (request complete) -> queue the response -> send it all, body included -> READING again
+    on keep-alive, or close. The next request may already be sitting in conn.recv, so that's always
+    checked before asking the kernel for more.
+*/
+void UringLoop::advance(UringConnection &uc) {
+    Connection &conn = uc.conn;
+    while (1) {
+        if (conn.state == CONN_READING) {
+            if (!parseBufferedRequest(conn)) {
+                // part of one is in: start (or check) its header clock, armDeadline goes by it from here.
+                if (conn.recv.size() > 0 && headerTimedOut(conn)) {
+                    closeConnection(uc);
+                    return;
+                }
+                queueRecv(uc);
+                return;
+            }
+            queueResponses(conn);
+        }
+
+        if (conn.response.pendingSegments() > 0) {
+            queueSendmsg(uc);
+            return;
+        }
+        if (conn.fileFd >= 0) {
+            advanceFileBody(conn);
+            if (conn.response.pendingSegments() > 0) continue; // a multipart part header goes out first
+            if (conn.fileFd >= 0) {
+                queueFileRead(uc);
+                return;
+            }
+        }
+
+        // the whole response is out.
+        if (!conn.keepAlive) {
+            closeConnection(uc);
+            return;
+        }
+        resetRequest(conn);
+    }
+}
+
+void UringLoop::releaseBuffer(UringConnection &uc) {
+    if (uc.bufIndex >= 0) freeBuffers.push_back(uc.bufIndex);
+    uc.bufIndex = -1;
+    uc.body = nullptr;
+    uc.bodyLen = uc.bodySent = 0;
+}
+
+// Only ever called with nothing in flight for the connection, so the kernel is done with everything in it.
+void UringLoop::closeConnection(UringConnection &uc) {
+    int fd = uc.conn.fd;
+    TRACE << "closing connection on fd " << fd << ENDL;
+    releaseBuffer(uc);
+    close(fd);
+    connections.erase(fd); // (uc is gone after this)
+}
+
+/*
+    Ran out of time for whatever it was waiting on. Its recv or send is still with the kernel, so we
+    can't free it here: shutdown() makes that come back straight away, and then it gets closed.
+*/
+void UringLoop::timedOut(UringConnection &uc) {
+    static const char *waitingFor[TIMEOUT_KINDS] = {"idle", "sending its request header", "taking its response"};
+    DEBUG << "connection on fd " << uc.conn.fd << " took too long (" << waitingFor[uc.conn.timeoutKind] << "), closing" << ENDL;
+    countTimeout(uc.conn.timeoutKind);
+    uc.timedOut = true;
+    shutdown(uc.conn.fd, SHUT_RDWR);
+}
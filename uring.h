@@ -0,0 +1,125 @@
+#ifndef URING_H
+#define URING_H
+
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include <linux/io_uring.h>
+
+#include "webServer.h"
+
+#define URING_ENTRIES 256            // submission queue slots (the completion queue gets URING_CQ_ENTRIES)
+#define URING_CQ_ENTRIES 4096
+#define URING_BUFFERS 64             // registered buffers file bodies are read into
+#define URING_BUFFER_SIZE (64 * 1024)
+
+// What a connection is waiting on. There's never more than one of them in flight per connection.
+enum UringOp {
+    URING_NONE,
+    URING_RECV,      // more of the request
+    URING_SENDMSG,   // queued response segments
+    URING_READ,      // the next piece of a file body from disk
+    URING_SEND_BODY  // ...and that piece going out
+};
+
+struct UringConnection {
+    Connection conn;
+    UringOp pending = URING_NONE;
+    bool timedOut = false; // its deadline shut it down, whatever comes back next just closes it
+
+    // the kernel reads these when it gets round to the sendmsg, so they live here rather than on the stack.
+    struct iovec iov[MAX_IOVECS];
+    struct msghdr msg{};
+
+    // file body piece in flight: a registered buffer (bufIndex >= 0) or, if they're all taken, spare.
+    int bufIndex = -1;
+    std::unique_ptr<char[]> spare;
+    char *body = nullptr;
+    std::size_t bodyLen = 0, bodySent = 0;
+
+    explicit UringConnection(int connfd) : conn(connfd) {}
+};
+
+/*
+    Single threaded io_uring engine (-m uring), the completion based sibling of EventLoop.
+    Instead of waiting for readiness and then doing the read/send ourselves, we hand the kernel the
+    whole operation (accept, recv straight into conn.recv, sendmsg of the queued iovecs, read of
+    the next piece of a file body into a registered buffer, send of that piece) and get told when
+    it's done. Everything queued while handling one batch of completions goes to the kernel in a
+    single io_uring_enter(), which is also where we wait for the next batch.
+    Only accept is multishot, and file bodies aren't spliced (README.txt says why).
+    The request/response logic is the same parseBufferedRequest/queueResponses/resetRequest the
+    other drivers use; only the socket and disk I/O are different.
+    Talks to the kernel with the raw syscalls (no liburing). If the ring can't be set up, or the
+    kernel is missing something we need, ready() is false and main falls back to EventLoop.
+*/
+class UringLoop {
+public:
+    explicit UringLoop(int listenFd);
+    ~UringLoop();
+
+    bool ready() const { return ringFd >= 0; }
+    void run(); // never returns.
+
+private:
+    bool setupRing();
+    bool supportsOps();
+    void registerBuffers();
+
+    io_uring_sqe *nextSqe();
+    void submit(unsigned waitFor);
+
+    void queueAccept();
+    void queueTimer();
+    void queueRecv(UringConnection &uc);
+    void queueSendmsg(UringConnection &uc);
+    void queueFileRead(UringConnection &uc);
+    void queueBodySend(UringConnection &uc);
+
+    void handleCompletion(const io_uring_cqe &cqe);
+    void acceptDone(const io_uring_cqe &cqe);
+    void connectionDone(UringConnection &uc, int res);
+    void advance(UringConnection &uc);
+    void releaseBuffer(UringConnection &uc);
+    void closeConnection(UringConnection &uc);
+    void timedOut(UringConnection &uc);
+
+    int listenFd;
+    int ringFd = -1;
+    bool multishotAccept = true;
+
+    // submission queue
+    void *sqRing = nullptr;
+    std::size_t sqRingSize = 0;
+    unsigned *sqHead = nullptr;
+    unsigned *sqTail = nullptr;
+    unsigned sqMask = 0;
+    unsigned sqEntries = 0;
+    io_uring_sqe *sqes = nullptr;
+    std::size_t sqesSize = 0;
+    unsigned toSubmit = 0;
+
+    // completion queue (the same mapping as the submission queue when the kernel has IORING_FEAT_SINGLE_MMAP)
+    void *cqRing = nullptr;
+    std::size_t cqRingSize = 0;
+    unsigned *cqHead = nullptr;
+    unsigned *cqTail = nullptr;
+    unsigned cqMask = 0;
+    io_uring_cqe *cqes = nullptr;
+
+    // registered buffers for file bodies, empty if registering them didn't work out.
+    std::unique_ptr<char[]> bufferPool;
+    std::vector<int> freeBuffers;
+
+    // deadlines: while any are armed a timeout op wakes us every tick to see to the wheel.
+    TimerWheel timers;
+    bool tickPending = false;
+
+    std::chrono::steady_clock::time_point batchStart; // when the completions being handled came in, for conn.readyAt
+    __kernel_timespec tickInterval{0, TIMER_TICK_MS * 1000000LL};
+
+    std::unordered_map<int, std::unique_ptr<UringConnection>> connections; // owns every open connection, keyed by fd.
+};
+
+#endif
@@ -0,0 +1,60 @@
+/*
+    validatorBench: the old std::regex filename check against the compile-time DFA one.
+    Checks both agree on every sample first, then times each over the same names.
+
+    make validatorBench && ./validatorBench [iterations]
+*/
+#include <chrono>
+#include <iostream>
+#include <regex>
+#include <string>
+#include <vector>
+
+#include "fileValidator.h"
+
+// exactly what is_file_valid used to do for the base name.
+static bool regexValid(const std::string &base) {
+    static const std::regex allowed(R"(^[A-Za-z]+[0-9]+\.(html|jpg)$)", std::regex::icase);
+    return std::regex_match(base, allowed);
+}
+
+static bool dfaValid(const std::string &base) {
+    return DfaValidator<AssignmentFilePolicy>::matches(base);
+}
+
+template <typename Check>
+static double nsPerCall(Check check, const std::vector<std::string> &names, long iterations) {
+    long hits = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < iterations; i++) {
+        hits += check(names[i % names.size()]);
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    if (hits < 0) std::cout << ""; // keep the loop from being thrown away
+    return std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+}
+
+int main(int argc, char *argv[]) {
+    long iterations = (argc > 1) ? std::stol(argv[1]) : 1000000;
+
+    std::vector<std::string> names = {
+        "index1.html", "file1.html", "image1.jpg", "IMAGE22.JPG", "file2.html",
+        "nope.html", "1file.html", "file1.htm", "file1.html.bak", "",
+        "aVeryLongFileNameThatIsStillValid12345.html", "file1.png", "../file1.html", "file1.HtMl",
+    };
+
+    for (const std::string &name : names) {
+        if (regexValid(name) != dfaValid(name)) {
+            std::cout << "MISMATCH on \"" << name << "\": regex " << regexValid(name)
+                      << ", dfa " << dfaValid(name) << std::endl;
+            return 1;
+        }
+    }
+
+    double regexNs = nsPerCall(regexValid, names, iterations);
+    double dfaNs = nsPerCall(dfaValid, names, iterations);
+    std::cout << "states in the assignment DFA: " << DfaValidator<AssignmentFilePolicy>::dfa.stateCount << std::endl;
+    std::cout << "std::regex: " << regexNs << " ns/name" << std::endl;
+    std::cout << "DFA:        " << dfaNs << " ns/name (" << regexNs / dfaNs << "x faster)" << std::endl;
+    return 0;
+}
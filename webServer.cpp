@@ -1,21 +1,73 @@
 #include "webServer.h"
 #include "logging.h"
+#include "eventLoop.h"
+#include "uring.h"
+#include "coroScheduler.h"
+#include "threadPool.h"
+#include "contentCache.h"
+#include "fileIndex.h"
+#include "responseBuilder.h"
 #include <fcntl.h>
+#include <atomic>
+#include <thread>
+#include <pthread.h>
+#include <sys/sendfile.h>
+#include <poll.h>
+#include <netinet/tcp.h>
 
-std::filesystem::path webRoot = std::filesystem::current_path() / "data";
+// const: it's read from every worker thread, nobody gets to change it after startup.
+const std::filesystem::path webRoot = std::filesystem::current_path() / "data";
 
-bool check_for_file(const std::string &reqPath, std::string &resolvedPath) {
+// flips to false (for good) the first time sendfile() turns out not to work here.
+static std::atomic<bool> sendfileAvailable{true};
+
+// created in main() (unless -c 0), shared by every thread after that.
+static std::unique_ptr<ContentCache> contentCache;
+
+// every file under webRoot, built in main() (unless -i 0) before we take any connections.
+static std::unique_ptr<FileIndex> fileIndex;
+
+void setupFileServices(int cacheMegabytes, int indexThreads) {
+    contentCache.reset();
+    fileIndex.reset();
+    if (cacheMegabytes > 0) {
+        contentCache = std::make_unique<ContentCache>(static_cast<std::size_t>(cacheMegabytes) * 1024 * 1024);
+    }
+    if (indexThreads > 0) {
+        fileIndex = std::make_unique<FileIndex>(webRoot.string());
+        fileIndex->build(static_cast<unsigned>(indexThreads));
+    }
+}
+
+bool check_for_file(std::string_view reqPath, std::string &resolvedPath) {
     if(
         reqPath.empty() ||
         reqPath.front() != '/' ||
-        reqPath.find("..") != std::string::npos
+        reqPath.find("..") != std::string_view::npos
     ) {
         return false;
     }
 
-    std::string localPath = reqPath.substr(1); // drop leading slash
+    std::string_view localPath = reqPath.substr(1); // drop leading slash
+
+    // the index knows every file, so a hit or (usually) a miss never touches the filesystem.
+    if (fileIndex) {
+        static const std::string rootPrefix = webRoot.string() + "/";
+        if (fileIndex->lookup(localPath)) {
+            resolvedPath.assign(rootPrefix).append(localPath);
+            return true;
+        }
+        if (fileIndex->authoritative()) return false;
+    }
 
     std::filesystem::path fullPath = webRoot / localPath;
+
+    // cached (and still fresh) means it's a regular file we've already read, no need to ask the filesystem.
+    if (contentCache && contentCache->find(fullPath.string())) {
+        resolvedPath = fullPath.string();
+        return true;
+    }
+
     if(
         !std::filesystem::exists(fullPath) || 
         !std::filesystem::is_regular_file(fullPath)
@@ -27,15 +79,168 @@ bool check_for_file(const std::string &reqPath, std::string &resolvedPath) {
     return true;
 }
 
+// Only the last path component is checked, against whichever policy -p picked (fileValidator.h).
 bool is_file_valid(const std::string &filename) {
-    DEBUG << "checking file validity for filename" << filename << ENDL;
-    std::filesystem::path p(filename);
-    std::string base = p.filename().string();
-    static const std::regex allowed(R"(^[A-Za-z]+[0-9]+\.(html|jpg)$)", std::regex::icase);
-    return std::regex_match(base, allowed);
+    std::string_view base(filename);
+    std::size_t slash = base.find_last_of('/');
+    if (slash != std::string_view::npos) base.remove_prefix(slash + 1);
+    return activeFilePolicy->matches(base);
+}
+
+// Does the comma separated header value contain `token` (case-insensitive)? e.g. "keep-alive, Upgrade"
+static bool hasToken(std::string_view value, std::string_view token) {
+    while (!value.empty()) {
+        std::size_t comma = value.find(',');
+        std::string_view item = value.substr(0, comma);
+        while (!item.empty() && (item.front() == ' ' || item.front() == '\t')) item.remove_prefix(1);
+        while (!item.empty() && (item.back() == ' ' || item.back() == '\t')) item.remove_suffix(1);
+        if (item.size() == token.size() && strncasecmp(item.data(), token.data(), token.size()) == 0) return true;
+        if (comma == std::string_view::npos) break;
+        value.remove_prefix(comma + 1);
+    }
+    return false;
+}
+
+/*
+    HTTP/1.1 connections stay open unless the client says "Connection: close",
+    HTTP/1.0 ones only stay open if it asks for "Connection: keep-alive".
+    Either way we stop after keepAliveMax requests.
+*/
+static bool wantsKeepAlive(const Connection &conn, const HttpRequest &req) {
+    if (conn.requestCount >= keepAliveMax) return false;
+
+    std::string_view connectionHeader = req.header(HDR_CONNECTION);
+    if (req.version == "HTTP/1.1") return !hasToken(connectionHeader, "close");
+    return hasToken(connectionHeader, "keep-alive");
+}
+
+// Are we too far behind to serve this one (see overload.h)? Only asked when we know how long it waited.
+static bool overloaded(const Connection &conn) {
+    if (conn.readyAt == std::chrono::steady_clock::time_point{}) return false;
+    std::chrono::steady_clock::duration delay = conn.requestStart - conn.readyAt;
+    if (conn.requestCount == 1) {
+        // a new connection may have sat in the listen backlog before we ever saw it, where most of the
+        // waiting happens once we're behind. The kernel knows how long ago its request came in (in ms).
+        struct tcp_info info;
+        socklen_t len = sizeof(info);
+        if (getsockopt(conn.fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) {
+            delay = std::max<std::chrono::steady_clock::duration>(delay, std::chrono::milliseconds(info.tcpi_last_data_recv));
+        }
+    }
+    return overloadControl().shouldShed(conn.requestStart, delay);
+}
+
+/*
+    Work out the return code for a request the parser just finished with.
+    Anything that isn't a clean GET closes the connection afterwards, we can't trust where the
+    next request would start.
+*/
+static void handleRequest(Connection &conn, ParseStatus status) {
+    conn.rtnCode = 400;
+    conn.keepAlive = false;
+    conn.requestCount++;
+    conn.requestStart = std::chrono::steady_clock::now();
+
+    if (status == PARSE_URI_TOO_LONG) {
+        conn.rtnCode = 414;
+        INFO << "Request line over " << parserLimits.maxRequestLine << " bytes, Providing status: 414" << ENDL;
+        return;
+    }
+    if (status == PARSE_HEADERS_TOO_LARGE) {
+        conn.rtnCode = 431;
+        INFO << "Header over " << parserLimits.maxHeaders << " lines / " << parserLimits.maxHeaderBytes
+             << " bytes, Providing status: 431" << ENDL;
+        return;
+    }
+
+    // Get should always be first, GET in other places is as good as invalid.
+    const HttpRequest &req = conn.parser.request();
+    if(
+        status == PARSE_DONE
+        && req.method == "GET"
+        && req.version.substr(0, 5) == "HTTP/"
+    ) {
+        // this also sets filename to be the proper local path (string)
+        // filename should update during this short-circuit (check_for_file modifies it)
+        if (req.target == STATS_PATH || req.target == STATS_JSON_PATH) {
+            // reserved, never a file: doesn't go near check_for_file or the filename policy.
+            conn.rtnCode = 200;
+            conn.stats = (req.target == STATS_JSON_PATH) ? STATS_JSON : STATS_TEXT;
+        } else if (overloaded(conn)) {
+            // a 503 now beats a slow answer later. It closes the connection too, one less client queueing.
+            conn.rtnCode = 503;
+            INFO << "Overloaded, shedding GET request for " << req.target << " Providing status: 503" << ENDL;
+            return;
+        } else if(check_for_file(req.target, conn.filename) && is_file_valid(conn.filename)) {
+            conn.rtnCode = 200;
+        } else {
+            conn.rtnCode = 404;
+        }
+        conn.keepAlive = wantsKeepAlive(conn, req);
+        conn.acceptedCodings = acceptedCodings(req.header(HDR_ACCEPT_ENCODING));
+        if (req.has(HDR_RANGE)) parseRangeHeader(req.header(HDR_RANGE), conn.range);
+        INFO << "Recieved GET request for " << req.target << " Providing status: " << conn.rtnCode << ENDL;
+    } else {
+        INFO << "Recieved potentially malformed HTTP request" << ENDL;
+        // implicitely returning 400;
+    }
+}
+
+/*
+    If the receive buffer holds a whole request, parse it, take it out of the buffer and work out the
+    response. Never touches the socket, so it's also how we pick up requests pipelined behind the last one.
+    Taking it out only moves the buffer's start, the bytes (and the request's views of them) stay put
+    until the next read.
+*/
+bool parseBufferedRequest(Connection &conn) {
+    ParseStatus status = conn.parser.parse(conn.recv.data(), conn.recv.size());
+    if (status == PARSE_INCOMPLETE) return false;
+
+    conn.recv.consume(conn.parser.consumed());
+    handleRequest(conn, status);
+    return true;
 }
 
-/* 
+/*
+    Call with part of a request buffered: starts its header clock if it isn't running yet, and says
+    (and counts) when it has run out.
+*/
+bool headerTimedOut(Connection &conn) {
+    auto now = std::chrono::steady_clock::now();
+    if (conn.headerDeadline == std::chrono::steady_clock::time_point{}) {
+        conn.headerDeadline = now + std::chrono::seconds(headerTimeout);
+        return false;
+    }
+    if (now < conn.headerDeadline) return false;
+    DEBUG << "request header on fd " << conn.fd << " not complete after " << headerTimeout << "s, closing" << ENDL;
+    countTimeout(TIMEOUT_HEADER);
+    return true;
+}
+
+/*
+    For the reactors: arm the connection's timer for whatever it's about to wait on.
+    Writing: writeTimeout from now, so every bit of progress pushes it back.
+    Reading a request that has started: its headerDeadline, which never moves.
+    Waiting for the next request: keepAliveTimeout from now.
+    The driver closes the connection when it fires (and counts conn.timeoutKind).
+*/
+void armDeadline(TimerWheel &timers, Connection &conn, void *owner, bool writing) {
+    auto now = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point when;
+    if (writing) {
+        conn.timeoutKind = TIMEOUT_WRITE;
+        when = now + std::chrono::seconds(writeTimeout);
+    } else if (conn.headerDeadline != std::chrono::steady_clock::time_point{}) {
+        conn.timeoutKind = TIMEOUT_HEADER;
+        when = conn.headerDeadline;
+    } else {
+        conn.timeoutKind = TIMEOUT_IDLE;
+        when = now + std::chrono::seconds(keepAliveTimeout);
+    }
+    timers.arm(conn.timer, owner, when);
+}
+
+/*
 1. Set the default return code to 400
 2. Read everything up to and including the end of the header.
 3. Look at the first line of the header to see if it contains a valid GET
@@ -43,130 +248,86 @@ bool is_file_valid(const std::string &filename) {
     b. If there is a filename, make sure it is a valid filename according to the specs of the assignment.
         i. If the filename is valid set the return code to 200.
         ii. If the filename is invalid set the return code to 404.
-*/
-int readRequest(int connfd, std::string &filename) {
-    int rtnCode = 400;
-
-    std::vector<std::string> lines;
 
-    std::string leftovers; // overflow from last line, will be attached to next line.
+This works in steps: whatever the socket has right now gets read into conn.recv (as much as fits,
+not 10 bytes at a time), the parser picks up where it left off, and if the blank line hasn't shown up
+yet we return STEP_AGAIN and carry on from there on the next call.
+On a blocking socket read() just waits, so this runs straight through like before.
+*/
+StepStatus readRequest(Connection &conn) {
     while (1) {
-        std::string line = std::move(leftovers);
-
-        // If leftover bytes already contain a full line, peel it off now.
-        if (size_t newlinePos = line.find(LINE_TERMINATOR); newlinePos != std::string::npos) {
-            leftovers.assign(line.begin() + newlinePos + termLen, line.end());
-            line.erase(newlinePos + termLen);
-        } else { // Otherwise keep reading in 10-byte chunks until we build a full line.
-            char chunk[CHUNK_SIZE];
-            while (true) { // read loop (go in chunks, appending to line until we hit terminator)
-                ssize_t bytesRead = read(connfd, chunk, sizeof(chunk));
-                if (bytesRead == 0) {
-                    INFO << "Client Closed Connection (Empty Read)" << ENDL;
-                    return rtnCode;
-                }
-                if (bytesRead < 0) {
-                    if (errno == EINTR) continue;
-                    ERROR << "read() failed: " << strerror(errno) << ENDL;
-                    return rtnCode;
-                }
-
-                line.append(chunk, bytesRead);
-                if (size_t newlinePos = line.find(LINE_TERMINATOR); newlinePos != std::string::npos) {
-                    leftovers.assign(line.begin() + newlinePos + termLen, line.end());
-                    line.erase(newlinePos + termLen);
-                    break; // (end read)
-                }
-            }
+        // If the buffer already holds a full request, we're done without touching the socket.
+        if (parseBufferedRequest(conn)) return STEP_DONE;
+        if (conn.recv.size() > 0) {
+            // part of one is in, and it only gets headerTimeout to finish (so a byte a second can't keep us forever).
+            if (headerTimedOut(conn)) return STEP_CLOSED;
+            // the rest is up to the client, however long that takes isn't time it spent waiting on us.
+            // (the reactors stamp readyAt again when it turns up)
+            conn.readyAt = {};
         }
 
-        // Condition for break: blank line (\r\n\r\n, but we've sanitized/clipped above so there should just be "" left)
-        if (line.empty() || line == std::string(LINE_TERMINATOR)) break;
-        // Otherwise just keep appending to lines.
-        lines.push_back(line);
-    }
-
-    // Read lines to parse out GET request next...
-    // Get should always be first, so we can just look at [0]. GET in other places is as good as invalid.
-    if (!lines.empty()) {
-        std::istringstream iss(lines[0]);
-        std::string method, reqPath, version;
-        iss >> method;
-        iss >> reqPath;
-        iss >> version;
-        if(
-            !iss.fail() 
-            && method == "GET" 
-            && version.compare(0, 5, "HTTP/") == 0
-        ) {
-            // this also sets filename to be the proper local path (string)
-            // filename should update during this short-circuit (check_for_file modifies it)
-            if(check_for_file(reqPath, filename) && is_file_valid(filename)) {
-                rtnCode = 200;
-            } else {
-                rtnCode = 404;
-            }
-            INFO << "Recieved GET request for " << reqPath << " Providing status: " << rtnCode << ENDL;
-        } else {
-            INFO << "Recieved potentially malformed HTTP request" << ENDL;
-            // implicitely returning 400;
+        // Otherwise make room and read some more. (The parser gives up with a 431 before a
+        // request can outgrow the buffer, so there's always room here.)
+        conn.recv.compact();
+        char *dst = conn.recv.writePtr();
+        ssize_t bytesRead = read(conn.fd, dst, conn.recv.writable());
+        if (bytesRead == 0) {
+            INFO << "Client Closed Connection (Empty Read)" << ENDL;
+            return STEP_CLOSED;
+        }
+        if (bytesRead < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return STEP_AGAIN; // nothing more for now.
+            ERROR << "read() failed: " << strerror(errno) << ENDL;
+            return STEP_CLOSED;
         }
+        conn.recv.commit(static_cast<std::size_t>(bytesRead));
     }
-
-    // Feels kinda silly that we basically don't touch the remainder of the header,
-    // but we do have it and it is properly reading it!!!
-
-    return rtnCode;
 }
 
 /*
-sendLine(socketFD, std::string &stringToSend)
+sendLine(conn, std::string &stringToSend)
     1. Convert the std::string to an array that is 2 bytes longer than the string.
     2. Replace the last two bytes of the array with the <CR> and <LF>
-    3. Use write to send that array.
+    3. Queue that array, writeResponse() does the actual send().
+    Only for headers we have to build on the spot, anything fixed is prebuilt (see responseBuilder.h).
 */
-void sendLine(int connfd, const std::string &stringToSend) {
-    std::string line = stringToSend + std::string(LINE_TERMINATOR);
+void sendLine(Connection &conn, const std::string &stringToSend) {
+    conn.response.addCopy(stringToSend);
+    conn.response.addCopy(LINE_TERMINATOR);
+}
 
-    std::size_t sent = 0;
-    while(sent < line.size()) {
-        /* replaced write with send, to include MSG_NOSIGNAL
-           this prevents SIGPIPE (client closed during write) from terminating the process.
-           send, like write, should still just work with raw bytes.
-        */
-        ssize_t written = send(connfd, line.data() + sent, line.size() - sent, MSG_NOSIGNAL);
-        if(written < 0) {
-            if (errno == EINTR) continue;
-            if (errno == EPIPE) {
-                WARNING << "write() failed: connection closed mid-write." << ENDL;
-                return;
-            }
-            ERROR << "write() failed in sendLine: " << strerror(errno) << ENDL;
-            return;
-        }
-        sent += static_cast<std::size_t>(written); // (convert written to unsigned to append nicely)
-    }
+// Every header block ends the same way: whether the connection survives the response, then the blank line.
+void finishHeaders(Connection &conn) {
+    conn.response.addStatic(conn.keepAlive ? prebuiltResponses.endHeadersKeepAlive : prebuiltResponses.endHeadersClose);
+}
+
+void send404(Connection &conn) {
+    conn.rtnCode = 404; // (sendFile falls back to this too)
+    conn.response.addStatic(conn.keepAlive ? prebuiltResponses.notFoundKeepAlive : prebuiltResponses.notFoundClose);
 }
 
-void send404(int connfd) {
-    sendLine(connfd, "HTTP/1.1 404 Not Found ");
-    sendLine(connfd, "Content-Type: text/html; charset=UTF-8");
-    sendLine(connfd, "");
-    sendLine(connfd, "<!DOCTYPE html>");
-    sendLine(connfd, "<html lang=\"en\"><head><meta charset=\"utf-8\"><title>404</title></head>");
-    sendLine(connfd, "<body><h1>404 :(</h1><p>The requested file was not found.</p></body></html>");
+void send400(Connection &conn) {
+    conn.response.addStatic(prebuiltResponses.badRequest);
 }
 
-void send400(int connfd) {
-    sendLine(connfd, "HTTP/1.1 400 Bad Request");
-    sendLine(connfd, "");
+void send414(Connection &conn) {
+    conn.response.addStatic(prebuiltResponses.uriTooLong);
+}
+
+void send431(Connection &conn) {
+    conn.response.addStatic(prebuiltResponses.headersTooLarge);
+}
+
+void send503(Connection &conn) {
+    conn.response.addStatic(prebuiltResponses.serviceUnavailable);
 }
 
 /*
 // **************************************************************************
 // * Send a 200
 // **************************************************************************
-sendFile(socketFD, filename)
+sendFile(conn, filename)
 1. Use the stat() function call to find the size of the file.
 2. If stat fails you don’t have read permission or the file does not exist.
     a. Send a 404 by calling send404()
@@ -178,125 +339,877 @@ sendFile(socketFD, filename)
     a. Note – if the content length and/or file type are not sent correctly, your browser will not display the file correctly.
 7. Send the file itself.
     a. Open the file.
-    b. Allocate 10 bytes of memory with malloc() or new[]
-    c. While #of-bytes-sent != size-of-file
-        i. Clear out the memory with bzero or something similar.
-        ii. read() up to 10 bytes from the file into your memory buffer
-        iii. write() the number of bytes you read
+    b. Small files get read in right behind the header. Bigger ones hand the fd to the connection
+       and writeResponse() streams it out with sendfile() (or CHUNK_SIZE read/send pieces as a fallback)
+       as the socket has room for it.
 8. when you are done you can just return. Since you set the content- length you don’t send the line terminator at the end of the file.
 */
-void sendFile(int connfd, std::string filename) {
-    struct stat st; 
+/*
+    Content type depending on the type of file (text/html or image/jpeg).
+*/
+std::string contentTypeFor(const std::string &filename) {
+    std::filesystem::path p(filename);
+    std::string ext = p.extension().string();
+    TRACE << "requested file has extension " << ext << ENDL;
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c){ return std::tolower(c); });
+
+    if (ext == ".html" || ext == ".htm") return "text/html; charset=utf-8";
+    if (ext == ".jpg" || ext == ".jpeg") return "image/jpeg";
+    if (ext == ".png") return "image/png";
+    if (ext == ".gif") return "image/gif";
+    if (ext == ".css") return "text/css; charset=utf-8";
+    if (ext == ".js") return "text/javascript; charset=utf-8";
+    if (ext == ".txt") return "text/plain; charset=utf-8";
+    return "application/octet-stream"; // fallback (should never see this).
+}
+
+/*
+    200 for a file we have in memory: its header block was built when it was cached,
+    so the whole response is three iovecs pointing at bytes that already exist.
+*/
+// The client's copy is still good: validators (and Vary) only, no body.
+static void send304(Connection &conn, const std::string &etag, const std::string &lastModified, bool varies) {
+    conn.rtnCode = 304;
+    sendLine(conn, "HTTP/1.1 304 Not Modified");
+    conn.response.addCopy(validatorLines(etag, lastModified));
+    if (varies) sendLine(conn, "Vary: Accept-Encoding");
+    finishHeaders(conn);
+}
+
+// "Content-Range: bytes 0-499/1234"
+static std::string contentRange(const ByteRange &range, uint64_t size) {
+    return "Content-Range: bytes " + std::to_string(range.offset) + "-"
+        + std::to_string(range.offset + range.length - 1) + "/" + std::to_string(size);
+}
+
+// Unique enough: nobody can guess it ahead of time to plant it in a file, and it changes every response.
+static std::string newBoundary() {
+    static std::atomic<uint64_t> counter{0};
+    uint64_t mix = (static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count()) << 16)
+        ^ counter.fetch_add(1, std::memory_order_relaxed) ^ reinterpret_cast<uintptr_t>(&counter);
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(mix));
+    return std::string("byteranges_") + hex;
+}
+
+/*
+    What a 206 needs besides the file bytes themselves: the header block (up to the Connection: line),
+    for multipart/byteranges the part header in front of each range, and the closing boundary.
+    One range is just a normal body with a Content-Range header, no parts.
+*/
+struct RangePlan {
+    ByteRange ranges[MAX_RANGES];
+    int count = 0;
+    std::string header;
+    std::string prefixes[MAX_RANGES];
+    std::string epilogue;
+};
+
+// varies: the file has compressed variants, so this says Vary: Accept-Encoding like its 200 does.
+static void planRanges(RangePlan &plan, const std::string &contentType, uint64_t size, const std::string &validators,
+                       bool varies) {
+    const std::string crlf(LINE_TERMINATOR);
+    uint64_t contentLength = 0;
+
+    plan.header = "HTTP/1.1 206 Partial Content" + crlf;
+    if (plan.count == 1) {
+        contentLength = plan.ranges[0].length;
+        plan.header += "Content-Type: " + contentType + crlf + contentRange(plan.ranges[0], size) + crlf;
+    } else {
+        std::string boundary = newBoundary();
+        for (int i = 0; i < plan.count; i++) {
+            plan.prefixes[i] = crlf + "--" + boundary + crlf + "Content-Type: " + contentType + crlf
+                + contentRange(plan.ranges[i], size) + crlf + crlf;
+            contentLength += plan.prefixes[i].size() + plan.ranges[i].length;
+        }
+        plan.epilogue = crlf + "--" + boundary + "--" + crlf;
+        contentLength += plan.epilogue.size();
+        plan.header += "Content-Type: multipart/byteranges; boundary=" + boundary + crlf;
+    }
+    plan.header += "Content-Length: " + std::to_string(contentLength) + crlf + validators;
+    if (varies) plan.header += "Vary: Accept-Encoding" + crlf;
+}
+
+// Range not satisfiable: nothing in the file matched. Content-Range tells the client how big it is.
+static void send416(Connection &conn, uint64_t size, bool varies) {
+    conn.rtnCode = 416;
+    sendLine(conn, "HTTP/1.1 416 Range Not Satisfiable");
+    sendLine(conn, "Content-Range: bytes */" + std::to_string(size));
+    sendLine(conn, "Content-Length: 0");
+    if (varies) sendLine(conn, "Vary: Accept-Encoding");
+    finishHeaders(conn);
+}
+
+// 206 with the bytes coming out of the cache entry: every range is just a slice of its body, nothing copied.
+static void sendCachedRanges(Connection &conn, const std::shared_ptr<const CachedFile> &cached, RangePlan &plan) {
+    std::string_view body = cached->body();
+    conn.rtnCode = 206;
+    planRanges(plan, cached->contentType, cached->size,
+               validatorLines(cached->variants[CODING_IDENTITY].etag, cached->lastModified), cached->varies);
+    conn.response.addCopy(plan.header);
+    finishHeaders(conn);
+    for (int i = 0; i < plan.count; i++) {
+        conn.response.addCopy(plan.prefixes[i]);
+        conn.response.addShared(cached, body.substr(plan.ranges[i].offset, plan.ranges[i].length));
+    }
+    conn.response.addCopy(plan.epilogue);
+}
+
+// 206 streamed from disk: the first range starts right away, the rest queue up as conn.fileParts.
+static void sendStreamedRanges(Connection &conn, int filefd, const std::string &contentType, uint64_t size,
+                               const std::string &validators, RangePlan &plan) {
+    conn.rtnCode = 206;
+    planRanges(plan, contentType, size, validators, false); // (only cached files get compressed variants)
+    conn.response.addCopy(plan.header);
+    finishHeaders(conn);
+    conn.response.addCopy(plan.prefixes[0]);
+
+    conn.fileFd = filefd;
+    conn.fileOffset = plan.ranges[0].offset;
+    conn.fileRemaining = plan.ranges[0].length;
+    conn.chunkLen = conn.chunkSent = 0;
+    conn.useSendfile = sendfileAvailable;
+    for (int i = 1; i < plan.count; i++) {
+        conn.fileParts.push_back(FilePart{plan.prefixes[i], plan.ranges[i].offset, plan.ranges[i].length});
+    }
+    if (!plan.epilogue.empty()) conn.fileParts.push_back(FilePart{plan.epilogue, 0, 0});
+}
+
+/*
+    A file we have in memory: 304 if the client already has this version, 206/416 for a Range
+    (unless If-Range says the client's copy is a different version), the whole thing otherwise.
+    Validators and every header were worked out when it was cached, so this is all lookups.
+*/
+static void sendCachedFile(Connection &conn, const std::shared_ptr<const CachedFile> &cached) {
+    const HttpRequest &req = conn.parser.request();
+    const CachedVariant &variant = cached->variantFor(conn.acceptedCodings);
+
+    if (notModified(req, variant.etag, cached->mtime.tv_sec)) {
+        send304(conn, variant.etag, cached->lastModified, cached->varies);
+        return;
+    }
+
+    if (conn.range.present && ifRangeMatches(req, cached->variants[CODING_IDENTITY].etag, cached->mtime.tv_sec)) {
+        RangePlan plan;
+        plan.count = resolveRanges(conn.range, cached->size, plan.ranges);
+        if (plan.count == 0) {
+            send416(conn, cached->size, cached->varies);
+        } else {
+            sendCachedRanges(conn, cached, plan);
+        }
+        return;
+    }
+
+    conn.response.addShared(cached, variant.header);
+    finishHeaders(conn);
+    conn.response.addShared(cached, variant.body);
+}
+
+void sendFile(Connection &conn, const std::string &filename) {
+    // Hot path: cached and known to be current, so no stat/open/read at all.
+    if (contentCache) {
+        if (auto cached = contentCache->find(filename)) {
+            sendCachedFile(conn, cached);
+            return;
+        }
+    }
+
+    struct stat st;
     if(stat(filename.c_str(), &st) < 0) {
         // don’t have read permission or the file does not exist.
         DEBUG << "cannot send file (failed at size check), likely do not have permissions. Falling back to 404." << ENDL;
-        send404(connfd);
+        send404(conn);
         return;
     }
 
     TRACE << "sending file of size " << st.st_size << ENDL;
 
     auto filesize = static_cast<uint64_t>(st.st_size); // make format proper for Content-Length header.
-
-    std::filesystem::path p(filename);
-    std::string ext = p.extension().string();
-    TRACE << "requested file has extension " << ext << ENDL;
-    std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c){ return std::tolower(c); });
-
-    std::string contentType = "application/octet-stream"; // fallback (should never see this).
-    if (ext == ".html" || ext == ".htm")  contentType = "text/html; charset=utf-8";
-    else if (ext == ".jpg" || ext == ".jpeg") contentType = "image/jpeg";
-
+    std::string contentType = contentTypeFor(filename);
 
     int filefd = open(filename.c_str(), O_RDONLY);
     if (filefd < 0) {
         ERROR << "open() failed: " << strerror(errno) << ENDL;
-        send404(connfd);
+        send404(conn);
         return;
     }
 
-    sendLine(connfd, "HTTP/1.1 200 OK");
-    sendLine(connfd, "Content-Type: " + contentType); // determine type of file first!
-    sendLine(connfd, "Content-Length: " + std::to_string(filesize));
-    sendLine(connfd, "");
-    //sendLine(connfd, "Bogus Content To Test!");
+    // Miss: read it into the cache now (if it fits) and answer from there.
+    if (contentCache && filesize <= contentCache->maxEntryBytes()) {
+        if (auto cached = contentCache->insert(filename, filefd)) {
+            close(filefd);
+            sendCachedFile(conn, cached);
+            return;
+        }
+    }
 
-    //send file bytes
-    char *buffer = new char[CHUNK_SIZE];
-    uint64_t totalSent = 0;
+    // Not cached: the ETag is remembered per file version (the first request after a change hashes it,
+    // if it's no bigger than a cached file could be).
+    const HttpRequest &req = conn.parser.request();
+    uint64_t hashLimit = contentCache ? contentCache->maxEntryBytes() : ETAG_HASH_MAX_BYTES;
+    std::string etag = etagForFile(filename, filefd, st, hashLimit);
+    std::string lastModified = httpDate(st.st_mtim.tv_sec);
+    std::string validators = validatorLines(etag, lastModified);
 
-    while(totalSent < filesize) {
-        bzero(buffer, CHUNK_SIZE);
+    if (notModified(req, etag, st.st_mtim.tv_sec)) {
+        close(filefd);
+        send304(conn, etag, lastModified, false);
+        return;
+    }
 
-        ssize_t chunkRead = read(filefd, buffer, CHUNK_SIZE);
-        if(chunkRead < 0) {
-            if(errno == EINTR) continue;
-            ERROR << "read() failed while sending file: " << strerror(errno) << ENDL;
-            delete[] buffer;
+    // ranges of an uncached file always stream, from the range's offset rather than byte 0.
+    if (conn.range.present && ifRangeMatches(req, etag, st.st_mtim.tv_sec)) {
+        RangePlan plan;
+        plan.count = resolveRanges(conn.range, filesize, plan.ranges);
+        if (plan.count == 0) {
             close(filefd);
+            send416(conn, filesize, false);
             return;
         }
-        if(chunkRead == 0) {
+        sendStreamedRanges(conn, filefd, contentType, filesize, validators, plan);
+        DEBUG << "streaming " << plan.count << " range(s) of " << filename << ENDL;
+        return;
+    }
+
+    if (filesize > INLINE_BODY_LIMIT) {
+        conn.response.addCopy(buildFileHeader(contentType, filesize, "", false, validators));
+        finishHeaders(conn);
+
+        conn.fileFd = filefd;
+        conn.fileOffset = 0;
+        conn.fileRemaining = filesize;
+        conn.chunkLen = conn.chunkSent = 0;
+        conn.useSendfile = sendfileAvailable;
+        DEBUG << "streaming " << filesize << " byte body via "
+              << (conn.useSendfile ? "sendfile (zero-copy)" : "buffered read/send") << ENDL;
+        return;
+    }
+
+    // Small file (and no cache to put it in): read it in now so it leaves in the same write as the header.
+    std::string body(filesize, '\0');
+    std::size_t got = 0;
+    while (got < filesize) {
+        ssize_t chunkRead = read(filefd, &body[got], filesize - got);
+        if (chunkRead < 0 && errno == EINTR) continue;
+        if (chunkRead <= 0) break;
+        got += static_cast<std::size_t>(chunkRead);
+    }
+    close(filefd);
+
+    if (got < filesize) {
+        ERROR << "could not read " << filename << " (file shrank or read() failed), sending 404 instead" << ENDL;
+        send404(conn);
+        return;
+    }
+
+    conn.response.addCopy(buildFileHeader(contentType, filesize, "", false, validators));
+    finishHeaders(conn);
+    conn.response.addCopy(body);
+}
+
+/*
+    Buffered fallback: pull the next CHUNK_SIZE piece of the file body into conn.chunk.
+    pread at fileOffset so we can take over part way through if sendfile bailed on us.
+    Returns false (response is toast) if the read failed or the file came up short.
+*/
+static bool loadFileChunk(Connection &conn) {
+    while (1) {
+        bzero(conn.chunk, CHUNK_SIZE);
+
+        ssize_t chunkRead = pread(conn.fileFd, conn.chunk, std::min<uint64_t>(CHUNK_SIZE, conn.fileRemaining), conn.fileOffset);
+        if (chunkRead < 0) {
+            if (errno == EINTR) continue;
+            ERROR << "read() failed while sending file: " << strerror(errno) << ENDL;
+            return false;
+        }
+        if (chunkRead == 0) {
+            // we already promised fileRemaining more bytes in Content-Length.
             WARNING << "Unexpected EOF while sending file" << ENDL;
-            break;
+            return false;
+        }
+        conn.chunkLen = static_cast<std::size_t>(chunkRead);
+        conn.chunkSent = 0;
+        conn.fileOffset += chunkRead;
+        conn.fileRemaining -= conn.chunkLen;
+        return true;
+    }
+}
+
+/*
+    err from sendfile(): if it means this kernel/filesystem can't sendfile at all, switch the connection
+    (and everyone after it) over to the buffered path and say so. The body carries on from fileOffset.
+*/
+bool sendfileUnsupported(Connection &conn, int err) {
+    if (err != EINVAL && err != ENOSYS && err != EOPNOTSUPP) return false;
+    WARNING << "sendfile() unavailable (" << strerror(err) << "), falling back to buffered read/send" << ENDL;
+    sendfileAvailable = false;
+    conn.useSendfile = false;
+    return true;
+}
+
+// sendfile() took sent bytes of the body.
+void consumeSendfile(Connection &conn, std::size_t sent) {
+    conn.fileOffset += sent;
+    conn.fileRemaining -= sent;
+    conn.bytesSent += sent;
+}
+
+/*
+    Zero-copy body: let the kernel move the file straight from the page cache to the socket.
+    sendfile can stop short (socket buffer full), so we keep our own offset and just go again.
+    If this kernel/filesystem can't sendfile at all we switch the connection (and everyone after it)
+    over to the buffered path and return STEP_DONE so writeResponse carries on with that.
+*/
+static StepStatus sendFileZeroCopy(Connection &conn) {
+    while (conn.fileRemaining > 0) {
+        if (conn.sendfileWaitMs > 0) {
+            // a blocking sendfile() sits out SO_SNDTIMEO and then reports progress anyway, so the
+            // blocking driver's write deadline has to be checked here. STEP_AGAIN = it ran out.
+            struct pollfd writable = {conn.fd, POLLOUT, 0};
+            int ready = poll(&writable, 1, conn.sendfileWaitMs);
+            if (ready < 0 && errno == EINTR) continue;
+            if (ready == 0) return STEP_AGAIN;
+        }
+        off_t offset = static_cast<off_t>(conn.fileOffset);
+        std::size_t count = static_cast<std::size_t>(std::min<uint64_t>(conn.fileRemaining, SENDFILE_MAX));
+        ssize_t sent = sendfile(conn.fd, conn.fileFd, &offset, count);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return STEP_AGAIN;
+            if (sendfileUnsupported(conn, errno)) return STEP_DONE;
+            if (errno == EPIPE || errno == ECONNRESET) {
+                WARNING << "Client closed connection while sending file." << ENDL;
+            } else {
+                ERROR << "sendfile() failed while sending file: " << strerror(errno) << ENDL;
+            }
+            return STEP_CLOSED;
+        }
+        if (sent == 0) {
+            // we already promised fileRemaining more bytes in Content-Length.
+            WARNING << "Unexpected EOF while sending file" << ENDL;
+            return STEP_CLOSED;
+        }
+        consumeSendfile(conn, static_cast<std::size_t>(sent));
+    }
+    return STEP_DONE;
+}
+
+/*
+    Between pieces of a streamed body: once the current range is all out, queue the next multipart
+    part header and move on to that part's range; once there's nothing left, close the file.
+*/
+void advanceFileBody(Connection &conn) {
+    if (conn.fileRemaining == 0 && conn.nextFilePart < conn.fileParts.size()) {
+        // next range of a multipart body: its part header, then its bytes.
+        const FilePart &part = conn.fileParts[conn.nextFilePart++];
+        conn.response.addCopy(part.prefix);
+        conn.fileOffset = part.offset;
+        conn.fileRemaining = part.length;
+    }
+    if (conn.fileRemaining == 0) {
+        close(conn.fileFd); // need to do this to prevent leak :^)
+        conn.fileFd = -1;
+    }
+}
+
+/*
+    What has to go out next for the queued response(s): the batched responses in conn.response first
+    (as one iovec array), then the streamed file body. On the buffered fallback the body goes a chunk
+    at a time, riding along as the last iovec; otherwise it's a sendfile() once the iovecs are flushed
+    (MSG_MORE holds the header back so it can share a packet with the start of the body).
+    Only reads the file (a buffered chunk), never touches the socket: the driver does the writing and
+    hands the result to consumeWritten / consumeSendfile.
+*/
+void nextWrite(Connection &conn, WriteStep &step) {
+    if (conn.fileFd >= 0 && conn.chunkSent == conn.chunkLen) {
+        advanceFileBody(conn);
+        if (conn.fileFd >= 0 && !conn.useSendfile && !loadFileChunk(conn)) {
+            step.kind = WRITE_FAILED;
+            return;
+        }
+    }
+
+    step.iovCount = conn.response.fillIov(step.iov, MAX_IOVECS);
+    // the chunk can only go along if everything queued in front of it made it into this round.
+    if (conn.chunkSent < conn.chunkLen && static_cast<std::size_t>(step.iovCount) == conn.response.pendingSegments()) {
+        step.iov[step.iovCount].iov_base = conn.chunk + conn.chunkSent;
+        step.iov[step.iovCount++].iov_len = conn.chunkLen - conn.chunkSent;
+    }
+    if (step.iovCount > 0) {
+        step.kind = WRITE_IOV;
+        step.flags = (conn.fileFd >= 0 && conn.useSendfile) ? MSG_MORE : 0;
+        return;
+    }
+    if (conn.fileFd < 0) {
+        step.kind = WRITE_DONE;
+        return;
+    }
+    step.kind = WRITE_SENDFILE;
+    step.sendfileCount = static_cast<std::size_t>(std::min<uint64_t>(conn.fileRemaining, SENDFILE_MAX));
+}
+
+// sendmsg() took sent bytes of a WRITE_IOV step: queued responses first, the rest came out of the chunk.
+void consumeWritten(Connection &conn, std::size_t sent) {
+    conn.bytesSent += sent;
+    std::size_t fromResponse = std::min(sent, conn.response.pendingBytes());
+    conn.response.consume(fromResponse);
+    conn.chunkSent += sent - fromResponse;
+}
+
+/*
+    Push out whatever is queued on the connection (see nextWrite), for the blocking and epoll drivers.
+    Returns STEP_AGAIN if the socket filled up part way through.
+*/
+StepStatus writeResponse(Connection &conn) {
+    while (1) {
+        WriteStep step;
+        nextWrite(conn, step);
+        if (step.kind == WRITE_FAILED) return STEP_CLOSED;
+        if (step.kind == WRITE_DONE) return STEP_DONE;
+        if (step.kind == WRITE_SENDFILE) {
+            // only the body is left, and it's going out zero-copy.
+            StepStatus status = sendFileZeroCopy(conn);
+            if (status != STEP_DONE) return status;
+            continue; // body finished (or we just fell back to buffered), go round again to tidy up.
         }
 
-        ssize_t chunkWritten = 0;
-        while(chunkWritten < chunkRead) {
-            ssize_t written = send(connfd, buffer + chunkWritten, chunkRead - chunkWritten, MSG_NOSIGNAL);
-            if (written < 0) {
-                if (errno == EINTR) continue;
-                if(errno == EPIPE) {
-                    WARNING << "Client closed connection while sending file." << ENDL;
-                }  else {
-                    ERROR << "send() faild while sending file: " << strerror(errno) << ENDL;
-                }
-                delete[] buffer;
-                close(filefd);
-                return;
+        /* sendmsg rather than writev, to include MSG_NOSIGNAL
+           this prevents SIGPIPE (client closed during write) from terminating the process.
+        */
+        struct msghdr msg{};
+        msg.msg_iov = step.iov;
+        msg.msg_iovlen = step.iovCount;
+        ssize_t written = sendmsg(conn.fd, &msg, step.flags | MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return STEP_AGAIN;
+            if (errno == EPIPE) {
+                WARNING << "write() failed: connection closed mid-write." << ENDL;
+                return STEP_CLOSED;
             }
-            chunkWritten += written;
+            ERROR << "sendmsg() failed in writeResponse: " << strerror(errno) << ENDL;
+            return STEP_CLOSED;
         }
+        consumeWritten(conn, static_cast<std::size_t>(written));
+    }
+}
+
+// The counters behind /__stats, added up across every thread right now. Never cached anywhere.
+static void sendStats(Connection &conn) {
+    bool json = (conn.stats == STATS_JSON);
+    std::string body = json ? statsJson() : statsText();
+    sendLine(conn, "HTTP/1.1 200 OK");
+    sendLine(conn, json ? "Content-Type: application/json" : "Content-Type: text/plain; charset=utf-8");
+    sendLine(conn, "Content-Length: " + std::to_string(body.size()));
+    sendLine(conn, "Cache-Control: no-store");
+    finishHeaders(conn);
+    conn.response.addCopy(body);
+}
+
+/*
+    Remember the response just queued: its status, when its request came in and how big it is.
+    With -a this also starts its access log record (everything but how much actually got sent
+    and how long it took, which finishResponses fills in once the batch is done).
+*/
+static void noteResponse(Connection &conn, std::size_t queuedBefore) {
+    PendingAccess &pending = conn.accessPending.emplace_back();
+    pending.start = conn.requestStart;
+    pending.scrape = (conn.stats != STATS_NONE);
+    pending.planned = conn.response.pendingBytes() - queuedBefore + conn.fileRemaining;
+    for (const FilePart &part : conn.fileParts) pending.planned += part.prefix.size() + part.length;
+
+    AccessRecord &record = pending.record;
+    record.status = static_cast<uint16_t>(conn.rtnCode);
+    if (!accessLogOn) return;
 
-        totalSent += static_cast<uint64_t>(chunkRead);
+    if (!conn.peerKnown) {
+        sockaddr_in peer{};
+        socklen_t len = sizeof(peer);
+        if (getpeername(conn.fd, reinterpret_cast<sockaddr*>(&peer), &len) == 0 && peer.sin_family == AF_INET) {
+            conn.peerAddr = peer.sin_addr.s_addr;
+            conn.peerPort = ntohs(peer.sin_port);
+        }
+        conn.peerKnown = true;
     }
 
-    delete[] buffer;
-    close(filefd); // need to do this to prevent leak :^)
+    record.peerAddr = conn.peerAddr;
+    record.peerPort = conn.peerPort;
+    if (conn.keepAlive) record.flags |= ACCESS_KEEPALIVE;
 
+    const HttpRequest &req = conn.parser.request();
+    std::memcpy(record.method, req.method.data(), std::min<std::size_t>(req.method.size(), ACCESS_METHOD_MAX));
+    std::size_t pathLen = std::min<std::size_t>(req.target.size(), ACCESS_PATH_MAX);
+    if (pathLen < req.target.size()) record.flags |= ACCESS_PATH_CUT;
+    std::memcpy(record.path, req.target.data(), pathLen);
+    record.pathLen = static_cast<uint8_t>(pathLen);
 }
 
-void processConnection(int connfd) {
-    std::string filename;
-    int rtnCode = readRequest(connfd, filename);
-    //auto codeString = std::to_string(rtnCode);
-    //sendLine(connfd, codeString); // test response. (works :))
+/*
+    The batch is over (all sent, or the connection is going away): count each response and, with -a,
+    append its access log record. Responses went out in order, so the bytes sent are handed out
+    front to back and anything that came up short is marked aborted.
+*/
+static void finishResponses(Connection &conn) {
+    if (conn.accessPending.empty()) return;
+
+    auto now = std::chrono::steady_clock::now();
+    struct timespec wall;
+    clock_gettime(CLOCK_REALTIME, &wall);
+    uint64_t timeNs = static_cast<uint64_t>(wall.tv_sec) * 1000000000ull + static_cast<uint64_t>(wall.tv_nsec);
 
-    // different responses...
-    switch(rtnCode) {
+    uint64_t left = conn.bytesSent;
+    for (PendingAccess &pending : conn.accessPending) {
+        AccessRecord &record = pending.record;
+        record.bytes = std::min(pending.planned, left);
+        left -= record.bytes;
+        if (record.bytes < pending.planned) record.flags |= ACCESS_ABORTED;
+        record.latencyUs = static_cast<uint32_t>(
+            std::chrono::duration_cast<std::chrono::microseconds>(now - pending.start).count());
+        record.timeNs = timeNs;
+        if (pending.scrape) {
+            countScrape();
+        } else {
+            countResponse(record.status, record.bytes, record.latencyUs);
+        }
+        if (accessLogOn) appendAccess(record);
+    }
+    conn.accessPending.clear();
+}
+
+// different responses...
+static void queueResponse(Connection &conn) {
+    std::size_t queuedBefore = conn.response.pendingBytes();
+    switch(conn.rtnCode) {
         case 404:
-            send404(connfd);
+            send404(conn);
             break;
         case 400:
-            send400(connfd);
+            send400(conn);
+            break;
+        case 414:
+            send414(conn);
+            break;
+        case 431:
+            send431(conn);
+            break;
+        case 503:
+            send503(conn);
             break;
         case 200:
-            sendFile(connfd, filename);
+            if (conn.stats != STATS_NONE) {
+                sendStats(conn);
+            } else {
+                sendFile(conn, conn.filename);
+            }
             break;
         default:
-            WARNING << "[processConnection] Somehow we got an unhandled rtnCode: " << rtnCode << ENDL;
-            send400(connfd);
+            WARNING << "[queueResponse] Somehow we got an unhandled rtnCode: " << conn.rtnCode << ENDL;
+            send400(conn);
+    }
+    noteResponse(conn, queuedBefore);
+}
+
+Connection::~Connection() {
+    finishResponses(*this); // whatever didn't finish before the connection closed
+    if (fileFd >= 0) close(fileFd);
+    countConnectionClosed();
+}
+
+// Forget the request we just answered (the queued response, and whether the connection stays open, stay put).
+static void clearRequest(Connection &conn) {
+    conn.filename.clear();
+    conn.rtnCode = 400;
+    conn.acceptedCodings = CODING_BIT(CODING_IDENTITY);
+    conn.range.present = false;
+    conn.stats = STATS_NONE;
+    conn.headerDeadline = {}; // the next one's clock starts with its first byte
+}
+
+/*
+    Queue the response to the request readRequest just finished, then keep going through any
+    requests the client already pipelined in behind it, so all their responses leave in one write.
+    We stop batching at a response that streams a file from disk or closes the connection,
+    or once the batch is big enough that it isn't worth holding back any longer.
+*/
+void queueResponses(Connection &conn) {
+    conn.state = CONN_WRITING;
+    while (1) {
+        queueResponse(conn);
+        if (!conn.keepAlive || conn.fileFd >= 0) return;
+        if (conn.response.pendingBytes() >= MAX_BATCH_BYTES || conn.response.pendingSegments() >= MAX_IOVECS - 4) return;
+
+        clearRequest(conn);
+        if (!parseBufferedRequest(conn)) return; // (a partial next request just waits in the parser)
+        TRACE << "batching response to pipelined request" << ENDL;
+    }
+}
+
+/*
+    Get the connection ready for the next request on it.
+    The receive buffer is deliberately kept: anything past the end of the last header belongs to the next request.
+*/
+void resetRequest(Connection &conn) {
+    finishResponses(conn);
+    conn.bytesSent = 0;
+    conn.state = CONN_READING;
+    clearRequest(conn);
+    conn.response.clear();
+    conn.fileOffset = 0;
+    conn.fileRemaining = 0;
+    conn.chunkLen = conn.chunkSent = 0;
+    conn.fileParts.clear();
+    conn.nextFilePart = 0;
+}
+
+/*
+    Blocking driver: with a blocking fd every step just runs to completion.
+    There's no timer wheel here, the socket timeouts stand in for it: SO_RCVTIMEO turns a client that
+    goes quiet into an EAGAIN from read(), which readRequest reports as STEP_AGAIN, and SO_SNDTIMEO
+    does the same for one that stops taking the response. Either way we hang up. A header trickling
+    in byte by byte is caught by readRequest itself.
+*/
+void processConnection(int connfd, std::chrono::steady_clock::time_point acceptedAt) {
+    struct timeval idle;
+    idle.tv_sec = std::min(keepAliveTimeout, headerTimeout);
+    idle.tv_usec = 0;
+    if (setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle)) < 0) {
+        WARNING << "setsockopt(SO_RCVTIMEO) failed: " << strerror(errno) << ENDL;
+    }
+    struct timeval stalled;
+    stalled.tv_sec = writeTimeout;
+    stalled.tv_usec = 0;
+    if (setsockopt(connfd, SOL_SOCKET, SO_SNDTIMEO, &stalled, sizeof(stalled)) < 0) {
+        WARNING << "setsockopt(SO_SNDTIMEO) failed: " << strerror(errno) << ENDL;
+    }
+
+    Connection conn(connfd);
+    conn.sendfileWaitMs = writeTimeout * 1000;
+    // the wait in the pool's queue counts if the request was already there by the time we got to it
+    // (a client that's slow to start sending was keeping itself waiting). Nothing queues behind a
+    // connection's own thread after that.
+    struct pollfd waiting = {connfd, POLLIN, 0};
+    if (poll(&waiting, 1, 0) > 0) conn.readyAt = acceptedAt;
+    while (1) {
+        StepStatus status = readRequest(conn);
+        if (status == STEP_AGAIN) {
+            // mid-request (or still waiting for the first one) it's the header deadline, otherwise just idle.
+            bool header = conn.headerDeadline != std::chrono::steady_clock::time_point{};
+            DEBUG << "connection " << (header ? "sent no complete request" : "idle") << " for " << idle.tv_sec << "s, closing" << ENDL;
+            countTimeout(header ? TIMEOUT_HEADER : TIMEOUT_IDLE);
+            return;
+        }
+        if (status != STEP_DONE) return;
+
+        queueResponses(conn);
+        conn.readyAt = {};
+        status = writeResponse(conn);
+        if (status == STEP_AGAIN) {
+            DEBUG << "client took none of the response for " << writeTimeout << "s, closing" << ENDL;
+            countTimeout(TIMEOUT_WRITE);
+            return;
+        }
+        if (status != STEP_DONE || !conn.keepAlive) return;
+
+        resetRequest(conn);
     }
 }
 
+/*
+    Create a TCP socket and bind it to servaddr.
+    With reusePort the socket sets SO_REUSEPORT first so several of them can share the port.
+    Returns -1 with errno set if the bind didn't work out.
+*/
+static int bindSocket(const sockaddr_in &servaddr, bool reusePort) {
+    // Create the socket - it makes an oldschool typeless file descriptor thingy
+    int fd = -1;
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        FATAL << "Failed to create listening socket " << strerror(errno) << ENDL;
+        exit(-1);
+    }
+
+    int on = 1;
+    if (reusePort && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+        FATAL << "setsockopt(SO_REUSEPORT) failed: " << strerror(errno) << ENDL;
+        exit(-1);
+    }
+
+    // Bind it
+    // the goofy (sockaddr*) &servaddr is a type cast to something broad, part of that weird psuedo-polymorphism thing.
+    // "Notice that bind(…) uses the generic sockaddr type, but we filled in an Internet style address (sockaddr_in)."
+    if (bind(fd, (sockaddr*) &servaddr, sizeof(servaddr)) < 0) {
+        int bindErrno = errno;
+        close(fd);
+        errno = bindErrno;
+        return -1;
+    }
+    return fd;
+}
+
+/*
+    Starting at `port`, walk upwards until we find a port that every one of the `count` listeners can bind.
+    With more than one listener we first make sure nobody else holds the port (a plain bind, no SO_REUSEPORT),
+    otherwise we could end up sharing it with some other process that also set SO_REUSEPORT.
+    If any shard can't get the port they all let go of it and we move on to the next one,
+    so every shard always ends up on the same port.
+*/
+static std::vector<int> bindListeners(unsigned count, int &port) {
+    // Configure da socket.
+    struct sockaddr_in servaddr;
+    bzero(&servaddr, sizeof(servaddr)); // Zero it out.
+    servaddr.sin_family = AF_INET; // ipv4
+    servaddr.sin_addr.s_addr = htonl(INADDR_ANY); // listen on everything
+
+    std::vector<int> fds;
+    for (;; port++) {
+        servaddr.sin_port = htons(port);
+
+        if (count > 1) {
+            int probe = bindSocket(servaddr, false);
+            if (probe < 0) {
+                if (errno == EADDRINUSE) continue;
+                FATAL << "bind() failed: " << strerror(errno) << ENDL;
+                exit(-1);
+            }
+            close(probe);
+        }
+
+        while (fds.size() < count) {
+            int fd = bindSocket(servaddr, count > 1);
+            if (fd < 0) break;
+            fds.push_back(fd);
+        }
+        if (fds.size() == count) return fds;
+
+        if (errno != EADDRINUSE) {
+            FATAL << "bind() failed: " << strerror(errno) << ENDL;
+            exit(-1);
+        }
+        TRACE << "port " << port << " taken, trying the next one" << ENDL;
+        for (int fd : fds) close(fd);
+        fds.clear();
+    }
+}
+
+/*
+    Logging is asynchronous, so a plain SIGINT/SIGTERM would take whatever is still sitting in the
+    log rings down with the process. Instead every thread has them blocked and this one thread
+    waits for them, lets the log writer empty out, and only then exits.
+*/
+static void startShutdownWatcher() {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr); // (inherited by every thread started after this)
+
+    std::thread([signals]() {
+        int sig = 0;
+        sigwait(&signals, &sig);
+        INFO << "caught " << strsignal(sig) << ", shutting down" << ENDL;
+        flushLogs();
+        _exit(128 + sig);
+    }).detach();
+}
+
+static void usage(const char *prog) {
+    std::cout << "useage: " << prog << " -d LOG_LEVEL -m epoll|block|pool|shard|uring|coro -t THREADS"
+              << " -k KEEPALIVE_SECONDS -r MAX_REQUESTS_PER_CONNECTION -c CACHE_MB"
+              << " -l MAX_REQUEST_LINE -n MAX_HEADERS -b MAX_HEADER_BYTES -p assignment|web|any"
+              << " -i INDEX_SCAN_THREADS -w drop|block -a ACCESS_LOG_FILE -H HEADER_TIMEOUT_SECONDS"
+              << " -W WRITE_TIMEOUT_SECONDS -q LISTEN_BACKLOG -s SHED_TARGET_MS -S SHED_INTERVAL_MS" << std::endl;
+    exit(-1);
+}
+
+// numeric option that has to be >= min, anything else gets the usage message.
+static int numericArg(const char *arg, const char *prog, int min = 1) {
+    try {
+        int value = std::stoi(arg);
+        if (value >= min) return value;
+    } catch (const std::exception&) {
+        // fall through to usage
+    }
+    usage(prog);
+    return -1;
+}
 
 int main(int argc, char *argv[]) {
 
+    // sendfile() has no MSG_NOSIGNAL, so a client hanging up mid-body would SIGPIPE us otherwise.
+    signal(SIGPIPE, SIG_IGN);
+    startShutdownWatcher();
+
     // Process cl args (taken from template)
     int opt = 0;
-    while ((opt = getopt(argc, argv, "d:")) != -1) {
+    std::string mode = "epoll"; // epoll reactor by default, "block" is the old accept -> process loop.
+    unsigned threadCount = ThreadPool::defaultThreadCount(); // workers for -m pool, reactors for -m shard, schedulers for -m coro
+    int cacheMegabytes = DEFAULT_CACHE_MB; // 0 turns the content cache off
+    int indexThreads = static_cast<int>(threadCount); // threads scanning webRoot at startup, 0 turns the index off
+    std::string accessLogPath; // binary access log, none unless -a is given
+    int listenBacklog = DEFAULT_LISTEN_BACKLOG; // connections the kernel holds for us until we accept them
+    while ((opt = getopt(argc, argv, "d:m:t:k:r:c:l:n:b:p:i:w:a:H:W:q:s:S:")) != -1) {
 
         switch (opt) {
+        case 'm':
+            mode = optarg;
+            if (mode != "epoll" && mode != "block" && mode != "pool" && mode != "shard" && mode != "uring"
+                && mode != "coro") usage(argv[0]);
+            break;
+        case 't':
+            threadCount = static_cast<unsigned>(numericArg(optarg, argv[0]));
+            break;
+        case 'k':
+            keepAliveTimeout = numericArg(optarg, argv[0]);
+            break;
+        case 'r':
+            keepAliveMax = numericArg(optarg, argv[0]);
+            break;
+        case 'H':
+            headerTimeout = numericArg(optarg, argv[0]);
+            break;
+        case 'W':
+            writeTimeout = numericArg(optarg, argv[0]);
+            break;
+        case 'q':
+            listenBacklog = numericArg(optarg, argv[0]);
+            break;
+        case 's':
+            shedTargetMs = numericArg(optarg, argv[0], 0);
+            break;
+        case 'S':
+            shedIntervalMs = numericArg(optarg, argv[0]);
+            break;
+        case 'c':
+            cacheMegabytes = numericArg(optarg, argv[0], 0);
+            break;
+        case 'l':
+            parserLimits.maxRequestLine = numericArg(optarg, argv[0]);
+            break;
+        case 'n':
+            parserLimits.maxHeaders = numericArg(optarg, argv[0]);
+            if (parserLimits.maxHeaders > MAX_HEADER_COUNT) usage(argv[0]);
+            break;
+        case 'b':
+            parserLimits.maxHeaderBytes = numericArg(optarg, argv[0], 64);
+            break;
+        case 'w':
+            if (std::string(optarg) == "drop") {
+                LOG_FULL_POLICY = LOG_DROP;
+            } else if (std::string(optarg) == "block") {
+                LOG_FULL_POLICY = LOG_BLOCK;
+            } else {
+                usage(argv[0]);
+            }
+            break;
+        case 'a':
+            accessLogPath = optarg;
+            break;
+        case 'i':
+            indexThreads = numericArg(optarg, argv[0], 0);
+            break;
+        case 'p':
+            activeFilePolicy = findFilePolicy(optarg);
+            if (!activeFilePolicy) usage(argv[0]);
+            break;
         case 'd':
             try {
                 LOG_LEVEL = std::stoi(optarg);
@@ -309,75 +1222,121 @@ int main(int argc, char *argv[]) {
         case ':':
         case '?':
         default:
-            std::cout << "useage: " << argv[0] << " -d LOG_LEVEL" << std::endl;
-            exit(-1);
+            usage(argv[0]);
         }
     }
 
-    // Create the socket - it makes an oldschool typeless file descriptor thingy
-    TRACE << "init: calling socket()" << ENDL;
-    int listenFd = -1;
-    if ((listenFd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        FATAL << "Failed to create listening socket " << strerror(errno) << ENDL;
+    if (LOG_LEVEL > LOG_COMPILED_LEVEL) {
+        WARNING << "-d " << LOG_LEVEL << " asked for, but this build only has messages up to level "
+                << LOG_COMPILED_LEVEL << " (make LOG_COMPILED_LEVEL=6 for all of them)" << ENDL;
+    }
+
+    buildPrebuiltResponses(); // (needs -k)
+
+    if (!accessLogPath.empty() && !openAccessLog(accessLogPath)) {
+        FATAL << "could not start the access log at " << accessLogPath << ENDL;
         exit(-1);
     }
 
-    // Configure da socket.
-    struct sockaddr_in servaddr;
-    bzero(&servaddr, sizeof(servaddr)); // Zero it out.
-    servaddr.sin_family = AF_INET; // ipv4
-    servaddr.sin_addr.s_addr = htonl(INADDR_ANY); // listen on everything
+    setupFileServices(cacheMegabytes, indexThreads);
+
+    // shard/coro: one listener per reactor (or scheduler) thread, all sharing the port through SO_REUSEPORT.
+    unsigned listenerCount = (mode == "shard" || mode == "coro") ? threadCount : 1;
 
     // track if we got the port (for attempt looping)
-    TRACE << "init: attempting to bind socket." << ENDL;
+    TRACE << "init: attempting to bind " << listenerCount << " socket(s)." << ENDL;
 
     int port = DEFAULT_PORT;
-    while(1) {
-        servaddr.sin_port = htons(port);
+    std::vector<int> listenFds = bindListeners(listenerCount, port);
 
-        // Bind it
-        // the goofy (sockaddr*) &servaddr is a type cast to something broad, part of that weird psuedo-polymorphism thing.
-        // "Notice that bind(…) uses the generic sockaddr type, but we filled in an Internet style address (sockaddr_in)."
-        if(bind(listenFd, (sockaddr*) &servaddr, sizeof(servaddr)) < 0) {
+    //INFO << "bound to port " << port << ENDL;
+    // Instead: going to always print bound port regardless of logging mode...
+    std::cout << "bound to port " << port << std::endl;
 
-            if(errno == EADDRINUSE) {
-                port += 1;
-                continue;
-            }
+    TRACE << "init: Configuring listen() " << ENDL;
 
-            FATAL << "bind() failed: " << strerror(errno) << ENDL;
+    // Create the listening queue and link it with socket.
+    for (int fd : listenFds) {
+        if (listen(fd, listenBacklog) < 0) {
+            FATAL << "listen() failed: " << strerror(errno) << ENDL;
             exit(-1);
         }
+    }
+    int listenFd = listenFds[0];
 
-        //INFO << "bound to port " << port << ENDL;
-        // Instead: going to always print bound port regardless of logging mode...
-        std::cout << "bound to port " << port << std::endl;
+    // Wait for connection w/ accept call. Da bigol' server loop
 
-        break;
+    if (mode == "shard") {
+        TRACE << "init: starting " << listenFds.size() << " pinned reactor shards" << ENDL;
+        runShards(listenFds);
+        return 0;
     }
 
-    TRACE << "init: Configuring listen() " << ENDL;
+    if (mode == "coro") {
+        TRACE << "init: starting " << listenFds.size() << " coroutine schedulers" << ENDL;
+        runCoroSchedulers(listenFds);
+        return 0;
+    }
 
-    // Create the listening queue and link it with socket.
-    int queuedepth = 1;
-    if (listen(listenFd, queuedepth) < 0) {
-        FATAL << "listen() failed: " << strerror(errno) << ENDL;
-        exit(-1);
+    if (mode == "uring") {
+        TRACE << "init: now entering io_uring loop" << ENDL;
+        auto loop = std::make_unique<UringLoop>(listenFd);
+        if (loop->ready()) loop->run();
+        WARNING << "io_uring isn't usable here, falling back to the epoll reactor" << ENDL;
+        loop.reset();
+        mode = "epoll";
     }
 
-    // Wait for connection w/ accept call. Da bigol' server loop
+    if (mode == "epoll") {
+        TRACE << "init: now entering event loop (epoll reactor)" << ENDL;
+        EventLoop loop(listenFd);
+        loop.run();
+        return 0;
+    }
+
+    // pool: main just accepts and hands the fd off, the workers do the (blocking) processConnection.
+    std::unique_ptr<ThreadPool> pool;
+    if (mode == "pool") pool = std::make_unique<ThreadPool>(threadCount);
 
     TRACE << "init: now entering main loop (wait and accept() cycle)" << ENDL;
 
+    // the listener goes non-blocking so every wakeup takes all that's queued (accept4 until EAGAIN).
+    // The connections stay blocking, accept4 doesn't hand O_NONBLOCK on.
+    if (!setNonBlocking(listenFd)) {
+        FATAL << "failed to make listening socket non-blocking: " << strerror(errno) << ENDL;
+        exit(-1);
+    }
+    struct pollfd listening = {listenFd, POLLIN, 0};
+
     while(1) {
-        int connfd = -1;
-        // Accept blocks until we actually have a connection.
-        if((connfd = accept(listenFd, (sockaddr*) NULL, NULL)) < 0) {
-            FATAL << "accept() failed: " << strerror(errno) << ENDL;
+        // poll blocks until we actually have a connection.
+        if (poll(&listening, 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            FATAL << "poll() failed: " << strerror(errno) << ENDL;
             exit(-1);
-        } 
+        }
+        // (block: the later ones in the batch queue behind the earlier ones, that's their delay too)
+        auto acceptedAt = std::chrono::steady_clock::now();
+
+        while (1) {
+            int connfd = accept4(listenFd, (sockaddr*) NULL, NULL, SOCK_CLOEXEC);
+            if (connfd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                FATAL << "accept() failed: " << strerror(errno) << ENDL;
+                exit(-1);
+            }
 
-        processConnection(connfd);
-        close(connfd);
+            if (pool) {
+                pool->submit([connfd, acceptedAt] {
+                    processConnection(connfd, acceptedAt);
+                    close(connfd);
+                });
+                continue;
+            }
+
+            processConnection(connfd, acceptedAt);
+            close(connfd);
+        }
     }
-}
\ No newline at end of file
+}
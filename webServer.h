@@ -1,11 +1,15 @@
 #ifndef HEADER_H
-#define HEADER_H 
+#define HEADER_H
 
 #include <iostream>
 #include <fstream>
-#include <regex>
 #include <string>
 #include <sstream> // for istrngstream stuff
+#include <vector>
+#include <algorithm>
+#include <filesystem>
+#include <chrono>
+#include <memory>
 
 #include <string.h>
 #include <unistd.h>
@@ -13,9 +17,20 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 
 #include "logging.h"
+#include "responseBuilder.h"
+#include "httpParser.h"
+#include "fileValidator.h"
+#include "compression.h"
+#include "httpRange.h"
+#include "conditional.h"
+#include "accessLog.h"
+#include "metrics.h"
+#include "timerWheel.h"
+#include "overload.h"
 
 #include <strings.h> // for bzero
 #include <errno.h> // for errno
@@ -33,7 +48,160 @@ constexpr std::size_t termLen = 2; // im just gonna be lazy and manually define
 
 #define DEFAULT_PORT 1993
 #define CHUNK_SIZE 10
+#define INLINE_BODY_LIMIT (16 * 1024) // uncached files up to this size get read in and sent along with the header
+#define MAX_BATCH_BYTES (64 * 1024)   // stop batching pipelined responses once this much is queued
+#define SENDFILE_MAX (1024 * 1024)    // most we hand sendfile() in one call, so one big file can't hog a reactor
+
+#define DEFAULT_KEEPALIVE_TIMEOUT 5   // seconds a persistent connection may sit idle between requests
+#define DEFAULT_KEEPALIVE_MAX 100     // requests served on one connection before we close it
+#define DEFAULT_HEADER_TIMEOUT 10     // seconds a request header may take to arrive, once it's started
+#define DEFAULT_WRITE_TIMEOUT 30      // seconds a response may go without the client taking any of it
+
+// <cwd>/data, everything we serve lives under here.
+extern const std::filesystem::path webRoot;
+
+// set from the command line in main() before any connection is served, read-only after that.
+inline int keepAliveTimeout = DEFAULT_KEEPALIVE_TIMEOUT;
+inline int keepAliveMax = DEFAULT_KEEPALIVE_MAX;
+inline int headerTimeout = DEFAULT_HEADER_TIMEOUT;
+inline int writeTimeout = DEFAULT_WRITE_TIMEOUT;
 
 //inline int BUFFER_SIZE = 10;
 
+/*
+    Result of one step of work on a connection.
+    With a blocking fd a step always runs to STEP_DONE (or STEP_CLOSED),
+    with a non-blocking fd it can stop early with STEP_AGAIN and be resumed
+    later once epoll says the socket is ready again.
+*/
+enum StepStatus {
+    STEP_DONE,   // finished this phase (request fully read / response fully sent)
+    STEP_AGAIN,  // socket would block, call again when it is ready
+    STEP_CLOSED  // peer went away or a hard error, just close the fd
+};
+
+enum ConnState {
+    CONN_READING,
+    CONN_WRITING
+};
+
+// One more piece of a streamed body: `prefix` goes out first, then `length` bytes of the file from `offset`.
+struct FilePart {
+    std::string prefix;
+    uint64_t offset;
+    uint64_t length;
+};
+
+// Is the request for /__stats rather than a file, and in which format?
+enum StatsFormat {
+    STATS_NONE,
+    STATS_TEXT,
+    STATS_JSON
+};
+
+/*
+    A response that's queued but not sent yet. Once it's out (or the connection gave up on it) it's
+    counted for /__stats and, with -a, its access log record is finished off and appended.
+*/
+struct PendingAccess {
+    AccessRecord record;
+    uint64_t planned;      // bytes the whole response comes to
+    std::chrono::steady_clock::time_point start;
+    bool scrape = false;   // a /__stats response, which stays out of the numbers it reports
+};
+
+/*
+    Everything we need to remember about a client between steps.
+    The blocking and the epoll drivers both work on this, so the request/response
+    logic only exists once.
+*/
+struct Connection {
+    int fd = -1;
+    ConnState state = CONN_READING;
+
+    // request side
+    RecvBuffer recv;       // bytes read off the socket that haven't been consumed by a request yet.
+    HttpParser parser;
+    std::string filename;
+    int rtnCode = 400;
+    bool keepAlive = false;  // does the connection stay open after this response?
+    unsigned acceptedCodings = CODING_BIT(CODING_IDENTITY); // from Accept-Encoding, see compression.h
+    RangeRequest range;      // from Range, range.present is false if there wasn't one (or we ignore it)
+    StatsFormat stats = STATS_NONE;
+    int requestCount = 0;    // requests seen on this connection so far
+    // when the driver found out there was work for this connection, for the queueing delay (see overload.h). {} if we don't know.
+    std::chrono::steady_clock::time_point readyAt;
+    // when the request being read has to be complete by, from its first byte (from accept for the first one).
+    std::chrono::steady_clock::time_point headerDeadline = std::chrono::steady_clock::now() + std::chrono::seconds(headerTimeout);
+
+    // the reactors' deadline for whatever the connection is waiting on right now (see armDeadline)
+    TimerNode timer;
+    TimeoutKind timeoutKind = TIMEOUT_IDLE;
+
+    // response side
+    ResponseBuilder response; // every batched response waiting to go out, as iovec segments.
+    int fileFd = -1;       // body still being streamed from disk (if any).
+    bool useSendfile = true; // zero-copy body, or the buffered read/send fallback below.
+    int sendfileWaitMs = 0;  // blocking driver: how long the socket gets to take more body (0 = don't wait, non-blocking)
+    uint64_t fileOffset = 0;
+    uint64_t fileRemaining = 0;
+    char chunk[CHUNK_SIZE];
+    std::size_t chunkLen = 0, chunkSent = 0;
+    // multipart/byteranges from disk: what comes after the range being streamed right now.
+    std::vector<FilePart> fileParts;
+    std::size_t nextFilePart = 0;
+
+    // the responses in the current batch, for /__stats and the access log (the peer only with -a).
+    std::chrono::steady_clock::time_point requestStart;
+    std::vector<PendingAccess> accessPending;
+    uint64_t bytesSent = 0;  // by writeResponse since the last resetRequest
+    bool peerKnown = false;
+    uint32_t peerAddr = 0;
+    uint16_t peerPort = 0;
+
+    explicit Connection(int connfd) : fd(connfd) { countConnectionOpened(); }
+    ~Connection();
+};
+
+// What a driver has to put on the wire next for a connection's response, see nextWrite().
+enum WriteKind {
+    WRITE_DONE,      // all of it is out
+    WRITE_IOV,       // sendmsg() iov[0..iovCount) with flags (| MSG_NOSIGNAL)
+    WRITE_SENDFILE,  // sendfile() sendfileCount bytes of conn.fileFd from conn.fileOffset
+    WRITE_FAILED     // the body couldn't be read from disk (already logged), give up on the connection
+};
+
+struct WriteStep {
+    WriteKind kind = WRITE_DONE;
+    struct iovec iov[MAX_IOVECS + 1]; // (+1 for the buffered body chunk)
+    int iovCount = 0;
+    int flags = 0;
+    std::size_t sendfileCount = 0;
+};
+
+/*
+    The content cache (-c, 0 for none) and the file index of webRoot (-i threads, 0 for none).
+    Set up once by main() before any connection is served; anything from an earlier call is thrown away.
+*/
+void setupFileServices(int cacheMegabytes, int indexThreads);
+
+bool check_for_file(std::string_view reqPath, std::string &resolvedPath);
+bool is_file_valid(const std::string &filename);
+void sendLine(Connection &conn, const std::string &stringToSend);
+void sendFile(Connection &conn, const std::string &filename);
+std::string contentTypeFor(const std::string &filename);
+bool parseBufferedRequest(Connection &conn);
+bool headerTimedOut(Connection &conn);
+void armDeadline(TimerWheel &timers, Connection &conn, void *owner, bool writing);
+StepStatus readRequest(Connection &conn);
+void queueResponses(Connection &conn);
+void nextWrite(Connection &conn, WriteStep &step);
+void consumeWritten(Connection &conn, std::size_t sent);
+void consumeSendfile(Connection &conn, std::size_t sent);
+bool sendfileUnsupported(Connection &conn, int err);
+StepStatus writeResponse(Connection &conn);
+void advanceFileBody(Connection &conn);
+void resetRequest(Connection &conn);
+void processConnection(int connfd, std::chrono::steady_clock::time_point acceptedAt = {});
+
 #endif